@@ -341,8 +341,12 @@ PRODUCT_PACKAGES += \
     libsensorndkbridge \
     libshim_sensors
 
+PRODUCT_PACKAGES_DEBUG += \
+    sensors.camellia-replay
+
 PRODUCT_COPY_FILES += \
-    $(LOCAL_PATH)/configs/hals.conf:$(TARGET_COPY_OUT_VENDOR)/etc/sensors/hals.conf
+    $(LOCAL_PATH)/configs/hals.conf:$(TARGET_COPY_OUT_VENDOR)/etc/sensors/hals.conf \
+    $(LOCAL_PATH)/configs/sensor_patches.conf:$(TARGET_COPY_OUT_VENDOR)/etc/sensors/sensor_patches.conf
 
 # Shipping API level
 PRODUCT_SHIPPING_API_LEVEL := 30
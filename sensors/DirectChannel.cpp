@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DirectChannel.h"
+
+#include <log/log.h>
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+using ::android::hardware::sensors::V1_0::SensorFlagBits;
+using ::android::hardware::sensors::V1_0::SensorsEventFormatOffset;
+using ::android::hardware::sensors::V1_0::SharedMemType;
+
+namespace {
+
+constexpr size_t offsetOf(SensorsEventFormatOffset offset) {
+    return static_cast<size_t>(offset);
+}
+
+template <typename T>
+void writeField(uint8_t* slot, SensorsEventFormatOffset offset, T value) {
+    memcpy(slot + offsetOf(offset), &value, sizeof(value));
+}
+
+}  // namespace
+
+DirectChannel::DirectChannel(const SharedMemInfo& mem)
+    : mMemoryHandle(native_handle_clone(mem.memoryHandle.getNativeHandle())), mMemInfo(mem) {
+    mMemInfo.memoryHandle = mMemoryHandle;
+}
+
+DirectChannel::~DirectChannel() {
+    setOwner(kNoOwner);
+    if (mMemoryHandle != nullptr) {
+        native_handle_close(mMemoryHandle);
+        native_handle_delete(mMemoryHandle);
+    }
+}
+
+DirectChannel::RateLevel DirectChannel::getMaxEmulatedRateLevel(const SensorInfo& sensor) {
+    if ((sensor.flags &
+         (SensorFlagBits::MASK_DIRECT_REPORT | SensorFlagBits::MASK_DIRECT_CHANNEL)) != 0 ||
+        (sensor.flags & SensorFlagBits::WAKE_UP) != 0 ||
+        (sensor.flags & SensorFlagBits::MASK_REPORTING_MODE) !=
+                static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE) ||
+        sensor.minDelay <= 0) {
+        return RateLevel::STOP;
+    }
+    int64_t minDelayNs = static_cast<int64_t>(sensor.minDelay) * 1000;
+    for (RateLevel rate : {RateLevel::VERY_FAST, RateLevel::FAST, RateLevel::NORMAL}) {
+        if (minDelayNs <= getRateLevelPeriodNs(rate)) {
+            return rate;
+        }
+    }
+    return RateLevel::STOP;
+}
+
+int64_t DirectChannel::getRateLevelPeriodNs(RateLevel rate) {
+    switch (rate) {
+        case RateLevel::NORMAL:
+            return 20000000;  // 50 Hz
+        case RateLevel::FAST:
+            return 5000000;  // 200 Hz
+        case RateLevel::VERY_FAST:
+            return 1250000;  // 800 Hz
+        default:
+            return 0;
+    }
+}
+
+bool DirectChannel::setOwner(int32_t owner, int32_t subHalChannelHandle) {
+    if (mBase != nullptr && owner != kProxyOwner) {
+        munmap(mBase, mMemInfo.size);
+        mBase = nullptr;
+    }
+    if (owner == kProxyOwner && mBase == nullptr) {
+        if (mMemInfo.type != SharedMemType::ASHMEM || mMemoryHandle == nullptr ||
+            mMemoryHandle->numFds < 1) {
+            return false;
+        }
+        void* base = mmap(nullptr, mMemInfo.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          mMemoryHandle->data[0], 0);
+        if (base == MAP_FAILED) {
+            ALOGE("Failed to map direct channel memory: %s", strerror(errno));
+            return false;
+        }
+        mBase = static_cast<uint8_t*>(base);
+        mNumSlots = mMemInfo.size / offsetOf(SensorsEventFormatOffset::TOTAL_LENGTH);
+        mNextSlot = 0;
+        mCounter = 0;
+    }
+    mOwner = owner;
+    mSubHalChannelHandle = subHalChannelHandle;
+    return true;
+}
+
+void DirectChannel::setNativeReport(int32_t sensorHandle, RateLevel rate) {
+    if (rate == RateLevel::STOP) {
+        mNativeSensors.erase(sensorHandle);
+    } else {
+        mNativeSensors.insert(sensorHandle);
+    }
+}
+
+int32_t DirectChannel::setEmulatedReport(int32_t sensorHandle, RateLevel rate) {
+    if (rate == RateLevel::STOP) {
+        mEmulatedReports.erase(sensorHandle);
+        return 0;
+    }
+    auto iter = mEmulatedReports.find(sensorHandle);
+    if (iter == mEmulatedReports.end()) {
+        iter = mEmulatedReports
+                       .emplace(sensorHandle,
+                                EmulatedReport{mNextReportToken++, 0,
+                                               std::numeric_limits<int64_t>::min() / 2})
+                       .first;
+    }
+    iter->second.periodNs = getRateLevelPeriodNs(rate);
+    return iter->second.token;
+}
+
+std::vector<int32_t> DirectChannel::clearEmulatedReports() {
+    std::vector<int32_t> sensorHandles;
+    for (const auto& reportEntry : mEmulatedReports) {
+        sensorHandles.push_back(reportEntry.first);
+    }
+    mEmulatedReports.clear();
+    return sensorHandles;
+}
+
+int64_t DirectChannel::getEmulatedReportPeriodNs(int32_t sensorHandle) const {
+    auto iter = mEmulatedReports.find(sensorHandle);
+    return iter == mEmulatedReports.end() ? 0 : iter->second.periodNs;
+}
+
+void DirectChannel::write(const Event& event) {
+    auto iter = mEmulatedReports.find(event.sensorHandle);
+    if (iter == mEmulatedReports.end() || mBase == nullptr || mNumSlots == 0) {
+        return;
+    }
+    // The sensor may be sampled faster for the framework or another channel, so events are
+    // decimated to about the rate of the report.
+    EmulatedReport& report = iter->second;
+    if (event.timestamp - report.lastTimestampNs < report.periodNs * 7 / 8) {
+        return;
+    }
+    report.lastTimestampNs = event.timestamp;
+
+    uint8_t* slot = mBase + mNextSlot * offsetOf(SensorsEventFormatOffset::TOTAL_LENGTH);
+    writeField(slot, SensorsEventFormatOffset::SIZE_FIELD,
+               static_cast<int32_t>(offsetOf(SensorsEventFormatOffset::TOTAL_LENGTH)));
+    writeField(slot, SensorsEventFormatOffset::REPORT_TOKEN, report.token);
+    writeField(slot, SensorsEventFormatOffset::SENSOR_TYPE, static_cast<int32_t>(event.sensorType));
+    writeField(slot, SensorsEventFormatOffset::TIMESTAMP, event.timestamp);
+    memcpy(slot + offsetOf(SensorsEventFormatOffset::DATA), event.u.data.data(),
+           offsetOf(SensorsEventFormatOffset::RESERVED) - offsetOf(SensorsEventFormatOffset::DATA));
+    // Readers consider an event valid once its counter changes, so it's published last.
+    if (++mCounter == 0) {
+        mCounter = 1;
+    }
+    __atomic_store_n(reinterpret_cast<uint32_t*>(
+                             slot + offsetOf(SensorsEventFormatOffset::ATOMIC_COUNTER)),
+                     mCounter, __ATOMIC_RELEASE);
+    mNextSlot = (mNextSlot + 1) % mNumSlots;
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/sensors/2.1/types.h>
+#include <cutils/native_handle.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * A direct channel registered with the HalProxy.
+ *
+ * Only one writer may fill the shared memory of a channel, so a channel is owned either by one
+ * subhal, with which its memory is registered, or by the proxy itself. The proxy writes the events
+ * of the sensors whose direct report it emulates, which must be in ashmem channels. Ownership can
+ * only change while no report is configured on the channel.
+ *
+ * Not thread safe, the HalProxy serializes access.
+ */
+class DirectChannel {
+  public:
+    using Event = ::android::hardware::sensors::V2_1::Event;
+    using RateLevel = ::android::hardware::sensors::V1_0::RateLevel;
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+    using SharedMemInfo = ::android::hardware::sensors::V1_0::SharedMemInfo;
+
+    //! The owner of a channel no one writes to.
+    static constexpr int32_t kNoOwner = -1;
+
+    //! The owner of a channel the proxy writes to.
+    static constexpr int32_t kProxyOwner = -2;
+
+    //! Keeps its own handle to the memory of mem, which is only valid for the call.
+    explicit DirectChannel(const SharedMemInfo& mem);
+    ~DirectChannel();
+
+    DirectChannel(const DirectChannel&) = delete;
+    DirectChannel& operator=(const DirectChannel&) = delete;
+
+    /**
+     * @param sensor A sensor, as reported by its subhal.
+     *
+     * @return The highest rate level at which the proxy can emulate the direct report of the
+     *    sensor, STOP if it can't.
+     */
+    static RateLevel getMaxEmulatedRateLevel(const SensorInfo& sensor);
+
+    //! @return The nominal sampling period of a rate level, 0 for STOP.
+    static int64_t getRateLevelPeriodNs(RateLevel rate);
+
+    //! @return The memory of the channel, valid for the lifetime of the channel.
+    const SharedMemInfo& getMemInfo() const { return mMemInfo; }
+
+    int32_t getOwner() const { return mOwner; }
+
+    //! @return The handle of the channel in the owner subhal.
+    int32_t getSubHalChannelHandle() const { return mSubHalChannelHandle; }
+
+    /**
+     * Set the owner of the channel. The channel must have no report configured.
+     *
+     * @param owner A subhal index, kProxyOwner or kNoOwner.
+     * @param subHalChannelHandle The handle of the channel in the owner subhal, if one.
+     *
+     * @return false if the proxy can't write to the memory of the channel.
+     */
+    bool setOwner(int32_t owner, int32_t subHalChannelHandle = -1);
+
+    bool hasReports() const { return !mNativeSensors.empty() || !mEmulatedReports.empty(); }
+
+    size_t getNumNativeReports() const { return mNativeSensors.size(); }
+    size_t getNumEmulatedReports() const { return mEmulatedReports.size(); }
+
+    //! Track the sensors reported by the owner subhal, to know when the channel is idle.
+    void setNativeReport(int32_t sensorHandle, RateLevel rate);
+    void clearNativeReports() { mNativeSensors.clear(); }
+
+    /**
+     * Configure the emulated report of a sensor. The channel must be owned by the proxy.
+     *
+     * @return The report token of the sensor in this channel, 0 if the report was stopped.
+     */
+    int32_t setEmulatedReport(int32_t sensorHandle, RateLevel rate);
+
+    //! Stop every emulated report and return the sensors that were reported.
+    std::vector<int32_t> clearEmulatedReports();
+
+    //! @return The sampling period the sensor is reported at, 0 if it isn't.
+    int64_t getEmulatedReportPeriodNs(int32_t sensorHandle) const;
+
+    /**
+     * Write an event to the shared memory if its sensor is reported in this channel and enough
+     * time passed since the last event written for it.
+     */
+    void write(const Event& event);
+
+  private:
+    struct EmulatedReport {
+        int32_t token;
+        int64_t periodNs;
+        int64_t lastTimestampNs;
+    };
+
+    native_handle_t* mMemoryHandle;
+    SharedMemInfo mMemInfo;
+
+    int32_t mOwner = kNoOwner;
+    int32_t mSubHalChannelHandle = -1;
+
+    std::set<int32_t> mNativeSensors;
+    std::map<int32_t, EmulatedReport> mEmulatedReports;
+    int32_t mNextReportToken = 1;
+
+    //! The mapping of the memory while the proxy owns the channel.
+    uint8_t* mBase = nullptr;
+    size_t mNumSlots = 0;
+    size_t mNextSlot = 0;
+    uint32_t mCounter = 0;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/sensors/1.0/types.h>
+#include <android/hardware/sensors/2.1/types.h>
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+// A 2.1 event only widens the sensor type enum of a 1.0 event, so arrays of either are converted
+// by copying their bytes.
+static_assert(sizeof(V1_0::Event) == sizeof(V2_1::Event), "Event sizes differ");
+static_assert(offsetof(V1_0::Event, timestamp) == offsetof(V2_1::Event, timestamp) &&
+                      offsetof(V1_0::Event, sensorHandle) == offsetof(V2_1::Event, sensorHandle) &&
+                      offsetof(V1_0::Event, sensorType) == offsetof(V2_1::Event, sensorType) &&
+                      offsetof(V1_0::Event, u) == offsetof(V2_1::Event, u),
+              "Event layouts differ");
+static_assert(std::is_same<std::underlying_type<V1_0::SensorType>::type,
+                           std::underlying_type<V2_1::SensorType>::type>::value,
+              "Sensor type enums differ");
+static_assert(std::is_trivially_copyable<V1_0::Event>::value &&
+                      std::is_trivially_copyable<V2_1::Event>::value,
+              "Events can't be copied as bytes");
+
+/**
+ * Convert the events posted by a 2.0 subhal to the 2.1 events the proxy works with. The array is
+ * copied in one go, which libc vectorizes, instead of event by event.
+ *
+ * @param events The events to convert.
+ * @param numEvents The number of events in events.
+ * @param newEvents Where to write the converted events, room for numEvents.
+ */
+inline void convertToNewEvents(const V1_0::Event* events, size_t numEvents,
+                               V2_1::Event* newEvents) {
+    if (numEvents > 0) {
+        memcpy(newEvents, events, numEvents * sizeof(V2_1::Event));
+    }
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
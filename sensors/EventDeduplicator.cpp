@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventDeduplicator.h"
+
+#include <cstring>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+bool EventDeduplicator::accepts(const V2_1::Event& event) {
+    if (event.sensorType == V2_1::SensorType::META_DATA ||
+        event.sensorType == V2_1::SensorType::ADDITIONAL_INFO) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    int64_t keepaliveNs = mKeepaliveNs.load(std::memory_order_relaxed);
+    if (mHasLastEvent && memcmp(&event.u, &mLastPayload, sizeof(mLastPayload)) == 0 &&
+        (keepaliveNs == 0 || event.timestamp - mLastTimestampNs < keepaliveNs)) {
+        return false;
+    }
+    mHasLastEvent = true;
+    mLastTimestampNs = event.timestamp;
+    memcpy(&mLastPayload, &event.u, sizeof(mLastPayload));
+    return true;
+}
+
+void EventDeduplicator::reset() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mHasLastEvent = false;
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/sensors/2.1/types.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * Suppresses the events of an on-change sensor whose data is bit-identical to the one of the last
+ * event forwarded, for subhals that keep re-emitting the current value at the sampling rate. A
+ * repeat is still forwarded once the keepalive has elapsed since the last forwarded event, in
+ * sensor time. Meta data and additional info events always pass and aren't compared.
+ *
+ * Thread safe, a subhal may post the events of a sensor from several threads.
+ */
+class EventDeduplicator {
+  public:
+    /**
+     * @param keepaliveNs The longest time between two forwarded events, 0 to never forward a
+     *    repeat.
+     */
+    void setKeepalive(int64_t keepaliveNs) {
+        mKeepaliveNs.store(keepaliveNs, std::memory_order_relaxed);
+    }
+
+    //! @return false if the event repeats the last forwarded one and must be dropped.
+    bool accepts(const V2_1::Event& event);
+
+    //! Forget the last forwarded event, so that the next one is forwarded whatever its data.
+    void reset();
+
+  private:
+    std::atomic<int64_t> mKeepaliveNs = 0;
+
+    std::mutex mMutex;
+    bool mHasLastEvent = false;
+    int64_t mLastTimestampNs = 0;
+    V1_0::EventPayload mLastPayload;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
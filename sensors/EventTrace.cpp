@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventTrace.h"
+
+#include <fcntl.h>
+#include <log/log.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utils/SystemClock.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x54455348;  // "HSET"
+constexpr uint32_t kVersion = 1;
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved;
+};
+
+struct RecordHeader {
+    //! The size of the record, header and padding included. Stored last to publish the record.
+    uint32_t size;
+    uint16_t type;
+    uint16_t reserved;
+    int64_t timeNs;
+};
+
+//! The layout of an event in a kEvents record.
+struct EventPayload {
+    int64_t timestamp;
+    int32_t sensorHandle;
+    int32_t sensorType;
+    float data[16];
+};
+
+struct CallPayload {
+    int32_t sensorHandle;
+    int32_t enabled;
+    int64_t samplingPeriodNs;
+    int64_t maxReportLatencyNs;
+};
+
+static_assert(sizeof(FileHeader) % 8 == 0 && sizeof(RecordHeader) % 8 == 0 &&
+                      sizeof(EventPayload) % 8 == 0,
+              "Records must stay 8 byte aligned");
+
+//! Upper bound of the string sizes read, so that a corrupt trace can't exhaust memory.
+constexpr uint32_t kMaxStringSize = 1 << 12;
+
+size_t alignRecord(size_t size) {
+    return (size + 7) & ~static_cast<size_t>(7);
+}
+
+class PayloadWriter {
+  public:
+    template <typename T>
+    void write(T value) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+        mData.insert(mData.end(), bytes, bytes + sizeof(value));
+    }
+
+    void writeString(const std::string& value) {
+        write(static_cast<uint32_t>(value.size()));
+        mData.insert(mData.end(), value.begin(), value.end());
+    }
+
+    const std::vector<uint8_t>& getData() const { return mData; }
+
+  private:
+    std::vector<uint8_t> mData;
+};
+
+class PayloadReader {
+  public:
+    PayloadReader(const uint8_t* data, size_t size) : mData(data), mSize(size) {}
+
+    template <typename T>
+    bool read(T* value) {
+        if (mSize - mOffset < sizeof(*value)) return false;
+        memcpy(value, mData + mOffset, sizeof(*value));
+        mOffset += sizeof(*value);
+        return true;
+    }
+
+    bool readString(hidl_string* value) {
+        uint32_t size;
+        if (!read(&size) || size > kMaxStringSize || mSize - mOffset < size) return false;
+        *value = std::string(reinterpret_cast<const char*>(mData + mOffset), size);
+        mOffset += size;
+        return true;
+    }
+
+  private:
+    const uint8_t* mData;
+    size_t mSize;
+    size_t mOffset = 0;
+};
+
+void writeSensorInfo(PayloadWriter& writer, const V2_1::SensorInfo& sensor) {
+    writer.write(sensor.sensorHandle);
+    writer.writeString(sensor.name);
+    writer.writeString(sensor.vendor);
+    writer.write(sensor.version);
+    writer.write(static_cast<int32_t>(sensor.type));
+    writer.writeString(sensor.typeAsString);
+    writer.write(sensor.maxRange);
+    writer.write(sensor.resolution);
+    writer.write(sensor.power);
+    writer.write(sensor.minDelay);
+    writer.write(sensor.fifoReservedEventCount);
+    writer.write(sensor.fifoMaxEventCount);
+    writer.writeString(sensor.requiredPermission);
+    writer.write(sensor.maxDelay);
+    writer.write(static_cast<uint32_t>(sensor.flags));
+}
+
+bool readSensorInfo(PayloadReader& reader, V2_1::SensorInfo* sensor) {
+    int32_t type;
+    uint32_t flags;
+    if (!reader.read(&sensor->sensorHandle) || !reader.readString(&sensor->name) ||
+        !reader.readString(&sensor->vendor) || !reader.read(&sensor->version) ||
+        !reader.read(&type) || !reader.readString(&sensor->typeAsString) ||
+        !reader.read(&sensor->maxRange) || !reader.read(&sensor->resolution) ||
+        !reader.read(&sensor->power) || !reader.read(&sensor->minDelay) ||
+        !reader.read(&sensor->fifoReservedEventCount) ||
+        !reader.read(&sensor->fifoMaxEventCount) ||
+        !reader.readString(&sensor->requiredPermission) || !reader.read(&sensor->maxDelay) ||
+        !reader.read(&flags)) {
+        return false;
+    }
+    sensor->type = static_cast<V2_1::SensorType>(type);
+    sensor->flags = flags;
+    return true;
+}
+
+}  // namespace
+
+bool EventRecorder::start(const std::string& path, size_t capacity,
+                          const std::vector<SensorInfo>& sensors) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mRecording.load()) {
+        return true;
+    }
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+    if (fd < 0) {
+        ALOGE("Failed to create event trace %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    // The blocks are allocated up front so that posts don't allocate them when first writing to a
+    // page, falling back to a sparse file where that isn't supported.
+    if (posix_fallocate(fd, 0, capacity) != 0 && ftruncate(fd, capacity) != 0) {
+        ALOGE("Failed to size event trace %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    void* base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (base == MAP_FAILED) {
+        ALOGE("Failed to map event trace %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    mPath = path;
+    mFd = fd;
+    mBase = static_cast<uint8_t*>(base);
+    mCapacity = capacity;
+    FileHeader header = {kMagic, kVersion, 0};
+    memcpy(mBase, &header, sizeof(header));
+    mTail.store(sizeof(header));
+    mNumRecordsDropped.store(0);
+    mRecording.store(true);
+
+    for (const SensorInfo& sensor : sensors) {
+        recordSensor(sensor);
+    }
+    ALOGI("Recording sensor events to %s", path.c_str());
+    return true;
+}
+
+void EventRecorder::stop() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRecording.load()) {
+        return;
+    }
+    // A post either sees the recording stopped or is waited for.
+    mRecording.store(false);
+    while (mNumWriters.load() != 0) {
+        std::this_thread::yield();
+    }
+
+    size_t tail = mTail.load();
+    size_t size = tail <= mCapacity ? tail : mFullOffset;
+    munmap(mBase, mCapacity);
+    if (ftruncate(mFd, size) != 0) {
+        ALOGW("Failed to truncate event trace %s: %s", mPath.c_str(), strerror(errno));
+    }
+    close(mFd);
+    mFd = -1;
+    mBase = nullptr;
+    ALOGI("Recorded %zu bytes of sensor events to %s", size, mPath.c_str());
+}
+
+template <typename WritePayload>
+void EventRecorder::append(EventTraceRecord::Type type, int64_t timeNs, size_t payloadSize,
+                           WritePayload writePayload) {
+    mNumWriters.fetch_add(1);
+    if (!mRecording.load()) {
+        mNumWriters.fetch_sub(1);
+        return;
+    }
+
+    size_t size = alignRecord(sizeof(RecordHeader) + payloadSize);
+    size_t offset = mTail.fetch_add(size, std::memory_order_relaxed);
+    if (offset + size > mCapacity) {
+        // Only the record crossing the end sees an offset within the trace.
+        if (offset <= mCapacity) {
+            mFullOffset = offset;
+            ALOGW("Event trace %s is full, dropping the following records", mPath.c_str());
+        }
+        mNumRecordsDropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        uint8_t* record = mBase + offset;
+        writePayload(record + sizeof(RecordHeader));
+        RecordHeader* header = reinterpret_cast<RecordHeader*>(record);
+        header->type = type;
+        header->reserved = 0;
+        header->timeNs = timeNs;
+        __atomic_store_n(&header->size, static_cast<uint32_t>(size), __ATOMIC_RELEASE);
+    }
+    mNumWriters.fetch_sub(1);
+}
+
+void EventRecorder::appendPayload(EventTraceRecord::Type type, int64_t timeNs,
+                                  const void* payload, size_t payloadSize) {
+    append(type, timeNs, payloadSize,
+           [payload, payloadSize](uint8_t* dest) { memcpy(dest, payload, payloadSize); });
+}
+
+void EventRecorder::recordEvents(const Event* events, size_t numEvents, int32_t subHalIndex,
+                                 int64_t postTimeNs) {
+    int32_t subHalBits = subHalIndex << 24;
+    append(EventTraceRecord::kEvents, postTimeNs, numEvents * sizeof(EventPayload),
+           [events, numEvents, subHalBits](uint8_t* dest) {
+               for (size_t i = 0; i < numEvents; i++) {
+                   EventPayload payload;
+                   payload.timestamp = events[i].timestamp;
+                   payload.sensorHandle = events[i].sensorHandle | subHalBits;
+                   payload.sensorType = static_cast<int32_t>(events[i].sensorType);
+                   memcpy(payload.data, events[i].u.data.data(), sizeof(payload.data));
+                   memcpy(dest + i * sizeof(payload), &payload, sizeof(payload));
+               }
+           });
+}
+
+void EventRecorder::recordSensor(const SensorInfo& sensor) {
+    PayloadWriter writer;
+    writeSensorInfo(writer, sensor);
+    appendPayload(EventTraceRecord::kSensor, ::android::elapsedRealtimeNano(),
+                  writer.getData().data(), writer.getData().size());
+}
+
+void EventRecorder::recordActivate(int32_t sensorHandle, bool enabled) {
+    CallPayload payload = {sensorHandle, enabled, 0, 0};
+    appendPayload(EventTraceRecord::kActivate, ::android::elapsedRealtimeNano(), &payload,
+                  sizeof(payload));
+}
+
+void EventRecorder::recordBatch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                                int64_t maxReportLatencyNs) {
+    CallPayload payload = {sensorHandle, 0, samplingPeriodNs, maxReportLatencyNs};
+    appendPayload(EventTraceRecord::kBatch, ::android::elapsedRealtimeNano(), &payload,
+                  sizeof(payload));
+}
+
+void EventRecorder::recordFlush(int32_t sensorHandle) {
+    CallPayload payload = {sensorHandle, 0, 0, 0};
+    appendPayload(EventTraceRecord::kFlush, ::android::elapsedRealtimeNano(), &payload,
+                  sizeof(payload));
+}
+
+void EventRecorder::dump(std::ostream& stream) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRecording.load()) {
+        stream << "Event recording: off" << std::endl;
+        return;
+    }
+    stream << "Event recording: to " << mPath << ", "
+           << std::min(mTail.load(), mCapacity) / 1024 << " of " << mCapacity / 1024
+           << " KiB used, " << mNumRecordsDropped.load() << " records dropped" << std::endl;
+}
+
+bool EventTraceReader::open(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream) {
+        return false;
+    }
+    mData.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+
+    FileHeader header;
+    if (mData.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, mData.data(), sizeof(header));
+    if (header.magic != kMagic || header.version != kVersion) {
+        ALOGW("Ignoring event trace %s of unknown format", path.c_str());
+        return false;
+    }
+    rewind();
+    return true;
+}
+
+void EventTraceReader::rewind() {
+    mOffset = sizeof(FileHeader);
+}
+
+bool EventTraceReader::next(EventTraceRecord* record) {
+    RecordHeader header;
+    if (mData.size() - mOffset < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, mData.data() + mOffset, sizeof(header));
+    // A record of size 0 is one that was never written, the end of a trace cut short.
+    if (header.size < sizeof(header) || header.size % 8 != 0 ||
+        header.size > mData.size() - mOffset) {
+        return false;
+    }
+    const uint8_t* payload = mData.data() + mOffset + sizeof(header);
+    size_t payloadSize = header.size - sizeof(header);
+    mOffset += header.size;
+
+    record->type = static_cast<EventTraceRecord::Type>(header.type);
+    record->timeNs = header.timeNs;
+    PayloadReader reader(payload, payloadSize);
+    switch (record->type) {
+        case EventTraceRecord::kSensor:
+            return readSensorInfo(reader, &record->sensor);
+        case EventTraceRecord::kEvents: {
+            size_t numEvents = payloadSize / sizeof(EventPayload);
+            record->events.resize(numEvents);
+            for (V2_1::Event& event : record->events) {
+                EventPayload eventPayload;
+                reader.read(&eventPayload);
+                event.timestamp = eventPayload.timestamp;
+                event.sensorHandle = eventPayload.sensorHandle;
+                event.sensorType = static_cast<V2_1::SensorType>(eventPayload.sensorType);
+                memcpy(event.u.data.data(), eventPayload.data, sizeof(eventPayload.data));
+            }
+            return true;
+        }
+        case EventTraceRecord::kActivate:
+        case EventTraceRecord::kBatch:
+        case EventTraceRecord::kFlush: {
+            CallPayload callPayload;
+            if (!reader.read(&callPayload)) return false;
+            record->sensorHandle = callPayload.sensorHandle;
+            record->enabled = callPayload.enabled != 0;
+            record->samplingPeriodNs = callPayload.samplingPeriodNs;
+            record->maxReportLatencyNs = callPayload.maxReportLatencyNs;
+            return true;
+        }
+        default:
+            ALOGW("Unknown event trace record type %u", header.type);
+            return false;
+    }
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/sensors/2.1/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * A binary trace of the events posted to the HalProxy and of the calls driving them, written by
+ * EventRecorder and read by EventTraceReader.
+ *
+ * A trace is a small header followed by records, each made of a header holding its size, type and
+ * elapsed realtime, then its payload padded to 8 bytes. Sensor handles include the subhal index.
+ * Values are in host byte order, traces are meant to be replayed on the kind of device or host
+ * that recorded them.
+ */
+struct EventTraceRecord {
+    using Event = ::android::hardware::sensors::V2_1::Event;
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+
+    enum Type : uint16_t {
+        //! A sensor known to the proxy, every sensor is recorded when a recording starts.
+        kSensor = 1,
+        //! The events of one post from a subhal, before the proxy processes them.
+        kEvents = 2,
+        kActivate = 3,
+        kBatch = 4,
+        kFlush = 5,
+    };
+
+    Type type;
+
+    //! The elapsed realtime of the post or call.
+    int64_t timeNs;
+
+    //! Set for kSensor.
+    SensorInfo sensor;
+
+    //! Set for kEvents.
+    std::vector<Event> events;
+
+    //! Set for kActivate, kBatch and kFlush.
+    int32_t sensorHandle;
+    bool enabled;
+    int64_t samplingPeriodNs;
+    int64_t maxReportLatencyNs;
+};
+
+/**
+ * Records an event trace to a memory mapped file.
+ *
+ * The file is sized and its pages faulted in when the recording starts. Posts then reserve their
+ * record with an atomic add on the tail of the trace and copy it in place, without a lock or a
+ * syscall, the kernel writing the pages back in the background. A record is published by storing
+ * its size last. Once the file is full the following records are dropped and counted, the trace
+ * ending at the last record that fit.
+ */
+class EventRecorder {
+  public:
+    using Event = EventTraceRecord::Event;
+    using SensorInfo = EventTraceRecord::SensorInfo;
+
+    EventRecorder() = default;
+    ~EventRecorder() { stop(); }
+
+    EventRecorder(const EventRecorder&) = delete;
+    EventRecorder& operator=(const EventRecorder&) = delete;
+
+    /**
+     * Start recording to a file, replacing it. Does nothing if already recording.
+     *
+     * @param path The path of the trace.
+     * @param capacity The size of the trace, in bytes.
+     * @param sensors The sensors known to the proxy.
+     *
+     * @return false if the file couldn't be created or mapped.
+     */
+    bool start(const std::string& path, size_t capacity, const std::vector<SensorInfo>& sensors);
+
+    //! Stop recording and truncate the trace to the records written.
+    void stop();
+
+    //! Checked before recording on the event path, so that it costs a load when not recording.
+    bool isRecording() const { return mRecording.load(std::memory_order_relaxed); }
+
+    /**
+     * Record the events of a post, as the subhal posted them.
+     *
+     * @param events The array of events to record, with subhal handles.
+     * @param numEvents The number of events in events.
+     * @param subHalIndex The index of the subhal that posted the events.
+     * @param postTimeNs The elapsed realtime at which the subhal posted the events.
+     */
+    void recordEvents(const Event* events, size_t numEvents, int32_t subHalIndex,
+                      int64_t postTimeNs);
+
+    void recordSensor(const SensorInfo& sensor);
+    void recordActivate(int32_t sensorHandle, bool enabled);
+    void recordBatch(int32_t sensorHandle, int64_t samplingPeriodNs, int64_t maxReportLatencyNs);
+    void recordFlush(int32_t sensorHandle);
+
+    void dump(std::ostream& stream);
+
+  private:
+    /**
+     * Reserve a record and write its payload, then publish it.
+     *
+     * @param type The type of the record.
+     * @param timeNs The elapsed realtime of the record.
+     * @param payloadSize The size of the payload.
+     * @param writePayload Writes the payload at the address it is given.
+     */
+    template <typename WritePayload>
+    void append(EventTraceRecord::Type type, int64_t timeNs, size_t payloadSize,
+                WritePayload writePayload);
+
+    void appendPayload(EventTraceRecord::Type type, int64_t timeNs, const void* payload,
+                       size_t payloadSize);
+
+    //! Serializes start and stop.
+    std::mutex mMutex;
+
+    std::atomic_bool mRecording = false;
+
+    //! The number of posts or calls writing a record, which stop waits for before unmapping.
+    std::atomic_size_t mNumWriters = 0;
+
+    //! The offset of the next record, may grow past the capacity once the trace is full.
+    std::atomic_size_t mTail = 0;
+
+    std::atomic<uint64_t> mNumRecordsDropped = 0;
+
+    //! Where the trace ends once full, set by the record that didn't fit.
+    size_t mFullOffset = 0;
+
+    std::string mPath;
+    int mFd = -1;
+    uint8_t* mBase = nullptr;
+    size_t mCapacity = 0;
+};
+
+/**
+ * Reads an event trace, including one that was cut short.
+ */
+class EventTraceReader {
+  public:
+    /**
+     * Read a trace in memory.
+     *
+     * @param path The path of the trace.
+     *
+     * @return false if the file is missing, unreadable or of another format version.
+     */
+    bool open(const std::string& path);
+
+    /**
+     * Read the next record.
+     *
+     * @return false at the end of the trace or at the first malformed record.
+     */
+    bool next(EventTraceRecord* record);
+
+    //! Go back to the first record.
+    void rewind();
+
+  private:
+    std::vector<uint8_t> mData;
+    size_t mOffset = 0;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -19,14 +19,19 @@
 #include <android/hardware/sensors/2.0/types.h>
 
 #include <android-base/file.h>
+#include <android-base/properties.h>
+#include <utils/SystemClock.h>
 #include "hardware_legacy/power.h"
 
 #include <dlfcn.h>
 
+#include <algorithm>
 #include <cinttypes>
 #include <cmath>
+#include <cstdio>
 #include <fstream>
 #include <functional>
+#include <iomanip>
 #include <thread>
 
 namespace android {
@@ -46,6 +51,48 @@ typedef V2_1::implementation::ISensorsSubHal*(SensorsHalGetSubHalV2_1Func)(uint3
 
 static constexpr int32_t kBitsAfterSubHalIndex = 24;
 
+//! The number of subhal indices the sensor handles have room for.
+static constexpr size_t kMaxSubHals = 1 << (32 - kBitsAfterSubHalIndex);
+
+//! The config file listing the subhal libraries.
+static const char* kMultiHalConfigFile = "/vendor/etc/sensors/hals.conf";
+
+//! The debug argument that resets the sensor latency histograms once they are dumped.
+static const char* kResetLatencyArg = "--reset-latency";
+
+//! The debug arguments that start and stop recording an event trace to kEventTraceFile.
+static const char* kRecordArg = "--record";
+static const char* kStopRecordingArg = "--stop-recording";
+
+//! The debug argument that applies the changes made to kMultiHalConfigFile.
+static const char* kReloadSubHalsArg = "--reload-subhals";
+
+//! The debug argument that dumps the counters as line delimited JSON instead of the text dump.
+static const char* kStatsArg = "--stats";
+
+//! Where event traces are recorded, and how large they can grow.
+static const char* kEventTraceFile = "/data/vendor/sensors/events.trace";
+static constexpr size_t kEventTraceCapacity = 64 * 1024 * 1024;
+
+//! The property enabling loading subhals on demand from the subhal cache.
+static const char* kLazyLoadProperty = "ro.vendor.sensors.multihal.lazy_load";
+
+//! Where the sensor lists of the subhals are cached to load them on demand.
+static const char* kSubHalCacheFile = "/data/vendor/sensors/subhals.cache";
+
+//! The rules patching the sensors reported by the subhals.
+static const char* kSensorPatchesFile = "/vendor/etc/sensors/sensor_patches.conf";
+
+//! The directories searched for subhal libraries.
+static const std::string kSubHalShareObjectLocations[] = {
+        "",  // Default locations will be searched
+#ifdef __LP64__
+        "/vendor/lib64/hw/", "/odm/lib64/hw/"
+#else
+        "/vendor/lib/hw/", "/odm/lib/hw/"
+#endif
+};
+
 /**
  * Set the subhal index as first byte of sensor handle and return this modified version.
  *
@@ -55,7 +102,9 @@ static constexpr int32_t kBitsAfterSubHalIndex = 24;
  * @return The modified sensor handle.
  */
 int32_t setSubHalIndex(int32_t sensorHandle, size_t subHalIndex) {
-    return sensorHandle | (static_cast<int32_t>(subHalIndex) << kBitsAfterSubHalIndex);
+    // Indices from 128 set the sign bit, which only unsigned shifts are defined for.
+    return sensorHandle |
+           static_cast<int32_t>(static_cast<uint32_t>(subHalIndex) << kBitsAfterSubHalIndex);
 }
 
 /**
@@ -66,7 +115,7 @@ int32_t setSubHalIndex(int32_t sensorHandle, size_t subHalIndex) {
  * @return The subhal index.
  */
 size_t extractSubHalIndex(int32_t sensorHandle) {
-    return static_cast<size_t>(sensorHandle >> kBitsAfterSubHalIndex);
+    return static_cast<size_t>(static_cast<uint32_t>(sensorHandle) >> kBitsAfterSubHalIndex);
 }
 
 /**
@@ -81,28 +130,88 @@ int64_t msFromNs(int64_t nanos) {
     return nanos / nanosecondsInAMillsecond;
 }
 
-bool patchXiaomiPickupSensor(V2_1::SensorInfo& sensor) {
-    if (sensor.typeAsString != "xiaomi pick up sensor") {
-        return true;
+/**
+ * Quote a string for JSON output.
+ *
+ * @param value The string to quote.
+ *
+ * @return The JSON string literal.
+ */
+std::string toJsonString(const std::string& value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
     }
+    quoted += '"';
+    return quoted;
+}
 
-    /*
-     * Implement only the wake-up version of this sensor.
-     */
-    if (!(sensor.flags & V1_0::SensorFlagBits::WAKE_UP)) {
-        return false;
-    }
+/**
+ * Records the duration of a call in a histogram when it goes out of scope.
+ */
+class ScopedCallTimer {
+  public:
+    explicit ScopedCallTimer(LatencyHistogram& histogram)
+        : mHistogram(histogram), mStartNs(::android::elapsedRealtimeNano()) {}
 
-    sensor.type = V2_1::SensorType::PICK_UP_GESTURE;
-    sensor.typeAsString = SENSOR_STRING_TYPE_PICK_UP_GESTURE;
-    sensor.maxRange = 1;
+    ~ScopedCallTimer() { mHistogram.record(::android::elapsedRealtimeNano() - mStartNs); }
 
-    return true;
+  private:
+    LatencyHistogram& mHistogram;
+    const int64_t mStartNs;
+};
+
+//! The number of bits of the wakelock state holding the refcount, the reset count is above them.
+constexpr int kWakelockRefCountBits = 32;
+
+//! @return The wakelock refcount of a wakelock state.
+size_t wakelockRefCount(uint64_t state) {
+    return static_cast<size_t>(state & ((UINT64_C(1) << kWakelockRefCountBits) - 1));
+}
+
+//! @return The number of resets of the shared wakelock of a wakelock state.
+int64_t wakelockResetCount(uint64_t state) {
+    return static_cast<int64_t>(state >> kWakelockRefCountBits);
+}
+
+/**
+ * Run work for each index of [0, n) on worker threads and wait for all of it to be done. Work for
+ * different indices may run concurrently and in any order.
+ *
+ * @param n The number of indices.
+ * @param work The work to run for an index.
+ */
+void runInParallel(size_t n, const std::function<void(size_t)>& work) {
+    size_t numThreads = std::min<size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic_size_t nextIndex = 0;
+    auto worker = [&] {
+        for (size_t i = nextIndex.fetch_add(1); i < n; i = nextIndex.fetch_add(1)) {
+            work(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
 }
 
 HalProxy::HalProxy() {
-    const char* kMultiHalConfigFile = "/vendor/etc/sensors/hals.conf";
+    int64_t startTime = ::android::elapsedRealtimeNano();
     initializeSubHalListFromConfigFile(kMultiHalConfigFile);
+    mSubHalLoadDurationNs = ::android::elapsedRealtimeNano() - startTime;
     init();
 }
 
@@ -131,25 +240,30 @@ HalProxy::~HalProxy() {
     stopThreads();
 }
 
+const char* const HalProxy::kMethodNames[HalProxy::kNumMethods] = {
+        "getSensorsList",          "setOperationMode",        "activate",
+        "initialize",              "batch",                   "flush",
+        "injectSensorData",        "registerDirectChannel",   "unregisterDirectChannel",
+        "configDirectReport",
+};
+
 Return<void> HalProxy::getSensorsList_2_1(ISensorsV2_1::getSensorsList_2_1_cb _hidl_cb) {
-    std::vector<V2_1::SensorInfo> sensors;
-    for (const auto& iter : mSensors) {
-        sensors.push_back(iter.second);
-    }
-    _hidl_cb(sensors);
+    ScopedCallTimer timer(mMethodLatency[kMethodGetSensorsList]);
+    std::shared_ptr<const SensorListCache> sensorList = std::atomic_load(&mSensorListCache);
+    _hidl_cb(sensorList->sensorsV2_1);
     return Void();
 }
 
 Return<void> HalProxy::getSensorsList(ISensorsV2_0::getSensorsList_cb _hidl_cb) {
-    std::vector<V1_0::SensorInfo> sensors;
-    for (const auto& iter : mSensors) {
-        sensors.push_back(convertToOldSensorInfo(iter.second));
-    }
-    _hidl_cb(sensors);
+    ScopedCallTimer timer(mMethodLatency[kMethodGetSensorsList]);
+    std::shared_ptr<const SensorListCache> sensorList = std::atomic_load(&mSensorListCache);
+    _hidl_cb(sensorList->sensorsV1_0);
     return Void();
 }
 
 Return<Result> HalProxy::setOperationMode(OperationMode mode) {
+    ScopedCallTimer timer(mMethodLatency[kMethodSetOperationMode]);
+    std::lock_guard<std::mutex> lock(mOperationModeMutex);
     Result result = Result::OK;
     size_t subHalIndex;
     for (subHalIndex = 0; subHalIndex < mSubHalList.size(); subHalIndex++) {
@@ -164,7 +278,7 @@ Return<Result> HalProxy::setOperationMode(OperationMode mode) {
     if (result != Result::OK) {
         // Reset the subhal operation modes that have been flipped
         for (size_t i = 0; i < subHalIndex; i++) {
-            mSubHalList[i]->setOperationMode(mCurrentOperationMode);
+            mSubHalList[i]->setOperationMode(mCurrentOperationMode.load());
         }
     } else {
         mCurrentOperationMode = mode;
@@ -173,11 +287,27 @@ Return<Result> HalProxy::setOperationMode(OperationMode mode) {
 }
 
 Return<Result> HalProxy::activate(int32_t sensorHandle, bool enabled) {
+    ScopedCallTimer timer(mMethodLatency[kMethodActivate]);
     if (!isSubHalIndexValid(sensorHandle)) {
         return Result::BAD_VALUE;
     }
-    return getSubHalForSensorHandle(sensorHandle)
-            ->activate(clearSubHalIndex(sensorHandle), enabled);
+    mEventRecorder.recordActivate(sensorHandle, enabled);
+    if (!enabled) {
+        mSoftwareBatcher.flush(sensorHandle);
+    }
+    Result result;
+    if (mEmulatedDirectReportSensors.count(sensorHandle) > 0) {
+        std::lock_guard<std::mutex> lock(mDirectChannelMutex);
+        mEmulatedDirectReportSensors[sensorHandle].enabled = enabled;
+        result = applyEmulatedDirectReportConfig(sensorHandle);
+    } else {
+        result = getSubHalForSensorHandle(sensorHandle)
+                         ->activate(clearSubHalIndex(sensorHandle), enabled);
+    }
+    if (result == Result::OK) {
+        mSensorRegistry.setActive(sensorHandle, enabled);
+    }
+    return result;
 }
 
 Return<Result> HalProxy::initialize_2_1(
@@ -228,20 +358,36 @@ Return<Result> HalProxy::initializeCommon(
         std::unique_ptr<EventMessageQueueWrapperBase>& eventQueue,
         std::unique_ptr<WakeLockMessageQueueWrapperBase>& wakeLockQueue,
         const sp<ISensorsCallbackWrapperBase>& sensorsCallback) {
+    ScopedCallTimer timer(mMethodLatency[kMethodInitialize]);
+    std::lock_guard<std::mutex> lock(mInitializeMutex);
     Result result = Result::OK;
 
     stopThreads();
     resetSharedWakelock();
 
+    // The channels of the previous framework are gone, and sensors only enabled for them must be
+    // disabled below.
+    resetDirectChannels();
+
     // So that the pending write events queue can be cleared safely and when we start threads
     // again we do not get new events until after initialize resets the subhals.
     disableAllSensors();
 
-    // Clears the queue if any events were pending write before.
-    mPendingWriteEventsQueue = std::queue<std::pair<std::vector<V2_1::Event>, size_t>>();
-    mSizePendingWriteEventsQueue = 0;
+    // Clears the queues if any events were pending write before.
+    mPendingWriteEventsQueue.clear();
+    mWakeupPendingWriteEventsQueue.clear();
+    mWakeupPendingWriteEventsQueued.store(false);
+
+    // Sensors start out unbatched again.
+    mSoftwareBatcher.reset();
+    for (const auto& sensorEntry : mSensors) {
+        mSensorRegistry.setFlag(sensorEntry.first, SensorRegistry::kFlagSoftwareBatched, false);
+    }
 
     // Clears previously connected dynamic sensors
+    for (const auto& sensorEntry : mDynamicSensors) {
+        mSensorRegistry.remove(sensorEntry.first);
+    }
     mDynamicSensors.clear();
 
     mDynamicSensorsCallback = sensorsCallback;
@@ -271,36 +417,85 @@ Return<Result> HalProxy::initializeCommon(
 
     mThreadsRun.store(true);
 
+    mPendingWritesThreadConfig = ThreadConfig::fromProperties("pending_writes", "HalProxyWrites");
+    mWakelockThreadConfig = ThreadConfig::fromProperties("wakelock", "HalProxyWakelk");
     mPendingWritesThread = std::thread(startPendingWritesThread, this);
     mWakelockThread = std::thread(startWakelockThread, this);
 
+    // Subhals are initialized concurrently, and the error of the first one that failed is
+    // returned.
+    int64_t startTime = ::android::elapsedRealtimeNano();
+    std::vector<Result> subHalResults(mSubHalList.size(), Result::OK);
+    mSubHalInitializeDurationsNs.assign(mSubHalList.size(), 0);
+    runInParallel(mSubHalList.size(), [&](size_t i) {
+        int64_t subHalStartTime = ::android::elapsedRealtimeNano();
+        subHalResults[i] = mSubHalList[i]->initialize(this, mSubHalWakelockRefCounters[i].get(), i);
+        mSubHalInitializeDurationsNs[i] = ::android::elapsedRealtimeNano() - subHalStartTime;
+    });
+    mSubHalInitializeDurationNs = ::android::elapsedRealtimeNano() - startTime;
     for (size_t i = 0; i < mSubHalList.size(); i++) {
-        Result currRes = mSubHalList[i]->initialize(this, this, i);
-        if (currRes != Result::OK) {
-            result = currRes;
+        if (subHalResults[i] != Result::OK) {
+            result = subHalResults[i];
             ALOGE("Subhal '%s' failed to initialize.", mSubHalList[i]->getName().c_str());
             break;
         }
     }
 
-    mCurrentOperationMode = OperationMode::NORMAL;
+    // The framework only knows the sensors of the subhals loaded since the service started from
+    // the dynamic sensors announced to it.
+    if (mDynamicSensorsCallback != nullptr) {
+        for (const auto& subHalEntry : mReloadedSubHalSensors) {
+            connectReloadedSubHal(subHalEntry.first);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> operationModeLock(mOperationModeMutex);
+        mCurrentOperationMode = OperationMode::NORMAL;
+    }
 
     return result;
 }
 
 Return<Result> HalProxy::batch(int32_t sensorHandle, int64_t samplingPeriodNs,
                                int64_t maxReportLatencyNs) {
+    ScopedCallTimer timer(mMethodLatency[kMethodBatch]);
     if (!isSubHalIndexValid(sensorHandle)) {
         return Result::BAD_VALUE;
     }
-    return getSubHalForSensorHandle(sensorHandle)
-            ->batch(clearSubHalIndex(sensorHandle), samplingPeriodNs, maxReportLatencyNs);
+    mEventRecorder.recordBatch(sensorHandle, samplingPeriodNs, maxReportLatencyNs);
+    // The subhal has no FIFO for software batched sensors, so it streams the events and the proxy
+    // batches them.
+    bool softwareBatched = mSoftwareBatcher.hasSensor(sensorHandle);
+    int64_t subHalMaxReportLatencyNs = softwareBatched ? 0 : maxReportLatencyNs;
+    Result result;
+    if (mEmulatedDirectReportSensors.count(sensorHandle) > 0) {
+        std::lock_guard<std::mutex> lock(mDirectChannelMutex);
+        EmulatedDirectReportSensor& sensor = mEmulatedDirectReportSensors[sensorHandle];
+        sensor.samplingPeriodNs = samplingPeriodNs;
+        sensor.maxReportLatencyNs = subHalMaxReportLatencyNs;
+        result = applyEmulatedDirectReportConfig(sensorHandle);
+    } else {
+        result = getSubHalForSensorHandle(sensorHandle)
+                         ->batch(clearSubHalIndex(sensorHandle), samplingPeriodNs,
+                                 subHalMaxReportLatencyNs);
+    }
+    if (softwareBatched && result == Result::OK) {
+        bool batched = mSoftwareBatcher.setMaxReportLatency(sensorHandle, maxReportLatencyNs);
+        mSensorRegistry.setFlag(sensorHandle, SensorRegistry::kFlagSoftwareBatched, batched);
+    }
+    if (result == Result::OK) {
+        mSensorRegistry.setBatchParams(sensorHandle, samplingPeriodNs, maxReportLatencyNs);
+    }
+    return result;
 }
 
 Return<Result> HalProxy::flush(int32_t sensorHandle) {
+    ScopedCallTimer timer(mMethodLatency[kMethodFlush]);
     if (!isSubHalIndexValid(sensorHandle)) {
         return Result::BAD_VALUE;
     }
+    mEventRecorder.recordFlush(sensorHandle);
     return getSubHalForSensorHandle(sensorHandle)->flush(clearSubHalIndex(sensorHandle));
 }
 
@@ -309,6 +504,7 @@ Return<Result> HalProxy::injectSensorData_2_1(const V2_1::Event& event) {
 }
 
 Return<Result> HalProxy::injectSensorData(const V1_0::Event& event) {
+    ScopedCallTimer timer(mMethodLatency[kMethodInjectSensorData]);
     Result result = Result::OK;
     if (mCurrentOperationMode == OperationMode::NORMAL &&
         event.sensorType != V1_0::SensorType::ADDITIONAL_INFO) {
@@ -330,42 +526,144 @@ Return<Result> HalProxy::injectSensorData(const V1_0::Event& event) {
 
 Return<void> HalProxy::registerDirectChannel(const SharedMemInfo& mem,
                                              ISensorsV2_0::registerDirectChannel_cb _hidl_cb) {
-    if (mDirectChannelSubHal == nullptr) {
+    ScopedCallTimer timer(mMethodLatency[kMethodRegisterDirectChannel]);
+    if (!mDirectReportSupported) {
         _hidl_cb(Result::INVALID_OPERATION, -1 /* channelHandle */);
-    } else {
-        mDirectChannelSubHal->registerDirectChannel(mem, _hidl_cb);
+        return Return<void>();
+    }
+    if (mem.memoryHandle == nullptr) {
+        _hidl_cb(Result::BAD_VALUE, -1 /* channelHandle */);
+        return Return<void>();
     }
+
+    // The channel is only registered with a subhal once one of its sensors is configured on it,
+    // since it isn't known before which subhal or whether the proxy will write to it.
+    std::lock_guard<std::mutex> lock(mDirectChannelMutex);
+    int32_t channelHandle = mNextDirectChannelHandle++;
+    auto channel = std::make_unique<DirectChannel>(mem);
+    {
+        std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+        mDirectChannels[channelHandle] = std::move(channel);
+    }
+    _hidl_cb(Result::OK, channelHandle);
     return Return<void>();
 }
 
 Return<Result> HalProxy::unregisterDirectChannel(int32_t channelHandle) {
-    Result result;
-    if (mDirectChannelSubHal == nullptr) {
-        result = Result::INVALID_OPERATION;
-    } else {
-        result = mDirectChannelSubHal->unregisterDirectChannel(channelHandle);
+    ScopedCallTimer timer(mMethodLatency[kMethodUnregisterDirectChannel]);
+    if (!mDirectReportSupported) {
+        return Result::INVALID_OPERATION;
     }
-    return result;
+
+    std::lock_guard<std::mutex> lock(mDirectChannelMutex);
+    auto iter = mDirectChannels.find(channelHandle);
+    if (iter == mDirectChannels.end()) {
+        return Result::BAD_VALUE;
+    }
+    DirectChannel& channel = *iter->second;
+    if (channel.getOwner() >= 0) {
+        mSubHalList[channel.getOwner()]->unregisterDirectChannel(channel.getSubHalChannelHandle());
+    }
+    std::vector<int32_t> emulatedSensorHandles;
+    {
+        std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+        emulatedSensorHandles = channel.clearEmulatedReports();
+        mDirectChannels.erase(iter);
+    }
+    for (int32_t sensorHandle : emulatedSensorHandles) {
+        applyEmulatedDirectReportConfig(sensorHandle);
+    }
+    return Result::OK;
 }
 
 Return<void> HalProxy::configDirectReport(int32_t sensorHandle, int32_t channelHandle,
                                           RateLevel rate,
                                           ISensorsV2_0::configDirectReport_cb _hidl_cb) {
-    if (mDirectChannelSubHal == nullptr) {
+    ScopedCallTimer timer(mMethodLatency[kMethodConfigDirectReport]);
+    if (!mDirectReportSupported) {
         _hidl_cb(Result::INVALID_OPERATION, -1 /* reportToken */);
-    } else if (sensorHandle == -1 && rate != RateLevel::STOP) {
+        return Return<void>();
+    }
+    if ((sensorHandle == -1 && rate != RateLevel::STOP) ||
+        (sensorHandle != -1 && !isSubHalIndexValid(sensorHandle))) {
         _hidl_cb(Result::BAD_VALUE, -1 /* reportToken */);
-    } else {
-        // -1 denotes all sensors should be disabled
-        if (sensorHandle != -1) {
-            sensorHandle = clearSubHalIndex(sensorHandle);
+        return Return<void>();
+    }
+
+    std::lock_guard<std::mutex> lock(mDirectChannelMutex);
+    auto channelIter = mDirectChannels.find(channelHandle);
+    if (channelIter == mDirectChannels.end()) {
+        _hidl_cb(Result::BAD_VALUE, -1 /* reportToken */);
+        return Return<void>();
+    }
+    DirectChannel& channel = *channelIter->second;
+
+    // -1 denotes all sensors should be disabled
+    if (sensorHandle == -1) {
+        Result result = Result::OK;
+        if (channel.getOwner() >= 0 && channel.getNumNativeReports() > 0) {
+            mSubHalList[channel.getOwner()]->configDirectReport(
+                    -1 /* sensorHandle */, channel.getSubHalChannelHandle(), RateLevel::STOP,
+                    [&](Result subHalResult, int32_t /* reportToken */) {
+                        result = subHalResult;
+                    });
+            channel.clearNativeReports();
+        }
+        std::vector<int32_t> emulatedSensorHandles;
+        {
+            std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+            emulatedSensorHandles = channel.clearEmulatedReports();
+        }
+        for (int32_t emulatedSensorHandle : emulatedSensorHandles) {
+            applyEmulatedDirectReportConfig(emulatedSensorHandle);
         }
-        mDirectChannelSubHal->configDirectReport(sensorHandle, channelHandle, rate, _hidl_cb);
+        _hidl_cb(result, -1 /* reportToken */);
+        return Return<void>();
+    }
+
+    if (mEmulatedDirectReportSensors.count(sensorHandle) > 0) {
+        if (rate != RateLevel::STOP && !claimDirectChannel(channel, DirectChannel::kProxyOwner)) {
+            _hidl_cb(Result::INVALID_OPERATION, -1 /* reportToken */);
+            return Return<void>();
+        }
+        int32_t reportToken;
+        {
+            std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+            reportToken = channel.setEmulatedReport(sensorHandle, rate);
+        }
+        Result result = applyEmulatedDirectReportConfig(sensorHandle);
+        if (result != Result::OK && rate != RateLevel::STOP) {
+            {
+                std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+                channel.setEmulatedReport(sensorHandle, RateLevel::STOP);
+            }
+            applyEmulatedDirectReportConfig(sensorHandle);
+            reportToken = -1;
+        }
+        _hidl_cb(result, reportToken);
+        return Return<void>();
+    }
+
+    // Only one subhal can write to the channel, and the proxy doesn't emulate the direct report
+    // of sensors the subhal reports natively.
+    int32_t subHalIndex = static_cast<int32_t>(extractSubHalIndex(sensorHandle));
+    if ((rate != RateLevel::STOP && !claimDirectChannel(channel, subHalIndex)) ||
+        channel.getOwner() != subHalIndex) {
+        _hidl_cb(Result::INVALID_OPERATION, -1 /* reportToken */);
+        return Return<void>();
     }
+    mSubHalList[subHalIndex]->configDirectReport(
+            clearSubHalIndex(sensorHandle), channel.getSubHalChannelHandle(), rate,
+            [&](Result result, int32_t reportToken) {
+                if (result == Result::OK) {
+                    channel.setNativeReport(sensorHandle, rate);
+                }
+                _hidl_cb(result, reportToken);
+            });
     return Return<void>();
 }
 
-Return<void> HalProxy::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& /*args*/) {
+Return<void> HalProxy::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) {
     if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
         ALOGE("%s: missing fd for writing", __FUNCTION__);
         return Void();
@@ -374,29 +672,217 @@ Return<void> HalProxy::debug(const hidl_handle& fd, const hidl_vec<hidl_string>&
     android::base::borrowed_fd writeFd = dup(fd->data[0]);
 
     std::ostringstream stream;
+    if (std::find(args.begin(), args.end(), kStatsArg) != args.end()) {
+        dumpStats(stream);
+        android::base::WriteStringToFd(stream.str(), writeFd);
+        return Return<void>();
+    }
     stream << "===HalProxy===" << std::endl;
+    if (std::find(args.begin(), args.end(), kRecordArg) != args.end()) {
+        std::vector<SensorInfo> sensors;
+        for (const auto& sensorEntry : mSensors) {
+            sensors.push_back(sensorEntry.second);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mDynamicSensorsMutex);
+            for (const auto& sensorEntry : mDynamicSensors) {
+                sensors.push_back(sensorEntry.second);
+            }
+        }
+        if (!mEventRecorder.start(kEventTraceFile, kEventTraceCapacity, sensors)) {
+            stream << "Failed to start recording to " << kEventTraceFile << std::endl;
+        }
+    } else if (std::find(args.begin(), args.end(), kStopRecordingArg) != args.end()) {
+        mEventRecorder.stop();
+    }
+    if (std::find(args.begin(), args.end(), kReloadSubHalsArg) != args.end()) {
+        reloadSubHals(stream);
+    }
     stream << "Internal values:" << std::endl;
     stream << "  Threads are running: " << (mThreadsRun.load() ? "true" : "false") << std::endl;
     int64_t now = getTimeNow();
-    stream << "  Wakelock timeout start time: " << msFromNs(now - mWakelockTimeoutStartTime)
-           << " ms ago" << std::endl;
-    stream << "  Wakelock timeout reset time: " << msFromNs(now - mWakelockTimeoutResetTime)
-           << " ms ago" << std::endl;
-    // TODO(b/142969448): Add logging for history of wakelock acquisition per subhal.
-    stream << "  Wakelock ref count: " << mWakelockRefCount << std::endl;
-    stream << "  # of events on pending write writes queue: " << mSizePendingWriteEventsQueue
+    stream << "  Wakelock timeout start time: "
+           << msFromNs(now - mWakelockTimeoutStartTime.load()) << " ms ago" << std::endl;
+    stream << "  Wakelock timeout reset time: "
+           << msFromNs(now - mWakelockTimeoutResetTime.load()) << " ms ago" << std::endl;
+    stream << "  Wakelock ref count: " << wakelockRefCount(mWakelockState.load()) << std::endl;
+    // Copied under the write mutex, which isn't held while writing to the stream so that posts
+    // aren't held up by a slow dump reader.
+    size_t numPendingWriteEvents;
+    size_t mostPendingWriteEvents;
+    size_t numWakeupPendingWriteEvents;
+    size_t mostWakeupPendingWriteEvents;
+    uint64_t numEventsPostedToEventQueue;
+    uint64_t numEventQueueWakes;
+    uint64_t numEventsShed;
+    double eventQueueDrainRateHz;
+    size_t pendingWriteLimit;
+    size_t numEventsOnFront = 0;
+    {
+        std::lock_guard<std::mutex> lock(mEventQueueWriteMutex);
+        numPendingWriteEvents = mPendingWriteEventsQueue.size();
+        mostPendingWriteEvents = mMostEventsObservedPendingWriteEventsQueue;
+        numWakeupPendingWriteEvents = mWakeupPendingWriteEventsQueue.size();
+        mostWakeupPendingWriteEvents = mMostEventsObservedWakeupPendingWriteEventsQueue;
+        numEventsPostedToEventQueue = mNumEventsPostedToEventQueue;
+        numEventQueueWakes = mNumEventQueueWakes;
+        numEventsShed = mNumEventsShed;
+        eventQueueDrainRateHz = mEventQueueDrainRateHz;
+        pendingWriteLimit = getPendingWriteLimit();
+        if (!mPendingWriteEventsQueue.empty()) {
+            const Event* frontEvents;
+            size_t numContiguous;
+            numEventsOnFront =
+                    mPendingWriteEventsQueue.front(&frontEvents, &numContiguous).numEvents;
+        }
+    }
+    stream << "  # of events on pending write writes queue: " << numPendingWriteEvents
            << std::endl;
-    stream << " Most events seen on pending write events queue: "
-           << mMostEventsObservedPendingWriteEventsQueue << std::endl;
-    if (!mPendingWriteEventsQueue.empty()) {
-        stream << "  Size of events list on front of pending writes queue: "
-               << mPendingWriteEventsQueue.front().first.size() << std::endl;
+    stream << " Most events seen on pending write events queue: " << mostPendingWriteEvents
+           << std::endl;
+    stream << "  # of events on wakeup pending write events queue: "
+           << numWakeupPendingWriteEvents << std::endl;
+    stream << "  Most events seen on wakeup pending write events queue: "
+           << mostWakeupPendingWriteEvents << std::endl;
+    stream << "  # of events written directly to the event queue: "
+           << numEventsPostedToEventQueue << std::endl;
+    stream << "  # of wakes for events written directly to the event queue: "
+           << numEventQueueWakes << std::endl;
+    stream << "  # of events shed when the pending write events queue overflowed or lagged: "
+           << numEventsShed << std::endl;
+    if (eventQueueDrainRateHz >= 0) {
+        stream << "  Event queue drain rate: " << static_cast<uint64_t>(eventQueueDrainRateHz)
+               << " events/s, pending write events queue limit: " << pendingWriteLimit
+               << std::endl;
+    }
+    if (numPendingWriteEvents > 0) {
+        stream << "  Size of events list on front of pending writes queue: " << numEventsOnFront
+               << std::endl;
     }
+    stream << "  Subhal loading took: " << msFromNs(mSubHalLoadDurationNs) << " ms" << std::endl;
+    stream << "  Sensor list initialization took: " << msFromNs(mSensorListDurationNs) << " ms"
+           << std::endl;
+    stream << "  Subhal initialization took: " << msFromNs(mSubHalInitializeDurationNs) << " ms"
+           << std::endl;
     stream << "  # of non-dynamic sensors across all subhals: " << mSensors.size() << std::endl;
     stream << "  # of dynamic sensors across all subhals: " << mDynamicSensors.size() << std::endl;
-    stream << "SubHals (" << mSubHalList.size() << "):" << std::endl;
-    for (auto& subHal : mSubHalList) {
+    stream << "  # of sensor patch rules: " << mSensorPatches.size() << std::endl;
+    stream << "Sensor events shed:" << std::endl;
+    auto dumpShedEvents = [&](const std::map<int32_t, SensorInfo>& sensors) {
+        for (const auto& sensorEntry : sensors) {
+            uint64_t numShedEvents = mSensorRegistry.getNumShedEvents(sensorEntry.first);
+            if (numShedEvents > 0) {
+                stream << "  " << sensorEntry.second.name << ": " << numShedEvents << std::endl;
+            }
+        }
+    };
+    dumpShedEvents(mSensors);
+    {
+        std::lock_guard<std::mutex> lock(mDynamicSensorsMutex);
+        dumpShedEvents(mDynamicSensors);
+    }
+    stream << "Sensor events suppressed as repeats:" << std::endl;
+    auto dumpSuppressedEvents = [&](const std::map<int32_t, SensorInfo>& sensors) {
+        for (const auto& sensorEntry : sensors) {
+            uint64_t numSuppressedEvents =
+                    mSensorRegistry.getNumSuppressedEvents(sensorEntry.first);
+            if (numSuppressedEvents > 0) {
+                stream << "  " << sensorEntry.second.name << ": " << numSuppressedEvents
+                       << std::endl;
+            }
+        }
+    };
+    dumpSuppressedEvents(mSensors);
+    {
+        std::lock_guard<std::mutex> lock(mDynamicSensorsMutex);
+        dumpSuppressedEvents(mDynamicSensors);
+    }
+    mSoftwareBatcher.dump(stream);
+    mEventRecorder.dump(stream);
+    {
+        std::lock_guard<std::mutex> lock(mDirectChannelMutex);
+        stream << "Direct channels (" << mEmulatedDirectReportSensors.size()
+               << " sensors emulated):" << std::endl;
+        for (const auto& channelEntry : mDirectChannels) {
+            const DirectChannel& channel = *channelEntry.second;
+            stream << "  " << channelEntry.first << ": owner ";
+            if (channel.getOwner() >= 0) {
+                stream << mSubHalList[channel.getOwner()]->getName() << " ("
+                       << channel.getSubHalChannelHandle() << ")";
+            } else {
+                stream << (channel.getOwner() == DirectChannel::kProxyOwner ? "proxy" : "none");
+            }
+            stream << ", " << channel.getNumNativeReports() << " native reports, "
+                   << channel.getNumEmulatedReports() << " emulated reports" << std::endl;
+        }
+    }
+    bool resetLatency = std::find(args.begin(), args.end(), kResetLatencyArg) != args.end();
+    stream << "Post to event queue write latencies (pass " << kResetLatencyArg << " to reset):"
+           << std::endl;
+    stream << "  Wake-up events: ";
+    mWakeupPostToWriteLatency.dump(stream);
+    stream << "  Non wake-up events: ";
+    mNonWakeupPostToWriteLatency.dump(stream);
+    if (resetLatency) {
+        mWakeupPostToWriteLatency.reset();
+        mNonWakeupPostToWriteLatency.reset();
+    }
+    stream << "HIDL calls (pass " << kResetLatencyArg << " to reset):" << std::endl;
+    for (size_t i = 0; i < kNumMethods; i++) {
+        if (mMethodLatency[i].getCount() > 0) {
+            stream << "  " << kMethodNames[i] << ": ";
+            mMethodLatency[i].dump(stream);
+        }
+        if (resetLatency) {
+            mMethodLatency[i].reset();
+        }
+    }
+    stream << "Threads (notify to run latency):" << std::endl;
+    stream << "  ";
+    mPendingWritesThreadConfig.dump(stream);
+    stream << "    ";
+    mPendingWritesWakeLatency.dump(stream);
+    stream << "  ";
+    mWakelockThreadConfig.dump(stream);
+    stream << "    ";
+    mWakelockWakeLatency.dump(stream);
+    stream << "  ";
+    mSoftwareBatcher.getThreadConfig().dump(stream);
+    if (resetLatency) {
+        mPendingWritesWakeLatency.reset();
+        mWakelockWakeLatency.reset();
+    }
+    stream << "Sensor latencies (pass " << kResetLatencyArg << " to reset):" << std::endl;
+    for (const auto& sensorEntry : mSensors) {
+        dumpSensorLatency(stream, sensorEntry.second, resetLatency);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mDynamicSensorsMutex);
+        for (const auto& sensorEntry : mDynamicSensors) {
+            dumpSensorLatency(stream, sensorEntry.second, resetLatency);
+        }
+    }
+    // Copied under the initialize mutex, as reloading the subhals adds to the list, and released
+    // before the dumps of the subhals so that a slow one doesn't hold up initialize().
+    std::vector<std::shared_ptr<ISubHalWrapperBase>> subHals;
+    std::vector<int64_t> subHalInitializeDurationsNs;
+    {
+        std::lock_guard<std::mutex> lock(mInitializeMutex);
+        subHals = mSubHalList;
+        subHalInitializeDurationsNs = mSubHalInitializeDurationsNs;
+    }
+    stream << "SubHals (" << subHals.size() << "):" << std::endl;
+    for (size_t i = 0; i < subHals.size(); i++) {
+        auto& subHal = subHals[i];
         stream << "  Name: " << subHal->getName() << std::endl;
+        if (i < subHalInitializeDurationsNs.size()) {
+            stream << "    Initialization took: " << msFromNs(subHalInitializeDurationsNs[i])
+                   << " ms" << std::endl;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mWakelockStatsMutex);
+            mSubHalWakelockStats[i].dump(stream, getTimeNow());
+        }
         stream << "  Debug dump: " << std::endl;
         android::base::WriteStringToFd(stream.str(), writeFd);
         subHal->debug(fd, {});
@@ -418,7 +904,20 @@ Return<void> HalProxy::onDynamicSensorsConnected(const hidl_vec<SensorInfo>& dyn
                       sensor.name.c_str());
             } else {
                 sensor.sensorHandle = setSubHalIndex(sensor.sensorHandle, subHalIndex);
+                EventFilter filter;
+                int64_t dedupKeepaliveNs;
+                bool softwareBatch;
+                if (!mSensorPatches.apply(&sensor, &filter, &dedupKeepaliveNs, &softwareBatch)) {
+                    continue;
+                }
+                // Direct report isn't emulated for dynamic sensors.
+                if (subHalIndex != mDirectChannelSubHalIndex) {
+                    sensor.flags &= ~(V1_0::SensorFlagBits::MASK_DIRECT_REPORT |
+                                      V1_0::SensorFlagBits::MASK_DIRECT_CHANNEL);
+                }
                 mDynamicSensors[sensor.sensorHandle] = sensor;
+                mSensorRegistry.add(sensor, filter, dedupKeepaliveNs);
+                mEventRecorder.recordSensor(sensor);
                 sensors.push_back(sensor);
             }
         }
@@ -440,6 +939,7 @@ Return<void> HalProxy::onDynamicSensorsDisconnected(
                 sensorHandle = setSubHalIndex(sensorHandle, subHalIndex);
                 if (mDynamicSensors.find(sensorHandle) != mDynamicSensors.end()) {
                     mDynamicSensors.erase(sensorHandle);
+                    mSensorRegistry.remove(sensorHandle);
                     sensorHandles.push_back(sensorHandle);
                 }
             }
@@ -450,92 +950,352 @@ Return<void> HalProxy::onDynamicSensorsDisconnected(
 }
 
 void HalProxy::initializeSubHalListFromConfigFile(const char* configFileName) {
+    std::vector<std::string> subHalLibraryFiles;
+    if (!readSubHalConfigFile(configFileName, &subHalLibraryFiles)) {
+        return;
+    }
+
+    bool lazyLoad = android::base::GetBoolProperty(kLazyLoadProperty, false);
+    std::string buildFingerprint;
+    std::vector<SubHalCache::Library> libraries;
+    if (lazyLoad) {
+        buildFingerprint = SubHalCache::getBuildFingerprint();
+        if (buildFingerprint.empty()) {
+            ALOGW("Unknown vendor build, loading all subhals");
+            lazyLoad = false;
+        }
+    }
+    if (lazyLoad) {
+        for (const std::string& file : subHalLibraryFiles) {
+            libraries.push_back({file, getSubHalSharedObjectStamp(file)});
+        }
+        if (initializeLazySubHalList(buildFingerprint, libraries)) {
+            return;
+        }
+    }
+
+    // Libraries are loaded concurrently, then added in the order of the config file so that
+    // subhal indices don't depend on which library loaded first.
+    std::vector<std::shared_ptr<ISubHalWrapperBase>> subHals(subHalLibraryFiles.size());
+    runInParallel(subHalLibraryFiles.size(), [&](size_t i) {
+        subHals[i] = loadSubHal(subHalLibraryFiles[i]);
+    });
+    for (size_t i = 0; i < subHals.size(); i++) {
+        if (subHals[i] != nullptr) {
+            mSubHalList.push_back(std::move(subHals[i]));
+            mSubHalLibraryFiles.push_back(subHalLibraryFiles[i]);
+        }
+    }
+
+    if (lazyLoad) {
+        writeSubHalCache(buildFingerprint, libraries, mSubHalLibraryFiles);
+    }
+}
+
+bool HalProxy::readSubHalConfigFile(const char* configFileName,
+                                    std::vector<std::string>* libraryFiles) {
     std::ifstream subHalConfigStream(configFileName);
     if (!subHalConfigStream) {
         ALOGE("Failed to load subHal config file: %s", configFileName);
-    } else {
-        std::string subHalLibraryFile;
-        while (subHalConfigStream >> subHalLibraryFile) {
-            void* handle = getHandleForSubHalSharedObject(subHalLibraryFile);
-            if (handle == nullptr) {
-                ALOGE("dlopen failed for library: %s", subHalLibraryFile.c_str());
-            } else {
-                SensorsHalGetSubHalFunc* sensorsHalGetSubHalPtr =
-                        (SensorsHalGetSubHalFunc*)dlsym(handle, "sensorsHalGetSubHal");
-                if (sensorsHalGetSubHalPtr != nullptr) {
-                    std::function<SensorsHalGetSubHalFunc> sensorsHalGetSubHal =
-                            *sensorsHalGetSubHalPtr;
-                    uint32_t version;
-                    ISensorsSubHalV2_0* subHal = sensorsHalGetSubHal(&version);
-                    if (version != SUB_HAL_2_0_VERSION) {
-                        ALOGE("SubHal version was not 2.0 for library: %s",
-                              subHalLibraryFile.c_str());
-                    } else {
-                        ALOGV("Loaded SubHal from library: %s", subHalLibraryFile.c_str());
-                        mSubHalList.push_back(std::make_unique<SubHalWrapperV2_0>(subHal));
-                    }
-                } else {
-                    SensorsHalGetSubHalV2_1Func* getSubHalV2_1Ptr =
-                            (SensorsHalGetSubHalV2_1Func*)dlsym(handle, "sensorsHalGetSubHal_2_1");
-
-                    if (getSubHalV2_1Ptr == nullptr) {
-                        ALOGE("Failed to locate sensorsHalGetSubHal function for library: %s",
-                              subHalLibraryFile.c_str());
-                    } else {
-                        std::function<SensorsHalGetSubHalV2_1Func> sensorsHalGetSubHal_2_1 =
-                                *getSubHalV2_1Ptr;
-                        uint32_t version;
-                        ISensorsSubHalV2_1* subHal = sensorsHalGetSubHal_2_1(&version);
-                        if (version != SUB_HAL_2_1_VERSION) {
-                            ALOGE("SubHal version was not 2.1 for library: %s",
-                                  subHalLibraryFile.c_str());
-                        } else {
-                            ALOGV("Loaded SubHal from library: %s", subHalLibraryFile.c_str());
-                            mSubHalList.push_back(std::make_unique<SubHalWrapperV2_1>(subHal));
-                        }
-                    }
-                }
+        return false;
+    }
+
+    std::string subHalLibraryFile;
+    while (subHalConfigStream >> subHalLibraryFile) {
+        libraryFiles->push_back(subHalLibraryFile);
+    }
+    return true;
+}
+
+void HalProxy::reloadSubHals(std::ostream& stream) {
+    std::lock_guard<std::mutex> lock(mInitializeMutex);
+    std::lock_guard<std::mutex> operationModeLock(mOperationModeMutex);
+
+    stream << "Reloading subhals from " << kMultiHalConfigFile << ":" << std::endl;
+    std::vector<std::string> libraryFiles;
+    if (!readSubHalConfigFile(kMultiHalConfigFile, &libraryFiles)) {
+        stream << "  Failed to read the config file" << std::endl;
+        return;
+    }
+    auto isListed = [&](const std::string& libraryFile) {
+        return std::find(libraryFiles.begin(), libraryFiles.end(), libraryFile) !=
+               libraryFiles.end();
+    };
+
+    for (size_t i = 0; i < mSubHalList.size(); i++) {
+        const std::string& libraryFile = mSubHalLibraryFiles[i];
+        if (libraryFile.empty() || isListed(libraryFile)) {
+            continue;
+        }
+        auto subHalEntry = mReloadedSubHalSensors.find(i);
+        if (subHalEntry == mReloadedSubHalSensors.end()) {
+            stream << "  " << mSubHalList[i]->getName() << " (" << libraryFile
+                   << ") stays loaded until the service restarts" << std::endl;
+            continue;
+        }
+
+        std::vector<int32_t> sensorHandles;
+        for (const SensorInfo& sensor : subHalEntry->second) {
+            if (subHalIndexIsClear(sensor.sensorHandle)) {
+                activate(setSubHalIndex(sensor.sensorHandle, i), false /* enabled */);
+                sensorHandles.push_back(sensor.sensorHandle);
+            }
+        }
+        if (mDynamicSensorsCallback != nullptr) {
+            onDynamicSensorsDisconnected(sensorHandles, static_cast<int32_t>(i));
+        }
+        stream << "  Unloaded " << mSubHalList[i]->getName() << " (" << libraryFile << ")"
+               << std::endl;
+        ALOGI("Unloaded subhal %s", mSubHalList[i]->getName().c_str());
+        mReloadedSubHalSensors.erase(subHalEntry);
+        mSubHalLibraryFiles[i].clear();
+    }
+
+    for (const std::string& libraryFile : libraryFiles) {
+        if (std::find(mSubHalLibraryFiles.begin(), mSubHalLibraryFiles.end(), libraryFile) !=
+            mSubHalLibraryFiles.end()) {
+            continue;
+        }
+        // Indices of unloaded subhals aren't reused, the framework may still use their handles.
+        if (mSubHalList.size() == kMaxSubHals) {
+            stream << "  No subhal index left to load " << libraryFile << std::endl;
+            break;
+        }
+        std::shared_ptr<ISubHalWrapperBase> subHal = loadSubHal(libraryFile);
+        if (subHal == nullptr) {
+            stream << "  Failed to load " << libraryFile << std::endl;
+            continue;
+        }
+        std::vector<SensorInfo> sensors;
+        auto result = subHal->getSensorsList(
+                [&](const auto& list) { sensors.assign(list.begin(), list.end()); });
+        if (!result.isOk()) {
+            stream << "  getSensorsList call failed for " << libraryFile << std::endl;
+            continue;
+        }
+
+        size_t subHalIndex = mSubHalList.size();
+        mSubHalList.push_back(std::make_shared<SerializedSubHalWrapper>(std::move(subHal)));
+        mSubHalLibraryFiles.push_back(libraryFile);
+        mSubHalWakelockRefCounters.push_back(
+                new SubHalWakelockRefCounter(this, static_cast<int32_t>(subHalIndex)));
+        {
+            std::lock_guard<std::mutex> statsLock(mWakelockStatsMutex);
+            mSubHalWakelockStats.resize(mSubHalList.size());
+        }
+        mReloadedSubHalSensors[subHalIndex] = std::move(sensors);
+        mNumSubHals.store(mSubHalList.size());
+
+        // Otherwise the subhal is initialized along with the others once the framework starts.
+        if (mDynamicSensorsCallback != nullptr) {
+            int64_t startTime = ::android::elapsedRealtimeNano();
+            Result initializeResult = mSubHalList[subHalIndex]->initialize(
+                    this, mSubHalWakelockRefCounters[subHalIndex].get(), subHalIndex);
+            mSubHalInitializeDurationsNs.resize(mSubHalList.size());
+            mSubHalInitializeDurationsNs[subHalIndex] =
+                    ::android::elapsedRealtimeNano() - startTime;
+            if (initializeResult != Result::OK) {
+                stream << "  Subhal " << mSubHalList[subHalIndex]->getName()
+                       << " failed to initialize" << std::endl;
             }
+            if (mCurrentOperationMode.load() != OperationMode::NORMAL) {
+                mSubHalList[subHalIndex]->setOperationMode(mCurrentOperationMode.load());
+            }
+            connectReloadedSubHal(subHalIndex);
+        }
+        stream << "  Loaded " << mSubHalList[subHalIndex]->getName() << " (" << libraryFile
+               << ") with " << mReloadedSubHalSensors[subHalIndex].size() << " sensors"
+               << std::endl;
+        ALOGI("Loaded subhal %s from %s", mSubHalList[subHalIndex]->getName().c_str(),
+              libraryFile.c_str());
+    }
+}
+
+void HalProxy::connectReloadedSubHal(size_t subHalIndex) {
+    onDynamicSensorsConnected(mReloadedSubHalSensors[subHalIndex],
+                              static_cast<int32_t>(subHalIndex));
+}
+
+bool HalProxy::initializeLazySubHalList(const std::string& buildFingerprint,
+                                        const std::vector<SubHalCache::Library>& libraries) {
+    SubHalCache cache;
+    if (!cache.read(kSubHalCacheFile)) {
+        ALOGI("No subhal cache, loading all subhals");
+        return false;
+    }
+    if (cache.buildFingerprint != buildFingerprint) {
+        // The libraries may have been updated with the build without their stamps changing.
+        ALOGI("Subhal cache written by build %s, dropping it and loading all subhals",
+              cache.buildFingerprint.c_str());
+        std::remove(kSubHalCacheFile);
+        return false;
+    }
+    if (cache.libraries != libraries) {
+        ALOGI("Subhal libraries changed since they were cached, loading all subhals");
+        return false;
+    }
+
+    // The cache holds the subhals that loaded in index order, so handles are the same as when
+    // loading all of them.
+    for (const SubHalCache::SubHal& subHal : cache.subHals) {
+        std::string libraryFile = subHal.libraryFile;
+        mSubHalList.push_back(std::make_shared<LazySubHalWrapper>(
+                subHal.name, subHal.sensors, [this, libraryFile] {
+                    return loadSubHal(libraryFile);
+                }));
+        mSubHalLibraryFiles.push_back(libraryFile);
+    }
+    return true;
+}
+
+void HalProxy::writeSubHalCache(const std::string& buildFingerprint,
+                                const std::vector<SubHalCache::Library>& libraries,
+                                const std::vector<std::string>& loadedLibraryFiles) {
+    SubHalCache cache;
+    cache.buildFingerprint = buildFingerprint;
+    cache.libraries = libraries;
+    for (size_t i = 0; i < mSubHalList.size(); i++) {
+        SubHalCache::SubHal subHal = {loadedLibraryFiles[i], mSubHalList[i]->getName(), {}};
+        auto result = mSubHalList[i]->getSensorsList([&](const auto& list) {
+            subHal.sensors.assign(list.begin(), list.end());
+        });
+        if (!result.isOk()) {
+            ALOGE("getSensorsList call failed for SubHal: %s, not caching subhals",
+                  subHal.name.c_str());
+            return;
+        }
+        cache.subHals.push_back(std::move(subHal));
+    }
+    if (cache.write(kSubHalCacheFile)) {
+        ALOGI("Cached %zu subhals to load them on demand", cache.subHals.size());
+    }
+}
+
+std::string HalProxy::getSubHalSharedObjectStamp(const std::string& filename) {
+    for (const std::string& dir : kSubHalShareObjectLocations) {
+        std::string stamp = SubHalCache::getLibraryStamp(dir + filename);
+        if (!stamp.empty()) {
+            return stamp;
+        }
+    }
+    return "";
+}
+
+std::shared_ptr<ISubHalWrapperBase> HalProxy::loadSubHal(const std::string& subHalLibraryFile) {
+    void* handle = getHandleForSubHalSharedObject(subHalLibraryFile);
+    if (handle == nullptr) {
+        ALOGE("dlopen failed for library: %s", subHalLibraryFile.c_str());
+        return nullptr;
+    }
+
+    SensorsHalGetSubHalFunc* sensorsHalGetSubHalPtr =
+            (SensorsHalGetSubHalFunc*)dlsym(handle, "sensorsHalGetSubHal");
+    if (sensorsHalGetSubHalPtr != nullptr) {
+        std::function<SensorsHalGetSubHalFunc> sensorsHalGetSubHal = *sensorsHalGetSubHalPtr;
+        uint32_t version;
+        ISensorsSubHalV2_0* subHal = sensorsHalGetSubHal(&version);
+        if (version != SUB_HAL_2_0_VERSION) {
+            ALOGE("SubHal version was not 2.0 for library: %s", subHalLibraryFile.c_str());
+            return nullptr;
         }
+        ALOGV("Loaded SubHal from library: %s", subHalLibraryFile.c_str());
+        return std::make_shared<SubHalWrapperV2_0>(subHal);
+    }
+
+    SensorsHalGetSubHalV2_1Func* getSubHalV2_1Ptr =
+            (SensorsHalGetSubHalV2_1Func*)dlsym(handle, "sensorsHalGetSubHal_2_1");
+    if (getSubHalV2_1Ptr == nullptr) {
+        ALOGE("Failed to locate sensorsHalGetSubHal function for library: %s",
+              subHalLibraryFile.c_str());
+        return nullptr;
+    }
+    std::function<SensorsHalGetSubHalV2_1Func> sensorsHalGetSubHal_2_1 = *getSubHalV2_1Ptr;
+    uint32_t version;
+    ISensorsSubHalV2_1* subHal = sensorsHalGetSubHal_2_1(&version);
+    if (version != SUB_HAL_2_1_VERSION) {
+        ALOGE("SubHal version was not 2.1 for library: %s", subHalLibraryFile.c_str());
+        return nullptr;
     }
+    ALOGV("Loaded SubHal from library: %s", subHalLibraryFile.c_str());
+    return std::make_shared<SubHalWrapperV2_1>(subHal);
 }
 
 void HalProxy::initializeSensorList() {
-    for (size_t subHalIndex = 0; subHalIndex < mSubHalList.size(); subHalIndex++) {
+    // The lists are queried concurrently, then processed in subhal order.
+    int64_t startTime = ::android::elapsedRealtimeNano();
+    std::vector<std::vector<SensorInfo>> subHalSensors(mSubHalList.size());
+    std::unique_ptr<bool[]> subHalSensorsOk(new bool[mSubHalList.size()]());
+    runInParallel(mSubHalList.size(), [&](size_t subHalIndex) {
         auto result = mSubHalList[subHalIndex]->getSensorsList([&](const auto& list) {
-            for (SensorInfo sensor : list) {
-                if (!subHalIndexIsClear(sensor.sensorHandle)) {
-                    ALOGE("SubHal sensorHandle's first byte was not 0");
-                } else {
-                    ALOGV("Loaded sensor: %s", sensor.name.c_str());
-                    sensor.sensorHandle = setSubHalIndex(sensor.sensorHandle, subHalIndex);
-                    setDirectChannelFlags(&sensor, mSubHalList[subHalIndex]);
-                    bool keep = patchXiaomiPickupSensor(sensor);
-                    if (!keep) {
-                        continue;
-                    }
-
-                    mSensors[sensor.sensorHandle] = sensor;
-                }
-            }
+            subHalSensors[subHalIndex].assign(list.begin(), list.end());
         });
-        if (!result.isOk()) {
+        subHalSensorsOk[subHalIndex] = result.isOk();
+    });
+
+    // Direct channels are handed to the first subhal that reports a sensor natively to them.
+    for (size_t subHalIndex = 0;
+         subHalIndex < mSubHalList.size() && mDirectChannelSubHalIndex < 0; subHalIndex++) {
+        for (const SensorInfo& sensor : subHalSensors[subHalIndex]) {
+            if (subHalSensorsOk[subHalIndex] &&
+                (sensor.flags & (V1_0::SensorFlagBits::MASK_DIRECT_REPORT |
+                                 V1_0::SensorFlagBits::MASK_DIRECT_CHANNEL)) != 0) {
+                mDirectChannelSubHalIndex = static_cast<int32_t>(subHalIndex);
+                break;
+            }
+        }
+    }
+
+    for (size_t subHalIndex = 0; subHalIndex < mSubHalList.size(); subHalIndex++) {
+        if (!subHalSensorsOk[subHalIndex]) {
             ALOGE("getSensorsList call failed for SubHal: %s",
                   mSubHalList[subHalIndex]->getName().c_str());
+            continue;
+        }
+        for (SensorInfo& sensor : subHalSensors[subHalIndex]) {
+            if (!subHalIndexIsClear(sensor.sensorHandle)) {
+                ALOGE("SubHal sensorHandle's first byte was not 0");
+            } else {
+                ALOGV("Loaded sensor: %s", sensor.name.c_str());
+                sensor.sensorHandle = setSubHalIndex(sensor.sensorHandle, subHalIndex);
+                EventFilter filter;
+                int64_t dedupKeepaliveNs;
+                bool softwareBatch;
+                if (!mSensorPatches.apply(&sensor, &filter, &dedupKeepaliveNs, &softwareBatch)) {
+                    ALOGV("Removed sensor: %s", sensor.name.c_str());
+                    continue;
+                }
+                setDirectChannelFlags(&sensor);
+                if (softwareBatch && SoftwareBatcher::canBatch(sensor)) {
+                    // A batch is flushed once it holds kFifoSize events, but no room is reserved.
+                    mSoftwareBatcher.addSensor(sensor.sensorHandle);
+                    sensor.fifoReservedEventCount = 0;
+                    sensor.fifoMaxEventCount = SoftwareBatcher::kFifoSize;
+                }
+
+                mSensors[sensor.sensorHandle] = sensor;
+                mSensorRegistry.add(sensor, filter, dedupKeepaliveNs);
+            }
         }
     }
+    rebuildSensorListCache();
+    mSensorListDurationNs = ::android::elapsedRealtimeNano() - startTime;
 }
 
-void* HalProxy::getHandleForSubHalSharedObject(const std::string& filename) {
-    static const std::string kSubHalShareObjectLocations[] = {
-            "",  // Default locations will be searched
-#ifdef __LP64__
-            "/vendor/lib64/hw/", "/odm/lib64/hw/"
-#else
-            "/vendor/lib/hw/", "/odm/lib/hw/"
-#endif
-    };
+void HalProxy::rebuildSensorListCache() {
+    auto sensorList = std::make_shared<SensorListCache>();
+    sensorList->sensorsV2_1.resize(mSensors.size());
+    sensorList->sensorsV1_0.resize(mSensors.size());
+    size_t i = 0;
+    for (const auto& iter : mSensors) {
+        sensorList->sensorsV2_1[i] = iter.second;
+        sensorList->sensorsV1_0[i] = convertToOldSensorInfo(iter.second);
+        i++;
+    }
+    std::atomic_store(&mSensorListCache,
+                      std::shared_ptr<const SensorListCache>(std::move(sensorList)));
+}
 
+void* HalProxy::getHandleForSubHalSharedObject(const std::string& filename) {
     for (const std::string& dir : kSubHalShareObjectLocations) {
         void* handle = dlopen((dir + filename).c_str(), RTLD_NOW);
         if (handle != nullptr) {
@@ -546,6 +1306,26 @@ void* HalProxy::getHandleForSubHalSharedObject(const std::string& filename) {
 }
 
 void HalProxy::init() {
+    // Subhals loaded later are added without moving the others, which are used concurrently.
+    mSubHalList.reserve(kMaxSubHals);
+    mSubHalWakelockRefCounters.reserve(kMaxSubHals);
+    mSubHalInitializeDurationsNs.reserve(kMaxSubHals);
+    mSubHalLibraryFiles.resize(mSubHalList.size());
+
+    // The framework calls the proxy from several binder threads.
+    for (auto& subHal : mSubHalList) {
+        subHal = std::make_shared<SerializedSubHalWrapper>(std::move(subHal));
+    }
+    for (size_t i = 0; i < mSubHalList.size(); i++) {
+        mSubHalWakelockRefCounters.push_back(
+                new SubHalWakelockRefCounter(this, static_cast<int32_t>(i)));
+    }
+    mNumSubHals.store(mSubHalList.size());
+    mSubHalWakelockStats.resize(mSubHalList.size());
+    mLastStatsTimeNs = ::android::elapsedRealtimeNano();
+    if (!mSensorPatches.load(kSensorPatchesFile)) {
+        ALOGI("No sensor patches loaded from %s", kSensorPatchesFile);
+    }
     initializeSensorList();
 }
 
@@ -577,14 +1357,23 @@ void HalProxy::disableAllSensors() {
         int32_t sensorHandle = sensorEntry.first;
         activate(sensorHandle, false /* enabled */);
     }
-    std::lock_guard<std::mutex> dynamicSensorsLock(mDynamicSensorsMutex);
-    for (const auto& sensorEntry : mDynamicSensors) {
-        int32_t sensorHandle = sensorEntry.first;
+    // Subhals may connect or disconnect dynamic sensors while they are disabled, so the mutex
+    // isn't held across the calls. There can be thousands of dynamic sensors.
+    std::vector<int32_t> dynamicSensorHandles;
+    {
+        std::lock_guard<std::mutex> dynamicSensorsLock(mDynamicSensorsMutex);
+        dynamicSensorHandles.reserve(mDynamicSensors.size());
+        for (const auto& sensorEntry : mDynamicSensors) {
+            dynamicSensorHandles.push_back(sensorEntry.first);
+        }
+    }
+    for (int32_t sensorHandle : dynamicSensorHandles) {
         activate(sensorHandle, false /* enabled */);
     }
 }
 
 void HalProxy::startPendingWritesThread(HalProxy* halProxy) {
+    halProxy->mPendingWritesThreadConfig.apply();
     halProxy->handlePendingWrites();
 }
 
@@ -592,52 +1381,196 @@ void HalProxy::handlePendingWrites() {
     // TODO(b/143302327): Find a way to optimize locking strategy maybe using two mutexes instead of
     // one.
     std::unique_lock<std::mutex> lock(mEventQueueWriteMutex);
+    // When the reader last made room for the events being written, or they started being written.
+    int64_t lastProgressNs = 0;
     while (mThreadsRun.load()) {
-        mEventQueueWriteCV.wait(
-                lock, [&] { return !mPendingWriteEventsQueue.empty() || !mThreadsRun.load(); });
+        bool caughtUp = mWakeupPendingWriteEventsQueue.empty() && mPendingWriteEventsQueue.empty();
+        if (caughtUp) {
+            mEventQueueDrainRateHz = -1;
+        }
+        mPendingWritesThreadWaiting = true;
+        mEventQueueWriteCV.wait(lock, [&] {
+            return !mWakeupPendingWriteEventsQueue.empty() || !mPendingWriteEventsQueue.empty() ||
+                   !mThreadsRun.load();
+        });
+        mPendingWritesThreadWaiting = false;
+        if (mPendingWritesNotifyTimeNs != 0) {
+            mPendingWritesWakeLatency.record(::android::elapsedRealtimeNano() -
+                                             mPendingWritesNotifyTimeNs);
+            mPendingWritesNotifyTimeNs = 0;
+        }
+        if (caughtUp) {
+            lastProgressNs = ::android::elapsedRealtimeNano();
+        }
         if (mThreadsRun.load()) {
-            std::vector<Event>& pendingWriteEvents = mPendingWriteEventsQueue.front().first;
-            size_t numWakeupEvents = mPendingWriteEventsQueue.front().second;
-            size_t eventQueueSize = mEventQueue->getQuantumCount();
-            size_t numToWrite = std::min(pendingWriteEvents.size(), eventQueueSize);
+            // Wake-up events go first, whatever non-wakeup events were queued before them.
+            bool wakeup = !mWakeupPendingWriteEventsQueue.empty();
+            PendingWriteEventsQueue& queue =
+                    wakeup ? mWakeupPendingWriteEventsQueue : mPendingWriteEventsQueue;
+            const Event* pendingWriteEvents;
+            size_t numContiguous;
+            const PendingWriteEventsQueue::Span& span =
+                    queue.front(&pendingWriteEvents, &numContiguous);
+            size_t numInSpan = span.numEvents;
+            size_t numWakeupEventsInSpan = span.numWakeupEvents;
+            int64_t postTimeNs = span.postTimeNs;
+            int64_t enqueueTimeNs = span.enqueueTimeNs;
+            double drainRateHz = mEventQueueDrainRateHz;
+            size_t numToWrite = std::min(numContiguous, mEventQueue->getQuantumCount());
+            int64_t timeoutNs = kPendingWriteTimeoutNs;
+            if (drainRateHz < 0 && !wakeup) {
+                // Until the drain rate is measured, non-wakeup events are written in small chunks
+                // that don't keep wake-up events waiting for long.
+                numToWrite = std::min(numToWrite, kMinPendingWriteChunkSize);
+                timeoutNs = kMinPendingWriteTimeoutNs;
+            } else if (drainRateHz >= 0) {
+                numToWrite = std::min(
+                        numToWrite,
+                        std::max(kMinPendingWriteChunkSize,
+                                 static_cast<size_t>(drainRateHz * kPendingWriteChunkNs / 1e9)));
+                if (drainRateHz > 0) {
+                    double drainNs = numToWrite * 1e9 / drainRateHz;
+                    timeoutNs = static_cast<int64_t>(
+                            std::clamp(4 * drainNs, static_cast<double>(kMinPendingWriteTimeoutNs),
+                                       static_cast<double>(kPendingWriteTimeoutNs)));
+                }
+            }
+            int64_t now = ::android::elapsedRealtimeNano();
+            timeoutNs = std::clamp(lastProgressNs + kPendingWriteTimeoutNs - now, INT64_C(0),
+                                   timeoutNs);
+            // Shedding load must leave the events being written where they are, and posts must
+            // not write to the fmq meanwhile.
+            mPendingWriteEventsQueueInFlight = &queue;
+            mNumPendingWriteEventsInFlight = numToWrite;
             lock.unlock();
-            if (!mEventQueue->writeBlocking(
-                        pendingWriteEvents.data(), numToWrite,
-                        static_cast<uint32_t>(EventQueueFlagBits::EVENTS_READ),
-                        static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS),
-                        kPendingWriteTimeoutNs, mEventQueueFlag)) {
-                ALOGE("Dropping %zu events after blockingWrite failed.", numToWrite);
+            size_t numWritten = writePendingEvents(pendingWriteEvents, numToWrite, timeoutNs,
+                                                   !wakeup /* yieldToWakeupEvents */, &drainRateHz);
+            now = ::android::elapsedRealtimeNano();
+            if (numWritten > 0) {
+                lastProgressNs = now;
+            }
+            // Whatever wasn't written stays queued, unless the reader is stuck.
+            bool stalled = numWritten == 0 && now - lastProgressNs >= kPendingWriteTimeoutNs;
+            size_t numToPop = stalled ? numToWrite : numWritten;
+            // The written events stay accounted for in the wakelock ref count until the framework
+            // acks them, so only partial spans with wakeup events need to be counted.
+            size_t numWakeupEvents = numWakeupEventsInSpan;
+            if (numToPop < numInSpan && numWakeupEventsInSpan > 0) {
+                numWakeupEvents = countNumWakeupEvents(pendingWriteEvents, numToPop);
+            }
+            if (stalled) {
+                ALOGE("Dropping %zu events after the reader made no room for %" PRId64 " ms.",
+                      numToPop, kPendingWriteTimeoutNs / 1000000);
+                mNumEventQueueWriteFailures.fetch_add(1, std::memory_order_relaxed);
+                mNumEventsDropped.fetch_add(numToPop, std::memory_order_relaxed);
+                for (size_t i = 0; i < numToPop; i++) {
+                    mSensorRegistry.countDroppedEvents(pendingWriteEvents[i].sensorHandle, 1);
+                }
                 if (numWakeupEvents > 0) {
-                    if (pendingWriteEvents.size() > eventQueueSize) {
-                        decrementRefCountAndMaybeReleaseWakelock(
-                                countNumWakeupEvents(pendingWriteEvents, eventQueueSize));
-                    } else {
-                        decrementRefCountAndMaybeReleaseWakelock(numWakeupEvents);
-                    }
+                    releaseWakelockRefs(numWakeupEvents, -1 /* timeoutStart */,
+                                        static_cast<int32_t>(extractSubHalIndex(
+                                                pendingWriteEvents[0].sensorHandle)),
+                                        true /* forEvents */);
                 }
+                lastProgressNs = now;
+            } else if (numWritten > 0) {
+                // The written events are only popped below, so they can still be read here.
+                recordLatency(pendingWriteEvents, numWritten, &SensorLatencyStats::postToWrite,
+                              now - postTimeNs);
+                recordLatency(pendingWriteEvents, numWritten, &SensorLatencyStats::pendingQueue,
+                              now - enqueueTimeNs);
+                (wakeup ? mWakeupPostToWriteLatency : mNonWakeupPostToWriteLatency)
+                        .record(now - postTimeNs, numWritten);
             }
             lock.lock();
-            mSizePendingWriteEventsQueue -= numToWrite;
-            if (pendingWriteEvents.size() > eventQueueSize) {
-                // TODO(b/143302327): Check if this erase operation is too inefficient. It will copy
-                // all the events ahead of it down to fill gap off array at front after the erase.
-                pendingWriteEvents.erase(pendingWriteEvents.begin(),
-                                         pendingWriteEvents.begin() + eventQueueSize);
-            } else {
-                mPendingWriteEventsQueue.pop();
+            mEventQueueDrainRateHz = drainRateHz;
+            if (numToPop > 0) {
+                queue.pop(numToPop, numWakeupEvents);
             }
+            mWakeupPendingWriteEventsQueued.store(!mWakeupPendingWriteEventsQueue.empty(),
+                                                  std::memory_order_relaxed);
+            mPendingWriteEventsQueueInFlight = nullptr;
+            mNumPendingWriteEventsInFlight = 0;
         }
     }
 }
 
+size_t HalProxy::writePendingEvents(const Event* events, size_t numEvents, int64_t timeoutNs,
+                                    bool yieldToWakeupEvents, double* drainRateHz) {
+    int64_t observedNs = ::android::elapsedRealtimeNano();
+    int64_t deadlineNs = observedNs + timeoutNs;
+    size_t available = mEventQueue->availableToWrite();
+    size_t numWritten = 0;
+    while (numWritten < numEvents && mThreadsRun.load()) {
+        // Posts don't write to the fmq meanwhile, so wake-up events posted since are written
+        // first, after the events already written.
+        if (yieldToWakeupEvents &&
+            mWakeupPendingWriteEventsQueued.load(std::memory_order_relaxed)) {
+            break;
+        }
+        size_t numChunk = std::min(numEvents - numWritten, available);
+        if (numChunk > 0) {
+            if (!mEventQueue->write(events + numWritten, numChunk)) {
+                break;
+            }
+            numWritten += numChunk;
+            available -= numChunk;
+            mEventQueueFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS));
+            continue;
+        }
+        int64_t now = ::android::elapsedRealtimeNano();
+        if (now >= deadlineNs) {
+            break;
+        }
+        uint32_t efState = 0;
+        mEventQueueFlag->wait(static_cast<uint32_t>(EventQueueFlagBits::EVENTS_READ), &efState,
+                              deadlineNs - now, true /* retry */);
+        now = ::android::elapsedRealtimeNano();
+        // Nothing else writes to the fmq while events are in flight, so all the room made since
+        // the last look was made by the reader.
+        size_t newAvailable = mEventQueue->availableToWrite();
+        int64_t elapsedNs = std::max(now - observedNs, INT64_C(1));
+        double sampleHz = (newAvailable - available) * 1e9 / elapsedNs;
+        if (*drainRateHz >= 0) {
+            double weight = std::min(1.0, static_cast<double>(elapsedNs) / kDrainRateWindowNs);
+            *drainRateHz += weight * (sampleHz - *drainRateHz);
+        } else if (newAvailable > available || elapsedNs >= kDrainRateWindowNs) {
+            // A wake left over from before the events were written says nothing yet.
+            *drainRateHz = sampleHz;
+        }
+        available = newAvailable;
+        observedNs = now;
+    }
+    return numWritten;
+}
+
+size_t HalProxy::getPendingWriteLimit() const {
+    if (mEventQueueDrainRateHz < 0) {
+        return SIZE_MAX;
+    }
+    double limit = std::min(mEventQueueDrainRateHz * kMaxPendingWriteDrainNs / 1e9,
+                            static_cast<double>(kMaxSizePendingWriteEventsQueue));
+    // Leave room for a burst as large as the fmq however slow the reader is.
+    return std::max(static_cast<size_t>(limit), mEventQueue->getQuantumCount());
+}
+
 void HalProxy::startWakelockThread(HalProxy* halProxy) {
+    halProxy->mWakelockThreadConfig.apply();
     halProxy->handleWakelocks();
 }
 
 void HalProxy::handleWakelocks() {
     std::unique_lock<std::recursive_mutex> lock(mWakelockMutex);
     while (mThreadsRun.load()) {
-        mWakelockCV.wait(lock, [&] { return mWakelockRefCount > 0 || !mThreadsRun.load(); });
+        mWakelockThreadWaiting = true;
+        mWakelockCV.wait(lock, [&] {
+            return wakelockRefCount(mWakelockState.load()) > 0 || !mThreadsRun.load();
+        });
+        mWakelockThreadWaiting = false;
+        if (mWakelockNotifyTimeNs != 0) {
+            mWakelockWakeLatency.record(::android::elapsedRealtimeNano() - mWakelockNotifyTimeNs);
+            mWakelockNotifyTimeNs = 0;
+        }
         if (mThreadsRun.load()) {
             int64_t timeLeft;
             if (sharedWakelockDidTimeout(&timeLeft)) {
@@ -650,8 +1583,10 @@ void HalProxy::handleWakelocks() {
                         static_cast<uint32_t>(WakeLockQueueFlagBits::DATA_WRITTEN), timeLeft);
                 lock.lock();
                 if (success) {
-                    decrementRefCountAndMaybeReleaseWakelock(
-                            static_cast<size_t>(numWakeLocksProcessed));
+                    // The framework acks wakeup events in the order they were posted.
+                    releaseWakelockRefs(static_cast<size_t>(numWakeLocksProcessed),
+                                        -1 /* timeoutStart */, kUnattributedSubHalIndex,
+                                        true /* forEvents */);
                 }
             }
         }
@@ -661,7 +1596,7 @@ void HalProxy::handleWakelocks() {
 
 bool HalProxy::sharedWakelockDidTimeout(int64_t* timeLeft) {
     bool didTimeout;
-    int64_t duration = getTimeNow() - mWakelockTimeoutStartTime;
+    int64_t duration = getTimeNow() - mWakelockTimeoutStartTime.load();
     if (duration > kWakelockTimeoutNs) {
         didTimeout = true;
     } else {
@@ -673,85 +1608,477 @@ bool HalProxy::sharedWakelockDidTimeout(int64_t* timeLeft) {
 
 void HalProxy::resetSharedWakelock() {
     std::lock_guard<std::recursive_mutex> lockGuard(mWakelockMutex);
-    decrementRefCountAndMaybeReleaseWakelock(mWakelockRefCount);
-    mWakelockTimeoutResetTime = getTimeNow();
+    // Counting the reset turns the releases of the refs added so far into no-ops.
+    uint64_t state = mWakelockState.load();
+    while (!mWakelockState.compare_exchange_weak(
+            state, static_cast<uint64_t>(wakelockResetCount(state) + 1) << kWakelockRefCountBits)) {
+    }
+    int64_t now = getTimeNow();
+    if (wakelockRefCount(state) > 0) {
+        release_wake_lock(kWakelockName);
+        std::lock_guard<std::mutex> statsLock(mWakelockStatsMutex);
+        for (SubHalWakelockStats& stats : mSubHalWakelockStats) {
+            stats.releaseAll(now);
+        }
+        mWakeupEventOwners.clear();
+    }
+    mWakelockTimeoutResetTime = now;
 }
 
-void HalProxy::postEventsToMessageQueue(const std::vector<Event>& events, size_t numWakeupEvents,
+void HalProxy::postEventsToMessageQueue(const Event* events, size_t numEvents,
+                                        size_t numWakeupEvents, int64_t postTimeNs,
                                         V2_0::implementation::ScopedWakelock wakelock) {
-    size_t numToWrite = 0;
+    writeEventsToMessageQueue(events, numEvents, numWakeupEvents, postTimeNs, wakelock.isLocked());
+}
+
+void HalProxy::postEventsToDirectChannels(const Event* events, size_t numEvents) {
+    std::lock_guard<std::mutex> lock(mDirectChannelWriteMutex);
+    for (auto& channelEntry : mDirectChannels) {
+        for (size_t i = 0; i < numEvents; i++) {
+            channelEntry.second->write(events[i]);
+        }
+    }
+}
+
+void HalProxy::postEventsToSoftwareBatches(const Event* events, size_t numEvents,
+                                           int64_t postTimeNs) {
+    mSoftwareBatcher.push(events, numEvents, postTimeNs);
+}
+
+void HalProxy::writeSoftwareBatchToMessageQueue(const Event* events, size_t numEvents,
+                                                int64_t postTimeNs) {
+    if (!mThreadsRun.load() || mEventQueue == nullptr) {
+        return;
+    }
+    writeEventsToMessageQueue(events, numEvents, 0 /* numWakeupEvents */, postTimeNs,
+                              false /* acquireWakelock */);
+}
+
+void HalProxy::writeEventsToMessageQueue(const Event* events, size_t numEvents,
+                                         size_t numWakeupEvents, int64_t postTimeNs,
+                                         bool acquireWakelock) {
+    mNumPostsInFlight.fetch_add(1);
     std::lock_guard<std::mutex> lock(mEventQueueWriteMutex);
-    if (wakelock.isLocked()) {
-        incrementRefCountAndMaybeAcquireWakelock(numWakeupEvents);
-    }
-    if (mPendingWriteEventsQueue.empty()) {
-        numToWrite = std::min(events.size(), mEventQueue->availableToWrite());
-        if (numToWrite > 0) {
-            if (mEventQueue->write(events.data(), numToWrite)) {
-                // TODO(b/143302327): While loop if mEventQueue->avaiableToWrite > 0 to possibly fit
-                // in more writes immediately
-                mEventQueueFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS));
-            } else {
-                numToWrite = 0;
+    if (acquireWakelock) {
+        // All the events of a post come from the same subhal.
+        acquireWakelockRefs(numWakeupEvents, nullptr /* timeoutStart */,
+                            static_cast<int32_t>(extractSubHalIndex(events[0].sensorHandle)),
+                            true /* forEvents */);
+    }
+    int64_t now = ::android::elapsedRealtimeNano();
+    if (numWakeupEvents == 0) {
+        writeEventsToMessageQueueLane(mPendingWriteEventsQueue, events, numEvents, postTimeNs,
+                                      now);
+    } else if (numWakeupEvents == numEvents) {
+        writeEventsToMessageQueueLane(mWakeupPendingWriteEventsQueue, events, numEvents,
+                                      postTimeNs, now);
+    } else {
+        // Each sensor is either wake-up or not, so splitting the post keeps the order of the
+        // events of every sensor.
+        mSplitPostEvents.clear();
+        for (size_t i = 0; i < numEvents; i++) {
+            if (mSensorRegistry.isWakeUpSensor(events[i].sensorHandle)) {
+                mSplitPostEvents.push_back(events[i]);
+            }
+        }
+        size_t numSplitWakeupEvents = mSplitPostEvents.size();
+        for (size_t i = 0; i < numEvents; i++) {
+            if (!mSensorRegistry.isWakeUpSensor(events[i].sensorHandle)) {
+                mSplitPostEvents.push_back(events[i]);
+            }
+        }
+        writeEventsToMessageQueueLane(mWakeupPendingWriteEventsQueue, mSplitPostEvents.data(),
+                                      numSplitWakeupEvents, postTimeNs, now);
+        writeEventsToMessageQueueLane(mPendingWriteEventsQueue,
+                                      mSplitPostEvents.data() + numSplitWakeupEvents,
+                                      numEvents - numSplitWakeupEvents, postTimeNs, now);
+    }
+    // Posts from other subhals that are already waiting on the mutex will be read together with
+    // these events, so leave the wake to the last of them, unless posts have kept overlapping for
+    // so long that the reader would fall behind.
+    bool lastPost = mNumPostsInFlight.fetch_sub(1) == 1;
+    if (mEventQueueWakePending &&
+        (lastPost || now - mEventQueueWakePendingSinceNs >= kMaxEventQueueWakeDeferralNs)) {
+        wakeEventQueueReader();
+    }
+}
+
+void HalProxy::wakeEventQueueReader() {
+    mEventQueueFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS));
+    mEventQueueWakePending = false;
+    mNumEventQueueWakes++;
+}
+
+void HalProxy::writeEventsToMessageQueueLane(PendingWriteEventsQueue& queue, const Event* events,
+                                             size_t numEvents, int64_t postTimeNs, int64_t now) {
+    if (numEvents == 0) {
+        return;
+    }
+    bool wakeup = &queue == &mWakeupPendingWriteEventsQueue;
+    size_t numToWrite = 0;
+    // The pending writes thread is the only other writer of the fmq. Queued wake-up events are
+    // written before anything else, queued non-wakeup events only before non-wakeup events.
+    if (mPendingWriteEventsQueueInFlight == nullptr && queue.empty() &&
+        mWakeupPendingWriteEventsQueue.empty()) {
+        // Write what fits. Once the fmq is full, the reader is woken up for the events written so
+        // far, whose wake would otherwise be deferred, and whatever room it made by then is used
+        // before the rest goes to the pending write events queue.
+        bool wokeReader = false;
+        while (numToWrite < numEvents) {
+            size_t numChunk = std::min(numEvents - numToWrite, mEventQueue->availableToWrite());
+            if (numChunk == 0) {
+                if (wokeReader || !mEventQueueWakePending) {
+                    break;
+                }
+                wakeEventQueueReader();
+                wokeReader = true;
+                continue;
+            }
+            if (!mEventQueue->write(events + numToWrite, numChunk)) {
+                break;
+            }
+            numToWrite += numChunk;
+            if (!mEventQueueWakePending) {
+                mEventQueueWakePending = true;
+                mEventQueueWakePendingSinceNs = now;
             }
         }
     }
-    size_t numLeft = events.size() - numToWrite;
-    if (numToWrite < events.size() &&
-        mSizePendingWriteEventsQueue + numLeft <= kMaxSizePendingWriteEventsQueue) {
-        std::vector<Event> eventsLeft(events.begin() + numToWrite, events.end());
-        mPendingWriteEventsQueue.push({eventsLeft, numWakeupEvents});
-        mSizePendingWriteEventsQueue += numLeft;
-        mMostEventsObservedPendingWriteEventsQueue =
-                std::max(mMostEventsObservedPendingWriteEventsQueue, mSizePendingWriteEventsQueue);
+    mNumEventsPostedToEventQueue += numToWrite;
+    if (numToWrite > 0) {
+        recordLatency(events, numToWrite, &SensorLatencyStats::postToWrite, now - postTimeNs);
+        (wakeup ? mWakeupPostToWriteLatency : mNonWakeupPostToWriteLatency)
+                .record(now - postTimeNs, numToWrite);
+    }
+    size_t numLeft = numEvents - numToWrite;
+    if (numLeft > 0) {
+        const Event* eventsLeft = events + numToWrite;
+        // Wake-up sensors have no sheddable events.
+        size_t numSheddableEvents = 0;
+        if (!wakeup) {
+            for (size_t i = 0; i < numLeft; i++) {
+                numSheddableEvents += mSensorRegistry.isSheddable(eventsLeft[i]) ? 1 : 0;
+            }
+        }
+        // While the reader is behind, sheddable events are decimated as soon as the queue holds
+        // more than it can drain in kMaxPendingWriteDrainNs instead of once it overflows.
+        size_t limit = std::min(queue.capacity(), getPendingWriteLimit());
+        if (queue.size() + numLeft > limit ||
+            !queue.push(eventsLeft, numLeft, wakeup ? numLeft : 0, numSheddableEvents, postTimeNs,
+                        now)) {
+            shedLoadAndPushPendingWriteEvents(queue, eventsLeft, numLeft, numSheddableEvents,
+                                              postTimeNs, now, limit);
+        }
+        if (wakeup) {
+            mWakeupPendingWriteEventsQueued.store(!queue.empty(), std::memory_order_relaxed);
+        }
+        size_t& mostEventsObserved = wakeup ? mMostEventsObservedWakeupPendingWriteEventsQueue
+                                            : mMostEventsObservedPendingWriteEventsQueue;
+        mostEventsObserved = std::max(mostEventsObserved, queue.size());
+        if (mPendingWritesThreadWaiting && mPendingWritesNotifyTimeNs == 0) {
+            mPendingWritesNotifyTimeNs = ::android::elapsedRealtimeNano();
+        }
         mEventQueueWriteCV.notify_one();
     }
 }
 
+void HalProxy::shedLoadAndPushPendingWriteEvents(PendingWriteEventsQueue& queue,
+                                                  const Event* events, size_t numEvents,
+                                                  size_t numSheddableEvents, int64_t postTimeNs,
+                                                  int64_t now, size_t limit) {
+    // Only the events of non wake-up sensors are sheddable.
+    if (&queue == &mPendingWriteEventsQueue) {
+        size_t numPinned = mPendingWriteEventsQueueInFlight == &queue
+                                   ? mNumPendingWriteEventsInFlight
+                                   : 0;
+        if (queue.size() + numEvents > limit) {
+            mNumEventsShed += queue.shed(numPinned, queue.size() + numEvents - limit,
+                                         kMaxNumShedScannedEvents, true /* decimate */,
+                                         mSensorRegistry);
+        }
+        // Sheddable events are evicted before any event of the post that isn't is dropped. The
+        // extra room spares the next posts another pass over the queue.
+        size_t numNonSheddableEvents = numEvents - numSheddableEvents;
+        if (numNonSheddableEvents > queue.availableToPush()) {
+            size_t numToDrop = numNonSheddableEvents - queue.availableToPush() +
+                               queue.capacity() / kShedHeadroomDivisor;
+            mNumEventsShed += queue.shed(numPinned, numToDrop, SIZE_MAX, false /* decimate */,
+                                         mSensorRegistry);
+        }
+    }
+    if (queue.push(events, numEvents, countNumWakeupEvents(events, numEvents), numSheddableEvents,
+                   postTimeNs, now)) {
+        return;
+    }
+
+    // Push the runs of events that aren't sheddable, dropping whatever still doesn't fit.
+    size_t runStart = 0;
+    for (size_t i = 0; i <= numEvents; i++) {
+        if (i < numEvents && !mSensorRegistry.isSheddable(events[i])) {
+            continue;
+        }
+        size_t numInRun = i - runStart;
+        size_t numWakeupEventsInRun = countNumWakeupEvents(events + runStart, numInRun);
+        if (!queue.push(events + runStart, numInRun, numWakeupEventsInRun,
+                        0 /* numSheddableEvents */, postTimeNs, now)) {
+            for (size_t j = runStart; j < i; j++) {
+                countShedEvent(events[j]);
+            }
+            if (numWakeupEventsInRun > 0) {
+                int32_t subHalIndex =
+                        static_cast<int32_t>(extractSubHalIndex(events[0].sensorHandle));
+                releaseWakelockRefs(numWakeupEventsInRun, -1 /* timeoutStart */, subHalIndex,
+                                    true /* forEvents */);
+            }
+        }
+        if (i < numEvents) {
+            countShedEvent(events[i]);
+        }
+        runStart = i + 1;
+    }
+    ALOGW("%s pending write events queue overflowed, %" PRIu64 " events shed so far.",
+          &queue == &mWakeupPendingWriteEventsQueue ? "Wakeup" : "Non-wakeup", mNumEventsShed);
+}
+
+void HalProxy::countShedEvent(const Event& event) {
+    mNumEventsShed++;
+    mSensorRegistry.countShedEvents(event.sensorHandle, 1);
+}
+
 bool HalProxy::incrementRefCountAndMaybeAcquireWakelock(size_t delta,
                                                         int64_t* timeoutStart /* = nullptr */) {
+    return acquireWakelockRefs(delta, timeoutStart, kUnattributedSubHalIndex,
+                               false /* forEvents */);
+}
+
+void HalProxy::decrementRefCountAndMaybeReleaseWakelock(size_t delta,
+                                                        int64_t timeoutStart /* = -1 */) {
+    releaseWakelockRefs(delta, timeoutStart, kUnattributedSubHalIndex, false /* forEvents */);
+}
+
+bool HalProxy::acquireWakelockRefs(size_t delta, int64_t* timeoutStart, int32_t subHalIndex,
+                                   bool forEvents) {
     if (!mThreadsRun.load()) return false;
-    std::lock_guard<std::recursive_mutex> lockGuard(mWakelockMutex);
-    if (mWakelockRefCount == 0) {
-        acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakelockName);
-        mWakelockCV.notify_one();
+    // Moved forward before the refs are added, so that the wakelock thread never sees them with
+    // an older timeout start.
+    int64_t now = getTimeNow();
+    int64_t startTime = mWakelockTimeoutStartTime.load();
+    while (startTime < now && !mWakelockTimeoutStartTime.compare_exchange_weak(startTime, now)) {
+    }
+
+    uint64_t state = mWakelockState.load();
+    while (true) {
+        if (wakelockRefCount(state) == 0) {
+            // The count can't leave 0 without the mutex, so it is still 0 if it was read as 0
+            // with the mutex held.
+            std::lock_guard<std::recursive_mutex> lockGuard(mWakelockMutex);
+            state = mWakelockState.load();
+            if (wakelockRefCount(state) == 0) {
+                acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakelockName);
+                state = mWakelockState.fetch_add(delta);
+                if (mWakelockThreadWaiting && mWakelockNotifyTimeNs == 0) {
+                    mWakelockNotifyTimeNs = ::android::elapsedRealtimeNano();
+                }
+                mWakelockCV.notify_one();
+                break;
+            }
+        }
+        if (mWakelockState.compare_exchange_weak(state, state + delta)) {
+            break;
+        }
     }
-    mWakelockTimeoutStartTime = getTimeNow();
-    mWakelockRefCount += delta;
     if (timeoutStart != nullptr) {
-        *timeoutStart = mWakelockTimeoutStartTime;
+        *timeoutStart = wakelockResetCount(state);
+    }
+
+    if (subHalIndex >= 0) {
+        std::lock_guard<std::mutex> statsLock(mWakelockStatsMutex);
+        if (static_cast<size_t>(subHalIndex) < mSubHalWakelockStats.size()) {
+            mSubHalWakelockStats[subHalIndex].acquire(delta, now);
+            if (forEvents) {
+                mWakeupEventOwners.push(subHalIndex, delta);
+            }
+        }
     }
     return true;
 }
 
-void HalProxy::decrementRefCountAndMaybeReleaseWakelock(size_t delta,
-                                                        int64_t timeoutStart /* = -1 */) {
+void HalProxy::releaseWakelockRefs(size_t delta, int64_t timeoutStart, int32_t subHalIndex,
+                                   bool forEvents) {
     if (!mThreadsRun.load()) return;
-    std::lock_guard<std::recursive_mutex> lockGuard(mWakelockMutex);
-    if (delta > mWakelockRefCount) {
-        ALOGE("Decrementing wakelock ref count by %zu when count is %zu",
-              delta, mWakelockRefCount);
-    }
-    if (timeoutStart == -1) timeoutStart = mWakelockTimeoutResetTime;
-    if (mWakelockRefCount == 0 || timeoutStart < mWakelockTimeoutResetTime) return;
-    mWakelockRefCount -= std::min(mWakelockRefCount, delta);
-    if (mWakelockRefCount == 0) {
+    std::unique_lock<std::recursive_mutex> lock(mWakelockMutex, std::defer_lock);
+    uint64_t state = mWakelockState.load();
+    size_t refCount;
+    size_t numReleased;
+    while (true) {
+        refCount = wakelockRefCount(state);
+        if (refCount == 0 || (timeoutStart != -1 && timeoutStart != wakelockResetCount(state))) {
+            return;
+        }
+        numReleased = std::min(refCount, delta);
+        // Releasing the last refs releases the shared wakelock, which mustn't race with it being
+        // acquired again.
+        if (numReleased == refCount && !lock.owns_lock()) {
+            lock.lock();
+            state = mWakelockState.load();
+            continue;
+        }
+        if (mWakelockState.compare_exchange_weak(state, state - numReleased)) {
+            break;
+        }
+    }
+    if (delta > refCount) {
+        ALOGE("Decrementing wakelock ref count by %zu when count is %zu", delta, refCount);
+    }
+    bool released = numReleased == refCount;
+    if (released) {
         release_wake_lock(kWakelockName);
     }
+
+    int64_t now = getTimeNow();
+    std::lock_guard<std::mutex> statsLock(mWakelockStatsMutex);
+    if (mSubHalWakelockStats.empty()) return;
+    if (forEvents && subHalIndex == kUnattributedSubHalIndex) {
+        mWakeupEventOwners.popFront(numReleased, [&](int32_t ownerIndex, size_t numEvents) {
+            mSubHalWakelockStats[ownerIndex].release(numEvents, now);
+        });
+    } else if (subHalIndex >= 0 &&
+               static_cast<size_t>(subHalIndex) < mSubHalWakelockStats.size()) {
+        if (forEvents) {
+            mWakeupEventOwners.remove(subHalIndex, numReleased);
+        }
+        mSubHalWakelockStats[subHalIndex].release(numReleased, now);
+    }
+
+    if (released) {
+        // Refs that couldn't be attributed, or a reset of the shared wakelock, may leave
+        // subhals with a share of a ref count that is now 0.
+        for (SubHalWakelockStats& stats : mSubHalWakelockStats) {
+            stats.releaseAll(now);
+        }
+        mWakeupEventOwners.clear();
+    }
 }
 
-void HalProxy::setDirectChannelFlags(SensorInfo* sensorInfo,
-                                     std::shared_ptr<ISubHalWrapperBase> subHal) {
-    bool sensorSupportsDirectChannel =
-            (sensorInfo->flags & (V1_0::SensorFlagBits::MASK_DIRECT_REPORT |
-                                  V1_0::SensorFlagBits::MASK_DIRECT_CHANNEL)) != 0;
-    if (mDirectChannelSubHal == nullptr && sensorSupportsDirectChannel) {
-        mDirectChannelSubHal = subHal;
-    } else if (mDirectChannelSubHal != nullptr && subHal != mDirectChannelSubHal) {
-        // disable direct channel capability for sensors in subHals that are not
-        // the only one we will enable
-        sensorInfo->flags &= ~(V1_0::SensorFlagBits::MASK_DIRECT_REPORT |
-                               V1_0::SensorFlagBits::MASK_DIRECT_CHANNEL);
+void HalProxy::setDirectChannelFlags(SensorInfo* sensorInfo) {
+    constexpr uint32_t kDirectFlags = V1_0::SensorFlagBits::MASK_DIRECT_REPORT |
+                                      V1_0::SensorFlagBits::MASK_DIRECT_CHANNEL;
+    if (mDirectChannelSubHalIndex >= 0 &&
+        extractSubHalIndex(sensorInfo->sensorHandle) ==
+                static_cast<size_t>(mDirectChannelSubHalIndex)) {
+        if ((sensorInfo->flags & kDirectFlags) != 0) {
+            mDirectReportSupported = true;
+        }
+        return;
+    }
+    // The sensors of other subhals couldn't share a channel with those of the direct channel
+    // subhal.
+    sensorInfo->flags &= ~kDirectFlags;
+    if (mDirectChannelSubHalIndex >= 0) {
+        return;
+    }
+    RateLevel rate = DirectChannel::getMaxEmulatedRateLevel(*sensorInfo);
+    if (rate == RateLevel::STOP) {
+        return;
+    }
+    sensorInfo->flags |= V1_0::SensorFlagBits::DIRECT_CHANNEL_ASHMEM |
+                         (static_cast<uint32_t>(rate)
+                          << static_cast<uint32_t>(V1_0::SensorFlagShift::DIRECT_REPORT));
+    mEmulatedDirectReportSensors[sensorInfo->sensorHandle] = {};
+    mDirectReportSupported = true;
+}
+
+bool HalProxy::claimDirectChannel(DirectChannel& channel, int32_t owner) {
+    if (channel.getOwner() == owner) {
+        return true;
+    }
+    if (channel.hasReports()) {
+        return false;
+    }
+    if (channel.getOwner() >= 0) {
+        mSubHalList[channel.getOwner()]->unregisterDirectChannel(channel.getSubHalChannelHandle());
+    }
+    std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+    channel.setOwner(DirectChannel::kNoOwner);
+    if (owner == DirectChannel::kProxyOwner) {
+        return channel.setOwner(DirectChannel::kProxyOwner);
+    }
+
+    Result result = Result::INVALID_OPERATION;
+    int32_t subHalChannelHandle = -1;
+    mSubHalList[owner]->registerDirectChannel(channel.getMemInfo(),
+                                              [&](Result subHalResult, int32_t channelHandle) {
+                                                  result = subHalResult;
+                                                  subHalChannelHandle = channelHandle;
+                                              });
+    if (result != Result::OK) {
+        ALOGE("Failed to register direct channel with subhal %s",
+              mSubHalList[owner]->getName().c_str());
+        return false;
+    }
+    return channel.setOwner(owner, subHalChannelHandle);
+}
+
+Result HalProxy::applyEmulatedDirectReportConfig(int32_t sensorHandle) {
+    EmulatedDirectReportSensor& sensor = mEmulatedDirectReportSensors[sensorHandle];
+    int64_t directPeriodNs = 0;
+    {
+        std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+        for (const auto& channelEntry : mDirectChannels) {
+            int64_t periodNs = channelEntry.second->getEmulatedReportPeriodNs(sensorHandle);
+            if (periodNs > 0 && (directPeriodNs == 0 || periodNs < directPeriodNs)) {
+                directPeriodNs = periodNs;
+            }
+        }
+    }
+    bool directReported = directPeriodNs > 0;
+    mSensorRegistry.setFlag(sensorHandle, SensorRegistry::kFlagDirectReport, directReported);
+    mSensorRegistry.setFlag(sensorHandle, SensorRegistry::kFlagDirectReportOnly,
+                            directReported && !sensor.enabled);
+
+    std::shared_ptr<ISubHalWrapperBase> subHal = getSubHalForSensorHandle(sensorHandle);
+    int32_t subHalSensorHandle = clearSubHalIndex(sensorHandle);
+    if (!sensor.enabled && !directReported) {
+        if (!sensor.subHalEnabled) {
+            return Result::OK;
+        }
+        sensor.subHalEnabled = false;
+        return subHal->activate(subHalSensorHandle, false /* enabled */);
+    }
+
+    // The sensor is sampled at the fastest of the requested rates, and direct channels can't
+    // wait for a batch.
+    int64_t samplingPeriodNs = sensor.enabled ? sensor.samplingPeriodNs : directPeriodNs;
+    if (directReported && directPeriodNs < samplingPeriodNs) {
+        samplingPeriodNs = directPeriodNs;
+    }
+    int64_t maxReportLatencyNs = directReported ? 0 : sensor.maxReportLatencyNs;
+    Result result = subHal->batch(subHalSensorHandle, samplingPeriodNs, maxReportLatencyNs);
+    if (result == Result::OK && !sensor.subHalEnabled) {
+        result = subHal->activate(subHalSensorHandle, true /* enabled */);
+        sensor.subHalEnabled = result == Result::OK;
+    }
+    return result;
+}
+
+void HalProxy::resetDirectChannels() {
+    std::lock_guard<std::mutex> lock(mDirectChannelMutex);
+    for (const auto& channelEntry : mDirectChannels) {
+        const DirectChannel& channel = *channelEntry.second;
+        if (channel.getOwner() >= 0) {
+            mSubHalList[channel.getOwner()]->unregisterDirectChannel(
+                    channel.getSubHalChannelHandle());
+        }
+    }
+    {
+        std::lock_guard<std::mutex> writeLock(mDirectChannelWriteMutex);
+        mDirectChannels.clear();
+    }
+    // The sensors are all disabled in their subhals next.
+    for (auto& sensorEntry : mEmulatedDirectReportSensors) {
+        sensorEntry.second = {};
+        mSensorRegistry.setFlag(sensorEntry.first, SensorRegistry::kFlagDirectReport, false);
+        mSensorRegistry.setFlag(sensorEntry.first, SensorRegistry::kFlagDirectReportOnly, false);
     }
 }
 
@@ -760,20 +2087,161 @@ std::shared_ptr<ISubHalWrapperBase> HalProxy::getSubHalForSensorHandle(int32_t s
 }
 
 bool HalProxy::isSubHalIndexValid(int32_t sensorHandle) {
-    return extractSubHalIndex(sensorHandle) < mSubHalList.size();
+    return extractSubHalIndex(sensorHandle) < mNumSubHals.load();
 }
 
-size_t HalProxy::countNumWakeupEvents(const std::vector<Event>& events, size_t n) {
+size_t HalProxy::countNumWakeupEvents(const Event* events, size_t n) {
     size_t numWakeupEvents = 0;
     for (size_t i = 0; i < n; i++) {
-        int32_t sensorHandle = events[i].sensorHandle;
-        if (mSensors[sensorHandle].flags & static_cast<uint32_t>(V1_0::SensorFlagBits::WAKE_UP)) {
+        if (mSensorRegistry.isWakeUpSensor(events[i].sensorHandle)) {
             numWakeupEvents++;
         }
     }
     return numWakeupEvents;
 }
 
+void HalProxy::recordLatency(const Event* events, size_t n,
+                             LatencyHistogram SensorLatencyStats::*histogram, int64_t latencyNs) {
+    size_t runStart = 0;
+    for (size_t i = 1; i <= n; i++) {
+        if (i < n && events[i].sensorHandle == events[runStart].sensorHandle) {
+            continue;
+        }
+        SensorLatencyStats* stats = mSensorRegistry.getLatencyStats(events[runStart].sensorHandle);
+        if (stats != nullptr) {
+            (stats->*histogram).record(latencyNs, i - runStart);
+        }
+        runStart = i;
+    }
+}
+
+void HalProxy::dumpSensorLatency(std::ostream& stream, const SensorInfo& sensor, bool reset) {
+    SensorLatencyStats* stats = mSensorRegistry.getLatencyStats(sensor.sensorHandle);
+    if (stats == nullptr || stats->subHalToPost.getCount() == 0) {
+        return;
+    }
+    stream << "  " << sensor.name << " (handle 0x" << std::hex << sensor.sensorHandle << std::dec
+           << "):" << std::endl;
+    stream << "    Subhal timestamp to post: ";
+    stats->subHalToPost.dump(stream);
+    stream << "    Post to event queue write: ";
+    stats->postToWrite.dump(stream);
+    stream << "    Pending write events queue: ";
+    stats->pendingQueue.dump(stream);
+    if (reset) {
+        stats->reset();
+    }
+}
+
+void HalProxy::dumpStats(std::ostream& stream) {
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    int64_t now = ::android::elapsedRealtimeNano();
+    int64_t intervalNs = now - mLastStatsTimeNs;
+    stream << std::fixed << std::setprecision(3);
+
+    size_t numPendingWriteEvents;
+    size_t numWakeupPendingWriteEvents;
+    uint64_t numEventsPostedToEventQueue;
+    uint64_t numEventsShed;
+    {
+        std::lock_guard<std::mutex> lock(mEventQueueWriteMutex);
+        numPendingWriteEvents = mPendingWriteEventsQueue.size();
+        numWakeupPendingWriteEvents = mWakeupPendingWriteEventsQueue.size();
+        numEventsPostedToEventQueue = mNumEventsPostedToEventQueue;
+        numEventsShed = mNumEventsShed;
+    }
+    stream << "{\"type\":\"proxy\",\"time_ns\":" << now << ",\"interval_ns\":" << intervalNs
+           << ",\"threads_running\":" << (mThreadsRun.load() ? "true" : "false")
+           << ",\"pending_write_events\":" << numPendingWriteEvents
+           << ",\"wakeup_pending_write_events\":" << numWakeupPendingWriteEvents
+           << ",\"events_written_directly\":" << numEventsPostedToEventQueue
+           << ",\"events_shed\":" << numEventsShed
+           << ",\"event_queue_write_failures\":" << mNumEventQueueWriteFailures.load()
+           << ",\"events_dropped\":" << mNumEventsDropped.load()
+           << ",\"wakelock_ref_count\":" << wakelockRefCount(mWakelockState.load()) << "}"
+           << std::endl;
+
+    struct SubHalTotals {
+        size_t numSensors = 0;
+        uint64_t numEvents = 0;
+        uint64_t numShedEvents = 0;
+        uint64_t numDroppedEvents = 0;
+        uint64_t numSuppressedEvents = 0;
+        double eventRateHz = 0;
+    };
+    size_t numSubHals = mNumSubHals.load();
+    std::vector<SubHalTotals> subHalTotals(numSubHals);
+    std::map<int32_t, uint64_t> numEventsByHandle;
+    auto dumpSensor = [&](const SensorInfo& sensor, bool dynamic) {
+        int32_t sensorHandle = sensor.sensorHandle;
+        uint64_t numEvents = mSensorRegistry.getNumEvents(sensorHandle);
+        uint64_t numShedEvents = mSensorRegistry.getNumShedEvents(sensorHandle);
+        uint64_t numDroppedEvents = mSensorRegistry.getNumDroppedEvents(sensorHandle);
+        uint64_t numSuppressedEvents = mSensorRegistry.getNumSuppressedEvents(sensorHandle);
+        auto lastEntry = mLastStatsNumEvents.find(sensorHandle);
+        uint64_t lastNumEvents = lastEntry == mLastStatsNumEvents.end() ? 0 : lastEntry->second;
+        double eventRateHz =
+                intervalNs > 0 ? (numEvents - lastNumEvents) * 1e9 / intervalNs : 0.0;
+        numEventsByHandle[sensorHandle] = numEvents;
+        SensorRegistry::SensorConfig config = mSensorRegistry.getConfig(sensorHandle);
+        bool softwareBatched = (mSensorRegistry.getFlags(sensorHandle) &
+                                SensorRegistry::kFlagSoftwareBatched) != 0;
+        size_t subHalIndex = extractSubHalIndex(sensorHandle);
+        stream << "{\"type\":\"sensor\",\"handle\":" << sensorHandle
+               << ",\"name\":" << toJsonString(sensor.name) << ",\"subhal\":" << subHalIndex
+               << ",\"sensor_type\":" << static_cast<int32_t>(sensor.type)
+               << ",\"dynamic\":" << (dynamic ? "true" : "false")
+               << ",\"active\":" << (config.active ? "true" : "false")
+               << ",\"sampling_period_ns\":" << config.samplingPeriodNs
+               << ",\"max_report_latency_ns\":" << config.maxReportLatencyNs
+               << ",\"software_batched\":" << (softwareBatched ? "true" : "false")
+               << ",\"events\":" << numEvents << ",\"event_rate_hz\":" << eventRateHz
+               << ",\"events_shed\":" << numShedEvents
+               << ",\"events_dropped\":" << numDroppedEvents
+               << ",\"events_suppressed\":" << numSuppressedEvents << "}" << std::endl;
+        if (subHalIndex < numSubHals) {
+            SubHalTotals& totals = subHalTotals[subHalIndex];
+            totals.numSensors++;
+            totals.numEvents += numEvents;
+            totals.numShedEvents += numShedEvents;
+            totals.numDroppedEvents += numDroppedEvents;
+            totals.numSuppressedEvents += numSuppressedEvents;
+            totals.eventRateHz += eventRateHz;
+        }
+    };
+    for (const auto& sensorEntry : mSensors) {
+        dumpSensor(sensorEntry.second, false /* dynamic */);
+    }
+    {
+        std::lock_guard<std::mutex> dynamicSensorsLock(mDynamicSensorsMutex);
+        for (const auto& sensorEntry : mDynamicSensors) {
+            dumpSensor(sensorEntry.second, true /* dynamic */);
+        }
+    }
+
+    for (size_t i = 0; i < numSubHals; i++) {
+        size_t numWakelockRefs = 0;
+        {
+            std::lock_guard<std::mutex> statsLock(mWakelockStatsMutex);
+            if (i < mSubHalWakelockStats.size()) {
+                numWakelockRefs = mSubHalWakelockStats[i].getRefCount();
+            }
+        }
+        const SubHalTotals& totals = subHalTotals[i];
+        stream << "{\"type\":\"subhal\",\"index\":" << i
+               << ",\"name\":" << toJsonString(mSubHalList[i]->getName())
+               << ",\"sensors\":" << totals.numSensors << ",\"events\":" << totals.numEvents
+               << ",\"event_rate_hz\":" << totals.eventRateHz
+               << ",\"events_shed\":" << totals.numShedEvents
+               << ",\"events_dropped\":" << totals.numDroppedEvents
+               << ",\"events_suppressed\":" << totals.numSuppressedEvents
+               << ",\"wakelock_ref_count\":" << numWakelockRefs << "}" << std::endl;
+    }
+
+    mLastStatsTimeNs = now;
+    mLastStatsNumEvents = std::move(numEventsByHandle);
+}
+
 int32_t HalProxy::clearSubHalIndex(int32_t sensorHandle) {
     return sensorHandle & (~kSensorHandleSubHalIndexMask);
 }
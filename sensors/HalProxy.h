@@ -0,0 +1,1027 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "DirectChannel.h"
+#include "EventMessageQueueWrapper.h"
+#include "EventTrace.h"
+#include "HalProxyCallback.h"
+#include "ISensorsCallbackWrapper.h"
+#include "PendingWriteEventsQueue.h"
+#include "SensorPatches.h"
+#include "SensorRegistry.h"
+#include "SoftwareBatcher.h"
+#include "SubHalCache.h"
+#include "SubHalWrapper.h"
+#include "ThreadConfig.h"
+#include "V2_0/ScopedWakelock.h"
+#include "V2_0/SubHal.h"
+#include "V2_1/SubHal.h"
+#include "WakeLockMessageQueueWrapper.h"
+#include "WakelockHistory.h"
+#include "convertV2_1.h"
+
+#include <android/hardware/sensors/2.1/ISensors.h>
+#include <android/hardware/sensors/2.1/types.h>
+#include <fmq/MessageQueue.h>
+#include <hardware_legacy/power.h>
+#include <hidl/MQDescriptor.h>
+#include <hidl/Status.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * HalProxy is the ISensors implementation that loads and proxies calls to the sub-HALs.
+ */
+class HalProxy : public V2_0::implementation::IScopedWakelockRefCounter,
+                 public V2_0::implementation::ISubHalCallback {
+  public:
+    using Event = ::android::hardware::sensors::V2_1::Event;
+    using OperationMode = ::android::hardware::sensors::V1_0::OperationMode;
+    using RateLevel = ::android::hardware::sensors::V1_0::RateLevel;
+    using Result = ::android::hardware::sensors::V1_0::Result;
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+    using SharedMemInfo = ::android::hardware::sensors::V1_0::SharedMemInfo;
+    using IHalProxyCallbackV2_0 = V2_0::implementation::IHalProxyCallback;
+    using IHalProxyCallbackV2_1 = V2_1::implementation::IHalProxyCallback;
+    using ISensorsSubHalV2_0 = V2_0::implementation::ISensorsSubHal;
+    using ISensorsSubHalV2_1 = V2_1::implementation::ISensorsSubHal;
+    using ISensorsV2_0 = V2_0::ISensors;
+    using ISensorsV2_1 = V2_1::ISensors;
+    using HalProxyCallbackBase = V2_0::implementation::HalProxyCallbackBase;
+
+    explicit HalProxy();
+    // Test only constructor.
+    explicit HalProxy(std::vector<ISensorsSubHalV2_0*>& subHalList);
+    explicit HalProxy(std::vector<ISensorsSubHalV2_0*>& subHalList,
+                      std::vector<ISensorsSubHalV2_1*>& subHalListV2_1);
+    ~HalProxy();
+
+    // Methods from ::android::hardware::sensors::V2_1::ISensors follow.
+    Return<void> getSensorsList_2_1(ISensorsV2_1::getSensorsList_2_1_cb _hidl_cb);
+
+    Return<Result> initialize_2_1(
+            const ::android::hardware::MQDescriptorSync<V2_1::Event>& eventQueueDescriptor,
+            const ::android::hardware::MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+            const sp<V2_1::ISensorsCallback>& sensorsCallback);
+
+    Return<Result> injectSensorData_2_1(const Event& event);
+
+    // Methods from ::android::hardware::sensors::V2_0::ISensors follow.
+    Return<void> getSensorsList(ISensorsV2_0::getSensorsList_cb _hidl_cb);
+
+    Return<Result> setOperationMode(OperationMode mode);
+
+    Return<Result> activate(int32_t sensorHandle, bool enabled);
+
+    Return<Result> initialize(
+            const ::android::hardware::MQDescriptorSync<V1_0::Event>& eventQueueDescriptor,
+            const ::android::hardware::MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+            const sp<V2_0::ISensorsCallback>& sensorsCallback);
+
+    Return<Result> initializeCommon(
+            std::unique_ptr<EventMessageQueueWrapperBase>& eventQueue,
+            std::unique_ptr<WakeLockMessageQueueWrapperBase>& wakeLockQueue,
+            const sp<ISensorsCallbackWrapperBase>& sensorsCallback);
+
+    Return<Result> batch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                         int64_t maxReportLatencyNs);
+
+    Return<Result> flush(int32_t sensorHandle);
+
+    Return<Result> injectSensorData(const V1_0::Event& event);
+
+    Return<void> registerDirectChannel(const SharedMemInfo& mem,
+                                       ISensorsV2_0::registerDirectChannel_cb _hidl_cb);
+
+    Return<Result> unregisterDirectChannel(int32_t channelHandle);
+
+    Return<void> configDirectReport(int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
+                                    ISensorsV2_0::configDirectReport_cb _hidl_cb);
+
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args);
+
+    Return<void> onDynamicSensorsConnected(const hidl_vec<SensorInfo>& dynamicSensorsAdded,
+                                           int32_t subHalIndex) override;
+
+    Return<void> onDynamicSensorsDisconnected(const hidl_vec<int32_t>& dynamicSensorHandlesRemoved,
+                                              int32_t subHalIndex) override;
+
+    void postEventsToMessageQueue(const Event* events, size_t numEvents, size_t numWakeupEvents,
+                                  int64_t postTimeNs,
+                                  V2_0::implementation::ScopedWakelock wakelock) override;
+
+    void postEventsToSoftwareBatches(const Event* events, size_t numEvents,
+                                     int64_t postTimeNs) override;
+
+    void postEventsToDirectChannels(const Event* events, size_t numEvents) override;
+
+    const SensorRegistry& getSensorRegistry() override { return mSensorRegistry; }
+
+    EventRecorder& getEventRecorder() override { return mEventRecorder; }
+
+    bool areThreadsRunning() override { return mThreadsRun.load(); }
+
+    // Below methods are from IScopedWakelockRefCounter interface
+    bool incrementRefCountAndMaybeAcquireWakelock(size_t delta,
+                                                  int64_t* timeoutStart = nullptr) override;
+
+    void decrementRefCountAndMaybeReleaseWakelock(size_t delta, int64_t timeoutStart = -1) override;
+
+    const std::map<int32_t, SensorInfo>& getSensors() { return mSensors; }
+
+    size_t getMostEventsObservedPendingWriteEventsQueue() {
+        std::lock_guard<std::mutex> lock(mEventQueueWriteMutex);
+        return mMostEventsObservedPendingWriteEventsQueue;
+    }
+
+  private:
+    /**
+     * The wakelock ref counter given to a subhal, so that the refs of the wakelocks the subhal
+     * creates are attributed to it.
+     */
+    class SubHalWakelockRefCounter : public V2_0::implementation::IScopedWakelockRefCounter {
+      public:
+        SubHalWakelockRefCounter(HalProxy* halProxy, int32_t subHalIndex)
+            : mHalProxy(halProxy), mSubHalIndex(subHalIndex) {}
+
+        bool incrementRefCountAndMaybeAcquireWakelock(size_t delta,
+                                                      int64_t* timeoutStart = nullptr) override {
+            return mHalProxy->acquireWakelockRefs(delta, timeoutStart, mSubHalIndex,
+                                                  false /* forEvents */);
+        }
+
+        void decrementRefCountAndMaybeReleaseWakelock(size_t delta,
+                                                      int64_t timeoutStart = -1) override {
+            mHalProxy->releaseWakelockRefs(delta, timeoutStart, mSubHalIndex,
+                                           false /* forEvents */);
+        }
+
+      private:
+        HalProxy* mHalProxy;
+        int32_t mSubHalIndex;
+    };
+
+    using EventMessageQueueV2_1 = MessageQueue<V2_1::Event, kSynchronizedReadWrite>;
+    using EventMessageQueueV2_0 = MessageQueue<V1_0::Event, kSynchronizedReadWrite>;
+    using WakeLockMessageQueue = MessageQueue<uint32_t, kSynchronizedReadWrite>;
+
+    /**
+     * The Event FMQ where sensor events are written
+     */
+    std::unique_ptr<EventMessageQueueWrapperBase> mEventQueue;
+
+    /**
+     * The Wake Lock FMQ that is read to determine when the framework has handled WAKE_UP events
+     */
+    std::unique_ptr<WakeLockMessageQueueWrapperBase> mWakeLockQueue;
+
+    /**
+     * Event Flag to signal to the framework when sensor events are available to be read and to
+     * interrupt event queue blocking write.
+     */
+    EventFlag* mEventQueueFlag = nullptr;
+
+    //! Event Flag to signal internally that the wakelock queue should stop its blocking read.
+    EventFlag* mWakelockQueueFlag = nullptr;
+
+    /**
+     * Callback to the sensors framework to inform it that new sensors have been added or removed.
+     */
+    sp<ISensorsCallbackWrapperBase> mDynamicSensorsCallback;
+
+    /**
+     * SubHal objects that have been saved from vendor dynamic libraries. Subhals are only added,
+     * with mInitializeMutex and mOperationModeMutex held, and the capacity is reserved so that
+     * adding one doesn't move the others.
+     */
+    std::vector<std::shared_ptr<ISubHalWrapperBase>> mSubHalList;
+
+    //! The number of subhals in mSubHalList, for the readers that don't hold mInitializeMutex.
+    std::atomic<size_t> mNumSubHals = 0;
+
+    /**
+     * The library each subhal was loaded from, indexed by subhal index. Empty for the subhals
+     * given to the constructor and the ones unloaded. Guarded by mInitializeMutex once the
+     * subhals are initialized.
+     */
+    std::vector<std::string> mSubHalLibraryFiles;
+
+    /**
+     * The sensors of the subhals loaded after the service started, by subhal index, as reported
+     * by the subhal. They are announced to the framework as dynamic sensors on each
+     * initialization. Guarded by mInitializeMutex.
+     */
+    std::map<size_t, std::vector<SensorInfo>> mReloadedSubHalSensors;
+
+    /**
+     * Map of sensor handles to SensorInfo objects that contains the sensor info from subhals as
+     * well as the modified sensor handle for the framework.
+     *
+     * The subhal index is encoded in the first byte of the sensor handle and the remaining
+     * bytes are generated by the subhal to identify the sensor.
+     */
+    std::map<int32_t, SensorInfo> mSensors;
+
+    //! The responses to getSensorsList_2_1 and getSensorsList, built from mSensors.
+    struct SensorListCache {
+        hidl_vec<V2_1::SensorInfo> sensorsV2_1;
+        hidl_vec<V1_0::SensorInfo> sensorsV1_0;
+    };
+
+    /**
+     * The sensor lists handed out to the framework. Replaced as a whole, with std::atomic_store,
+     * whenever mSensors changes so that callers holding the previous lists are unaffected.
+     */
+    std::shared_ptr<const SensorListCache> mSensorListCache;
+
+    //! Map of the dynamic sensors that have been added to halproxy.
+    std::map<int32_t, SensorInfo> mDynamicSensors;
+
+    //! Handle indexed lookup of both the static and dynamic sensors for the event path.
+    SensorRegistry mSensorRegistry;
+
+    //! The rules applied to the sensors reported by the subhals, loaded from kSensorPatchesFile.
+    SensorPatches mSensorPatches;
+
+    //! Records the posted events and the calls driving them while started from debug.
+    EventRecorder mEventRecorder;
+
+    //! The current operation mode for all subhals, only changed with mOperationModeMutex held.
+    std::atomic<OperationMode> mCurrentOperationMode = OperationMode::NORMAL;
+
+    //! The mutex serializing operation mode changes.
+    std::mutex mOperationModeMutex;
+
+    //! The mutex serializing initializations by the framework.
+    std::mutex mInitializeMutex;
+
+    //! The HIDL methods whose calls are timed, and their names in the debug dump.
+    enum Method : size_t {
+        kMethodGetSensorsList,
+        kMethodSetOperationMode,
+        kMethodActivate,
+        kMethodInitialize,
+        kMethodBatch,
+        kMethodFlush,
+        kMethodInjectSensorData,
+        kMethodRegisterDirectChannel,
+        kMethodUnregisterDirectChannel,
+        kMethodConfigDirectReport,
+        kNumMethods,
+    };
+    static const char* const kMethodNames[kNumMethods];
+
+    //! The count and duration of the calls to each HIDL method, indexed by Method.
+    LatencyHistogram mMethodLatency[kNumMethods];
+
+    //! The mutex serializing stats dumps, which compute event rates since the previous one.
+    std::mutex mStatsMutex;
+
+    //! When stats were last dumped, or the proxy created, and the event counts of the sensors then.
+    int64_t mLastStatsTimeNs = 0;
+    std::map<int32_t, uint64_t> mLastStatsNumEvents;
+
+    //! Whether any sensor supports direct report, natively or emulated by the proxy.
+    bool mDirectReportSupported = false;
+
+    /**
+     * The subhal whose sensors report to direct channels natively, the first one reporting such a
+     * sensor, or -1 if none does. Set once the sensor list is initialized.
+     */
+    int32_t mDirectChannelSubHalIndex = -1;
+
+    //! The framework requests for a sensor whose direct report the proxy emulates.
+    struct EmulatedDirectReportSensor {
+        bool enabled = false;
+        int64_t samplingPeriodNs = 0;
+        int64_t maxReportLatencyNs = 0;
+        //! Whether the sensor is enabled in its subhal, for the framework or a direct channel.
+        bool subHalEnabled = false;
+    };
+
+    /**
+     * The sensors whose direct report the proxy emulates, by sensor handle. The keys are set once
+     * the sensor list is initialized, the values are protected by mDirectChannelMutex.
+     */
+    std::map<int32_t, EmulatedDirectReportSensor> mEmulatedDirectReportSensors;
+
+    //! The direct channels registered by the framework, by the channel handle the proxy handed out.
+    std::map<int32_t, std::unique_ptr<DirectChannel>> mDirectChannels;
+
+    int32_t mNextDirectChannelHandle = 1;
+
+    //! The mutex serializing direct channel configuration, including the calls to the subhals.
+    std::mutex mDirectChannelMutex;
+
+    //! The mutex protecting mDirectChannels for the event path. Taken after mDirectChannelMutex.
+    std::mutex mDirectChannelWriteMutex;
+
+    /**
+     * How long the reader may leave no room in the fmq before the events being written by the
+     * pending writes thread are dropped.
+     */
+    static const int64_t kPendingWriteTimeoutNs = 5 * INT64_C(1000000000) /* 5 seconds */;
+
+    //! The shortest the pending writes thread waits for room before checking its queues again.
+    static constexpr int64_t kMinPendingWriteTimeoutNs = 10 * INT64_C(1000000) /* 10 ms */;
+
+    //! The pending writes thread writes at once about what the reader drains in that time.
+    static constexpr int64_t kPendingWriteChunkNs = 10 * INT64_C(1000000) /* 10 ms */;
+
+    //! The fewest events the pending writes thread writes at once.
+    static constexpr size_t kMinPendingWriteChunkSize = 16;
+
+    /**
+     * How long the reader may take to drain a pending write events queue before sheddable events
+     * are decimated to make room for new ones, rather than when the queue overflows.
+     */
+    static constexpr int64_t kMaxPendingWriteDrainNs = INT64_C(1000000000) /* 1 second */;
+
+    //! The most queued events a post looks at to decimate them, bounding the work under the lock.
+    static constexpr size_t kMaxNumShedScannedEvents = 1024;
+
+    //! When evicting sheddable events from a full queue, free this fraction of it on top.
+    static constexpr size_t kShedHeadroomDivisor = 64;
+
+    //! The time constant of the moving average of the drain rate of the reader.
+    static constexpr int64_t kDrainRateWindowNs = 100 * INT64_C(1000000) /* 100 ms */;
+
+    //! The bit mask used to get the subhal index from a sensor handle.
+    static constexpr int32_t kSensorHandleSubHalIndexMask = 0xFF000000;
+
+    //! The max number of events allowed in the pending write events queue
+    static constexpr size_t kMaxSizePendingWriteEventsQueue = 100000;
+
+    /**
+     * A FIFO ring of events, split in spans that each know their number of wakeup events, which
+     * are waiting to be written to the events fmq in the background thread.
+     */
+    PendingWriteEventsQueue mPendingWriteEventsQueue{kMaxSizePendingWriteEventsQueue};
+
+    //! The most events observed on the pending write events queue for debug purposes.
+    size_t mMostEventsObservedPendingWriteEventsQueue = 0;
+
+    //! The max number of events allowed in the wakeup pending write events queue
+    static constexpr size_t kMaxSizeWakeupPendingWriteEventsQueue = 10000;
+
+    /**
+     * The priority lane for the events of wake-up sensors, including their flush complete events.
+     * The pending writes thread always drains it before mPendingWriteEventsQueue, and wake-up
+     * events may be written to the fmq while non-wakeup events are waiting, so a wake-up event is
+     * never queued behind a backlog of non-wakeup events.
+     */
+    PendingWriteEventsQueue mWakeupPendingWriteEventsQueue{kMaxSizeWakeupPendingWriteEventsQueue};
+
+    /**
+     * Whether mWakeupPendingWriteEventsQueue holds events, set with the write mutex held and read
+     * without it by the pending writes thread while it writes non-wakeup events.
+     */
+    std::atomic_bool mWakeupPendingWriteEventsQueued = false;
+
+    //! The most events observed on the wakeup pending write events queue for debug purposes.
+    size_t mMostEventsObservedWakeupPendingWriteEventsQueue = 0;
+
+    //! The queue holding the events being written by the pending writes thread, if any.
+    const PendingWriteEventsQueue* mPendingWriteEventsQueueInFlight = nullptr;
+
+    //! The number of events at the front of that queue being written.
+    size_t mNumPendingWriteEventsInFlight = 0;
+
+    /**
+     * The rate at which the reader reads events from the fmq, as measured by the pending writes
+     * thread from the EVENTS_READ wakes while it waits for room. Negative until measured again
+     * once the pending write events queues have been drained.
+     */
+    double mEventQueueDrainRateHz = -1;
+
+    //! The time from post to write to the fmq of the events of non-wakeup and wake-up sensors.
+    LatencyHistogram mNonWakeupPostToWriteLatency;
+    LatencyHistogram mWakeupPostToWriteLatency;
+
+    //! Where a post mixing wakeup and non-wakeup events is split, protected by the write mutex.
+    std::vector<Event> mSplitPostEvents;
+
+    /**
+     * The number of events dropped because a pending write events queue overflowed or held more
+     * than the reader drains in kMaxPendingWriteDrainNs.
+     */
+    uint64_t mNumEventsShed = 0;
+
+    //! The number of blocking writes of pending events to the fmq that failed, and their events.
+    std::atomic<uint64_t> mNumEventQueueWriteFailures = 0;
+    std::atomic<uint64_t> mNumEventsDropped = 0;
+
+    //! The mutex protecting writing to the fmq and the pending events queue
+    std::mutex mEventQueueWriteMutex;
+
+    //! The number of posts that are writing or waiting to write to the fmq.
+    std::atomic_size_t mNumPostsInFlight = 0;
+
+    /**
+     * Whether events were written to the fmq that the reader hasn't been woken up for yet, and
+     * when the first of them was written.
+     */
+    bool mEventQueueWakePending = false;
+    int64_t mEventQueueWakePendingSinceNs = 0;
+
+    //! The longest the wake for events written by posts is deferred while posts keep overlapping.
+    static constexpr int64_t kMaxEventQueueWakeDeferralNs = INT64_C(1000000) /* 1 ms */;
+
+    //! The number of events written to the fmq without going through the pending events queue.
+    uint64_t mNumEventsPostedToEventQueue = 0;
+
+    //! The number of READ_AND_PROCESS wakes issued for those events.
+    uint64_t mNumEventQueueWakes = 0;
+
+    //! The condition variable waiting for pending write events to stack up
+    std::condition_variable mEventQueueWriteCV;
+
+    //! The thread object ptr that handles pending writes
+    std::thread mPendingWritesThread;
+
+    //! The thread object that handles wakelocks
+    std::thread mWakelockThread;
+
+    //! The names and scheduling settings of the threads, read from properties as they start.
+    ThreadConfig mPendingWritesThreadConfig;
+    ThreadConfig mWakelockThreadConfig;
+
+    /**
+     * Whether the pending writes thread is waiting for events, and when it was first notified
+     * since, 0 if it wasn't. Protected by mEventQueueWriteMutex.
+     */
+    bool mPendingWritesThreadWaiting = false;
+    int64_t mPendingWritesNotifyTimeNs = 0;
+
+    /**
+     * Whether the wakelock thread is waiting for the wakelock to be acquired, and when it was
+     * notified since, 0 if it wasn't. Protected by mWakelockMutex.
+     */
+    bool mWakelockThreadWaiting = false;
+    int64_t mWakelockNotifyTimeNs = 0;
+
+    //! From a thread being notified to the thread running, to tune the thread settings.
+    LatencyHistogram mPendingWritesWakeLatency;
+    LatencyHistogram mWakelockWakeLatency;
+
+    //! The bool indicating whether to end the threads started in initialize
+    std::atomic_bool mThreadsRun = true;
+
+    //! How long loading the subhal libraries took.
+    int64_t mSubHalLoadDurationNs = 0;
+
+    //! How long getting and processing the sensor lists of the subhals took.
+    int64_t mSensorListDurationNs = 0;
+
+    //! How long the last initialization of the subhals took, overall and per subhal.
+    int64_t mSubHalInitializeDurationNs = 0;
+    std::vector<int64_t> mSubHalInitializeDurationsNs;
+
+    //! The mutex protecting access to the dynamic sensors added and removed methods.
+    std::mutex mDynamicSensorsMutex;
+
+    // WakelockRefCount membar vars below
+
+    /**
+     * The mutex serializing the acquisitions and releases of the shared wakelock, which happen
+     * when the wakelock refcount leaves or reaches 0. Refs added to or removed from a non zero
+     * count don't take it, so posts don't contend with the wakelock thread.
+     */
+    std::recursive_mutex mWakelockMutex;
+
+    std::condition_variable_any mWakelockCV;
+
+    /**
+     * The refcount of how many events with wakeup bits are waiting to be handled by the
+     * framework in the low 32 bits, and the number of times the shared wakelock was reset in the
+     * high 32 bits. Only changed with a CAS, which the count only leaves or reaches 0 by with
+     * mWakelockMutex held.
+     */
+    std::atomic<uint64_t> mWakelockState = 0;
+
+    //! When refs were last added, the shared wakelock times out kWakelockTimeoutNs after.
+    std::atomic<int64_t> mWakelockTimeoutStartTime{V2_0::implementation::getTimeNow()};
+
+    std::atomic<int64_t> mWakelockTimeoutResetTime{V2_0::implementation::getTimeNow()};
+
+    const char* kWakelockName = "SensorsHAL_WAKEUP";
+
+    //! The subhal index used for wakelock refs that aren't attributed to a given subhal.
+    static constexpr int32_t kUnattributedSubHalIndex = -1;
+
+    //! The wakelock ref counters given to the subhals, indexed by subhal index.
+    std::vector<sp<SubHalWakelockRefCounter>> mSubHalWakelockRefCounters;
+
+    /**
+     * The mutex protecting the attribution of the wakelock refs to the subhals, only held to
+     * update it. Taken after mWakelockMutex. The shares may briefly disagree with the shared
+     * refcount, since they are updated after it.
+     */
+    std::mutex mWakelockStatsMutex;
+
+    //! The share of the wakelock ref count held for each subhal, indexed by subhal index.
+    std::vector<SubHalWakelockStats> mSubHalWakelockStats;
+
+    //! The subhals that posted the wakeup events the framework hasn't acknowledged yet.
+    WakeupEventOwners mWakeupEventOwners;
+
+    /**
+     * The software FIFOs of the non wake-up sensors without a hardware FIFO. Declared last so that
+     * its thread, which writes to the event fmq, is stopped first.
+     */
+    SoftwareBatcher mSoftwareBatcher{
+            [this](const Event* events, size_t numEvents, int64_t postTimeNs) {
+                writeSoftwareBatchToMessageQueue(events, numEvents, postTimeNs);
+            },
+            ThreadConfig::fromProperties("software_batcher", "HalProxyBatcher")};
+
+    /**
+     * Initialize the list of SubHal objects in mSubHalList by reading from dynamic libraries
+     * listed in a config file. The libraries are loaded concurrently.
+     *
+     * If kLazyLoadProperty is set, the subhals are instead initialized from the subhal cache and
+     * only loaded once used. The cache is written after loading all the libraries when it's
+     * missing or stale. It's not used when the vendor build fingerprint is unknown.
+     */
+    void initializeSubHalListFromConfigFile(const char* configFileName);
+
+    /**
+     * Read the libraries listed in a config file.
+     *
+     * @return false if the file couldn't be opened.
+     */
+    bool readSubHalConfigFile(const char* configFileName, std::vector<std::string>* libraryFiles);
+
+    /**
+     * Apply the changes made to the config file since the service started, for debug dumps. The
+     * libraries that are newly listed are loaded as new subhals, whose sensors are announced to
+     * the framework as dynamic sensors. The subhals loaded that way whose library is no longer
+     * listed get their sensors disabled and disconnected. Subhals loaded when the service started
+     * stay, since their sensors are in the static sensor list.
+     *
+     * Libraries are never unloaded, as a subhal may keep threads running, so loading a rebuilt
+     * library requires listing it under another file name.
+     *
+     * @param stream The stream to describe the changes to.
+     */
+    void reloadSubHals(std::ostream& stream);
+
+    /**
+     * Announce the sensors of a subhal loaded after the service started to the framework.
+     *
+     * @param subHalIndex The index of the subhal.
+     */
+    void connectReloadedSubHal(size_t subHalIndex);
+
+    /**
+     * Initialize the list of SubHal objects in mSubHalList with subhals that are loaded on
+     * demand, from the subhal cache.
+     *
+     * @param buildFingerprint The fingerprint of the current build, from
+     *    SubHalCache::getBuildFingerprint(). A cache written by another build is deleted.
+     * @param libraries The libraries listed in the config file, with their current stamps.
+     *
+     * @return false if the cache is missing or was written for another build or other libraries.
+     */
+    bool initializeLazySubHalList(const std::string& buildFingerprint,
+                                  const std::vector<SubHalCache::Library>& libraries);
+
+    /**
+     * Write the subhal cache from the subhals in mSubHalList.
+     *
+     * @param buildFingerprint The fingerprint of the current build.
+     * @param libraries The libraries listed in the config file, with their current stamps.
+     * @param loadedLibraryFiles The library each subhal in mSubHalList was loaded from.
+     */
+    void writeSubHalCache(const std::string& buildFingerprint,
+                          const std::vector<SubHalCache::Library>& libraries,
+                          const std::vector<std::string>& loadedLibraryFiles);
+
+    /**
+     * Load a subhal from its dynamic library.
+     *
+     * @param subHalLibraryFile The file name of the library.
+     *
+     * @return The subhal, or nullptr if it couldn't be loaded.
+     */
+    std::shared_ptr<ISubHalWrapperBase> loadSubHal(const std::string& subHalLibraryFile);
+
+    /**
+     * Initialize the list of SensorInfo objects in mSensorList by getting sensors from each
+     * subhal.
+     */
+    void initializeSensorList();
+
+    /**
+     * Rebuild the sensor lists handed out by getSensorsList_2_1 and getSensorsList from mSensors.
+     * Must be called whenever mSensors changes.
+     */
+    void rebuildSensorListCache();
+
+    /**
+     * Try using the default include directories as well as the directories defined in
+     * kSubHalShareObjectLocations to get a handle for dlsym for a subhal.
+     *
+     * @param filename The file name to search for.
+     *
+     * @return The handle or nullptr if search failed.
+     */
+    void* getHandleForSubHalSharedObject(const std::string& filename);
+
+    /**
+     * Get the stamp of the library that getHandleForSubHalSharedObject would open.
+     *
+     * @param filename The file name to search for.
+     *
+     * @return The stamp, or an empty string if the library wasn't found.
+     */
+    std::string getSubHalSharedObjectStamp(const std::string& filename);
+
+    /**
+     * Calls the helper methods that all ctors use.
+     */
+    void init();
+
+    /**
+     * Stops all threads by setting the threads running flag to false and joining to them.
+     */
+    void stopThreads();
+
+    /**
+     * Disable all the sensors observed by the HalProxy.
+     */
+    void disableAllSensors();
+
+    /**
+     * Starts the thread that handles pending writes to event fmq.
+     *
+     * @param halProxy The HalProxy object pointer.
+     */
+    static void startPendingWritesThread(HalProxy* halProxy);
+
+    /**
+     * Handles the pending writes on events to eventqueue. Each write takes about what the reader
+     * drains in kPendingWriteChunkNs, and waits for room a few times as long as that should take,
+     * so that wake-up events and the load shedding are never held up for long by a slow reader.
+     * Until the drain rate is measured, non-wakeup events are written kMinPendingWriteChunkSize at
+     * a time, waiting kMinPendingWriteTimeoutNs at most. A write of non-wakeup events also stops
+     * as soon as wake-up events are queued, which then only wait for the events already written.
+     */
+    void handlePendingWrites();
+
+    /**
+     * Write events to the fmq as the reader makes room for them, and measure how fast it does.
+     *
+     * @param events The array of events to write.
+     * @param numEvents The number of events in events.
+     * @param timeoutNs How long to wait for room in total.
+     * @param yieldToWakeupEvents Whether to return early, after a write or a wait, once wake-up
+     *    events are queued.
+     * @param drainRateHz The drain rate of the reader to update, negative if unknown.
+     *
+     * @return The number of events written, from the front of events.
+     */
+    size_t writePendingEvents(const Event* events, size_t numEvents, int64_t timeoutNs,
+                              bool yieldToWakeupEvents, double* drainRateHz);
+
+    /**
+     * @return The number of events a pending write events queue may hold before its sheddable
+     *    events are decimated, from the drain rate of the reader. Requires mEventQueueWriteMutex.
+     */
+    size_t getPendingWriteLimit() const;
+
+    /**
+     * Starts the thread that handles decrementing the ref count on wakeup events processed by the
+     * framework and timing out wakelocks.
+     *
+     * @param halProxy The HalProxy object pointer.
+     */
+    static void startWakelockThread(HalProxy* halProxy);
+
+    //! Handles the wakelocks.
+    void handleWakelocks();
+
+    /**
+     * Increment the wakelock ref count and attribute the refs to a subhal.
+     *
+     * @param delta The number of refs to add.
+     * @param timeoutStart Set to the number of resets of the shared wakelock so far if not
+     *    nullptr, which identifies the refs to releaseWakelockRefs.
+     * @param subHalIndex The subhal to attribute the refs to, or kUnattributedSubHalIndex.
+     * @param forEvents Whether the refs are held for wakeup events until the framework acks them.
+     *
+     * @return true if the refs were added.
+     */
+    bool acquireWakelockRefs(size_t delta, int64_t* timeoutStart, int32_t subHalIndex,
+                             bool forEvents);
+
+    /**
+     * Decrement the wakelock ref count and the share of the subhal the refs were attributed to.
+     *
+     * @param delta The number of refs to remove.
+     * @param timeoutStart What acquireWakelockRefs set it to, or -1. The refs are not removed if
+     *    the shared wakelock was reset since they were added, which removed them already.
+     * @param subHalIndex The subhal the refs were attributed to. For wakeup events, passing
+     *    kUnattributedSubHalIndex removes the refs of the oldest events, which is what a framework
+     *    ack is for.
+     * @param forEvents Whether the refs were held for wakeup events.
+     */
+    void releaseWakelockRefs(size_t delta, int64_t timeoutStart, int32_t subHalIndex,
+                             bool forEvents);
+
+    /**
+     * @param timeLeft The variable that should be set to the timeleft before timeout will occur or
+     * unmodified if timeout occurred.
+     *
+     * @return true if the shared wakelock has been held passed the timeout and should be released
+     */
+    bool sharedWakelockDidTimeout(int64_t* timeLeft);
+
+    /**
+     * Reset all the member variables associated with the wakelock ref count and maybe release
+     * the shared wakelock.
+     */
+    void resetSharedWakelock();
+
+    /**
+     * Count the number of wakeup events in the first n events of the array.
+     *
+     * @param events The array of Event objects.
+     * @param n The end index not inclusive of events to consider.
+     *
+     * @return The number of wakeup events of the considered events.
+     */
+    size_t countNumWakeupEvents(const Event* events, size_t n);
+
+    /**
+     * Write events to the event fmq, or to the pending write events queues what doesn't fit. The
+     * wakeup and non-wakeup events of a post are written separately, the wakeup ones first.
+     *
+     * @param events The array of events to write.
+     * @param numEvents The number of events in events.
+     * @param numWakeupEvents The number of wakeup events in events.
+     * @param postTimeNs When the events were posted by the subhal.
+     * @param acquireWakelock Whether to acquire wakelock refs for the wakeup events.
+     */
+    void writeEventsToMessageQueue(const Event* events, size_t numEvents, size_t numWakeupEvents,
+                                   int64_t postTimeNs, bool acquireWakelock);
+
+    /**
+     * Write the events flushed from a software batch, which are all non wake-up. Dropped while the
+     * threads are stopped.
+     *
+     * @param events The array of events to write.
+     * @param numEvents The number of events in events.
+     * @param postTimeNs When the oldest of the events was posted by the subhal.
+     */
+    void writeSoftwareBatchToMessageQueue(const Event* events, size_t numEvents,
+                                          int64_t postTimeNs);
+
+    /**
+     * Write events of one lane to the event fmq, or to the pending write events queue of the lane
+     * what doesn't fit.
+     *
+     * @param queue mWakeupPendingWriteEventsQueue or mPendingWriteEventsQueue.
+     * @param events The array of events to write, all of wake-up sensors if queue is
+     *    mWakeupPendingWriteEventsQueue and all of non-wakeup sensors otherwise.
+     * @param numEvents The number of events in events.
+     * @param postTimeNs When the events were posted by the subhal.
+     * @param now The current time.
+     */
+    void writeEventsToMessageQueueLane(PendingWriteEventsQueue& queue, const Event* events,
+                                       size_t numEvents, int64_t postTimeNs, int64_t now);
+
+    //! Wake the reader for the events posts wrote to the fmq. Requires mEventQueueWriteMutex.
+    void wakeEventQueueReader();
+
+    /**
+     * Make room on a pending write events queue for events that don't fit, and push them.
+     *
+     * Continuous non wake-up events already queued are decimated evenly per sensor, newest first,
+     * looking at no more than kMaxNumShedScannedEvents of them, until the events fit under the
+     * limit. If the events that aren't sheddable still don't fit in the queue, the queued
+     * sheddable events are evicted first. Only then are the sheddable events of the post dropped,
+     * and the others as a last resort.
+     *
+     * @param queue The queue to push to.
+     * @param events The array of events to push.
+     * @param numEvents The number of events in events.
+     * @param numSheddableEvents The number of sheddable events in events.
+     * @param postTimeNs When the events were posted by the subhal.
+     * @param now The current time.
+     * @param limit The number of events the queue should hold at most, from
+     *    getPendingWriteLimit().
+     */
+    void shedLoadAndPushPendingWriteEvents(PendingWriteEventsQueue& queue, const Event* events,
+                                           size_t numEvents, size_t numSheddableEvents,
+                                           int64_t postTimeNs, int64_t now, size_t limit);
+
+    //! Count an event dropped by shedLoadAndPushPendingWriteEvents.
+    void countShedEvent(const Event& event);
+
+    /**
+     * Record the same latency for each of the events in the histogram of its sensor.
+     *
+     * @param events The array of Event objects.
+     * @param n The number of events to record.
+     * @param histogram The histogram of the sensor latency stats to record in.
+     * @param latencyNs The latency to record.
+     */
+    void recordLatency(const Event* events, size_t n,
+                       LatencyHistogram SensorLatencyStats::*histogram, int64_t latencyNs);
+
+    /**
+     * Dump the latency histograms of a sensor if any events were recorded for it.
+     *
+     * @param stream The stream to write to.
+     * @param sensor The sensor to dump the histograms of.
+     * @param reset Whether to reset the histograms once dumped.
+     */
+    void dumpSensorLatency(std::ostream& stream, const SensorInfo& sensor, bool reset);
+
+    /**
+     * Write the counters of the proxy, of each sensor and of each subhal as one JSON object per
+     * line, for tools to parse. Event rates are averaged since the previous call.
+     *
+     * @param stream The stream to write to.
+     */
+    void dumpStats(std::ostream& stream);
+
+    /*
+     * Set the direct report flags of a sensor. A channel is written by a single subhal or by the
+     * proxy, so direct report is only advertised for the sensors of mDirectChannelSubHalIndex, or
+     * emulated by the proxy if no subhal supports it. Also keep track of whether any sensor
+     * supports direct report.
+     *
+     * @param sensorInfo The SensorInfo object that may be altered to have direct channel support
+     *    enabled or disabled.
+     */
+    void setDirectChannelFlags(SensorInfo* sensorInfo);
+
+    /**
+     * Make a subhal or the proxy the writer of a direct channel, registering the channel with the
+     * subhal. Needs mDirectChannelMutex.
+     *
+     * @param channel The channel.
+     * @param owner The subhal index or DirectChannel::kProxyOwner.
+     *
+     * @return false if another writer has reports configured on the channel, or if the new one
+     *    can't write to it.
+     */
+    bool claimDirectChannel(DirectChannel& channel, int32_t owner);
+
+    /**
+     * Enable and configure a sensor whose direct report the proxy emulates in its subhal, from
+     * the framework request and the direct reports of the sensor. Needs mDirectChannelMutex.
+     *
+     * @param sensorHandle The handle of the sensor.
+     *
+     * @return The result of the subhal calls.
+     */
+    Result applyEmulatedDirectReportConfig(int32_t sensorHandle);
+
+    //! Unregister all the direct channels, as when the framework restarts.
+    void resetDirectChannels();
+
+    /*
+     * Get the subhal pointer which can be found by indexing into the mSubHalList vector
+     * using the index from the first byte of sensorHandle.
+     *
+     * @param sensorHandle The handle used to identify a sensor in one of the subhals.
+     */
+    std::shared_ptr<ISubHalWrapperBase> getSubHalForSensorHandle(int32_t sensorHandle);
+
+    /**
+     * Checks that sensorHandle's subhal index byte is within bounds of mSubHalList.
+     *
+     * @param sensorHandle The sensor handle to check.
+     *
+     * @return true if sensorHandles's subhal index byte is valid.
+     */
+    bool isSubHalIndexValid(int32_t sensorHandle);
+
+    /*
+     * Clear out the subhal index bytes from a sensorHandle.
+     *
+     * @param sensorHandle The sensor handle to modify.
+     *
+     * @return The modified version of the sensor handle.
+     */
+    static int32_t clearSubHalIndex(int32_t sensorHandle);
+
+    /**
+     * @param sensorHandle The sensor handle to modify.
+     *
+     * @return true if subHalIndex byte of sensorHandle is zeroed.
+     */
+    static bool subHalIndexIsClear(int32_t sensorHandle);
+};
+
+/**
+ * Since a newer HAL can't masquerade as a older HAL, IHalProxy enables the HalProxy to be compiled
+ * either for HAL 2.0 or HAL 2.1 depending on the build configuration.
+ */
+template <class ISensorsVersion>
+struct IHalProxy : public HalProxy, public ISensorsVersion {
+    Return<void> getSensorsList(ISensorsV2_0::getSensorsList_cb _hidl_cb) override {
+        return HalProxy::getSensorsList(_hidl_cb);
+    }
+
+    Return<Result> setOperationMode(OperationMode mode) override {
+        return HalProxy::setOperationMode(mode);
+    }
+
+    Return<Result> activate(int32_t sensorHandle, bool enabled) override {
+        return HalProxy::activate(sensorHandle, enabled);
+    }
+
+    Return<Result> initialize(
+            const ::android::hardware::MQDescriptorSync<V1_0::Event>& eventQueueDescriptor,
+            const ::android::hardware::MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+            const sp<V2_0::ISensorsCallback>& sensorsCallback) override {
+        return HalProxy::initialize(eventQueueDescriptor, wakeLockDescriptor, sensorsCallback);
+    }
+
+    Return<Result> batch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                         int64_t maxReportLatencyNs) override {
+        return HalProxy::batch(sensorHandle, samplingPeriodNs, maxReportLatencyNs);
+    }
+
+    Return<Result> flush(int32_t sensorHandle) override { return HalProxy::flush(sensorHandle); }
+
+    Return<Result> injectSensorData(const V1_0::Event& event) override {
+        return HalProxy::injectSensorData(event);
+    }
+
+    Return<void> registerDirectChannel(const SharedMemInfo& mem,
+                                       ISensorsV2_0::registerDirectChannel_cb _hidl_cb) override {
+        return HalProxy::registerDirectChannel(mem, _hidl_cb);
+    }
+
+    Return<Result> unregisterDirectChannel(int32_t channelHandle) override {
+        return HalProxy::unregisterDirectChannel(channelHandle);
+    }
+
+    Return<void> configDirectReport(int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
+                                    ISensorsV2_0::configDirectReport_cb _hidl_cb) override {
+        return HalProxy::configDirectReport(sensorHandle, channelHandle, rate, _hidl_cb);
+    }
+
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) override {
+        return HalProxy::debug(fd, args);
+    }
+};
+
+struct HalProxyV2_0 : public IHalProxy<V2_0::ISensors> {};
+
+struct HalProxyV2_1 : public IHalProxy<V2_1::ISensors> {
+    Return<void> getSensorsList_2_1(ISensorsV2_1::getSensorsList_2_1_cb _hidl_cb) override {
+        return HalProxy::getSensorsList_2_1(_hidl_cb);
+    }
+
+    Return<Result> initialize_2_1(
+            const ::android::hardware::MQDescriptorSync<V2_1::Event>& eventQueueDescriptor,
+            const ::android::hardware::MQDescriptorSync<uint32_t>& wakeLockDescriptor,
+            const sp<V2_1::ISensorsCallback>& sensorsCallback) override {
+        return HalProxy::initialize_2_1(eventQueueDescriptor, wakeLockDescriptor, sensorsCallback);
+    }
+
+    Return<Result> injectSensorData_2_1(const Event& event) override {
+        return HalProxy::injectSensorData_2_1(event);
+    }
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
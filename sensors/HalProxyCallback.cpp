@@ -16,6 +16,10 @@
 
 #include "HalProxyCallback.h"
 
+#include "EventConversion.h"
+
+#include <utils/SystemClock.h>
+
 #include <cinttypes>
 
 namespace android {
@@ -35,14 +39,54 @@ static constexpr int32_t kBitsAfterSubHalIndex = 24;
  * @return The modified sensor handle.
  */
 int32_t setSubHalIndex(int32_t sensorHandle, size_t subHalIndex) {
-    return sensorHandle | (static_cast<int32_t>(subHalIndex) << kBitsAfterSubHalIndex);
+    // Indices from 128 set the sign bit, which only unsigned shifts are defined for.
+    return sensorHandle |
+           static_cast<int32_t>(static_cast<uint32_t>(subHalIndex) << kBitsAfterSubHalIndex);
 }
 
+// Subhals hand their events over as const, so they are copied once into a per thread buffer that
+// keeps its capacity between posts and is processed and posted from in place.
+static thread_local std::vector<V2_1::Event> sPostedEvents;
+static thread_local std::vector<V2_1::Event> sBatchedEvents;
+static thread_local std::vector<V2_1::Event> sDirectEvents;
+
 void HalProxyCallbackBase::postEvents(const std::vector<V2_1::Event>& events,
                                       ScopedWakelock wakelock) {
     if (events.empty() || !mCallback->areThreadsRunning()) return;
+    int64_t postTimeNs = ::android::elapsedRealtimeNano();
+    sPostedEvents.assign(events.begin(), events.end());
+    postBufferedEvents(postTimeNs, std::move(wakelock));
+}
+
+void HalProxyCallbackBase::postEvents(const std::vector<V1_0::Event>& events,
+                                      ScopedWakelock wakelock) {
+    if (events.empty() || !mCallback->areThreadsRunning()) return;
+    int64_t postTimeNs = ::android::elapsedRealtimeNano();
+    // Only the events past the previous size of the buffer are initialized before being
+    // overwritten, the buffer has reached its steady size after a few posts.
+    sPostedEvents.resize(events.size());
+    V2_1::implementation::convertToNewEvents(events.data(), events.size(), sPostedEvents.data());
+    postBufferedEvents(postTimeNs, std::move(wakelock));
+}
+
+void HalProxyCallbackBase::postBufferedEvents(int64_t postTimeNs, ScopedWakelock wakelock) {
+    V2_1::implementation::EventRecorder& recorder = mCallback->getEventRecorder();
+    if (recorder.isRecording()) {
+        recorder.recordEvents(sPostedEvents.data(), sPostedEvents.size(), mSubHalIndex,
+                              postTimeNs);
+    }
+    sBatchedEvents.clear();
+    sDirectEvents.clear();
     size_t numWakeupEvents;
-    std::vector<V2_1::Event> processedEvents = processEvents(events, &numWakeupEvents);
+    size_t numEvents = processEvents(sPostedEvents.data(), sPostedEvents.size(), postTimeNs,
+                                     &numWakeupEvents, &sBatchedEvents, &sDirectEvents);
+    if (!sDirectEvents.empty()) {
+        mCallback->postEventsToDirectChannels(sDirectEvents.data(), sDirectEvents.size());
+    }
+    if (!sBatchedEvents.empty()) {
+        mCallback->postEventsToSoftwareBatches(sBatchedEvents.data(), sBatchedEvents.size(),
+                                               postTimeNs);
+    }
     if (numWakeupEvents > 0) {
         ALOG_ASSERT(wakelock.isLocked(),
                     "Wakeup events posted while wakelock unlocked for subhal"
@@ -54,7 +98,9 @@ void HalProxyCallbackBase::postEvents(const std::vector<V2_1::Event>& events,
                     " w/ index %" PRId32 ".",
                     mSubHalIndex);
     }
-    mCallback->postEventsToMessageQueue(processedEvents, numWakeupEvents, std::move(wakelock));
+    if (numEvents == 0) return;
+    mCallback->postEventsToMessageQueue(sPostedEvents.data(), numEvents, numWakeupEvents,
+                                        postTimeNs, std::move(wakelock));
 }
 
 ScopedWakelock HalProxyCallbackBase::createScopedWakelock(bool lock) {
@@ -62,25 +108,90 @@ ScopedWakelock HalProxyCallbackBase::createScopedWakelock(bool lock) {
     return wakelock;
 }
 
-std::vector<V2_1::Event> HalProxyCallbackBase::processEvents(const std::vector<V2_1::Event>& events,
-                                                             size_t* numWakeupEvents) const {
+size_t HalProxyCallbackBase::processEvents(V2_1::Event* events, size_t numEvents,
+                                           int64_t postTimeNs, size_t* numWakeupEvents,
+                                           std::vector<V2_1::Event>* batchedEvents,
+                                           std::vector<V2_1::Event>* directEvents) const {
+    using V2_1::implementation::SensorLatencyStats;
+    using V2_1::implementation::SensorRegistry;
+
     *numWakeupEvents = 0;
-    std::vector<V2_1::Event> eventsOut;
-    for (V2_1::Event event : events) {
+    size_t numKept = 0;
+    const SensorRegistry& registry = mCallback->getSensorRegistry();
+    // Subhals mostly post runs of events from the same sensor, so lookups are reused for the run.
+    int32_t sensorHandle = 0;
+    uint8_t sensorFlags = 0;
+    SensorLatencyStats* latencyStats = nullptr;
+    V2_1::implementation::EventFilter filter;
+    V2_1::implementation::EventDeduplicator* deduplicator = nullptr;
+    // The accepted and suppressed events are counted once per run too.
+    size_t numAcceptedInRun = 0;
+    size_t numSuppressedInRun = 0;
+    for (size_t i = 0; i < numEvents; i++) {
+        V2_1::Event& event = events[i];
         event.sensorHandle = setSubHalIndex(event.sensorHandle, mSubHalIndex);
-        const V2_1::SensorInfo& sensor = mCallback->getSensorInfo(event.sensorHandle);
+        if (i == 0 || event.sensorHandle != sensorHandle) {
+            if (numAcceptedInRun > 0) {
+                registry.countEvents(sensorHandle, numAcceptedInRun);
+                numAcceptedInRun = 0;
+            }
+            if (numSuppressedInRun > 0) {
+                registry.countSuppressedEvents(sensorHandle, numSuppressedInRun);
+                numSuppressedInRun = 0;
+            }
+            sensorHandle = event.sensorHandle;
+            sensorFlags = registry.getFlags(sensorHandle);
+            latencyStats = registry.getLatencyStats(sensorHandle);
+            if ((sensorFlags & SensorRegistry::kFlagFilterEvents) != 0) {
+                filter = registry.getEventFilter(sensorHandle);
+            }
+            if ((sensorFlags & SensorRegistry::kFlagDeduplicate) != 0) {
+                deduplicator = registry.getDeduplicator(sensorHandle);
+            }
+        }
 
-        if (sensor.type == V2_1::SensorType::PICK_UP_GESTURE
-            && event.u.scalar != 1) {
+        if ((sensorFlags & SensorRegistry::kFlagFilterEvents) != 0 && !filter.accepts(event)) {
+            continue;
+        }
+        if ((sensorFlags & SensorRegistry::kFlagDeduplicate) != 0 &&
+            !deduplicator->accepts(event)) {
+            numSuppressedInRun++;
             continue;
         }
+        numAcceptedInRun++;
 
-        if ((sensor.flags & V1_0::SensorFlagBits::WAKE_UP) != 0) {
+        if ((sensorFlags & SensorRegistry::kFlagWakeUp) != 0) {
             (*numWakeupEvents)++;
         }
-        eventsOut.push_back(event);
+        if (latencyStats != nullptr) {
+            latencyStats->subHalToPost.record(postTimeNs - event.timestamp);
+        }
+        if ((sensorFlags & SensorRegistry::kFlagDirectReport) != 0 &&
+            event.sensorType != V2_1::SensorType::META_DATA &&
+            event.sensorType != V2_1::SensorType::ADDITIONAL_INFO) {
+            directEvents->push_back(event);
+            if ((sensorFlags & SensorRegistry::kFlagDirectReportOnly) != 0) {
+                continue;
+            }
+        }
+        // Flush complete events go through the batch too, so that they follow the batched events.
+        if ((sensorFlags & SensorRegistry::kFlagSoftwareBatched) != 0 &&
+            event.sensorType != V2_1::SensorType::ADDITIONAL_INFO) {
+            batchedEvents->push_back(event);
+            continue;
+        }
+        if (numKept != i) {
+            events[numKept] = event;
+        }
+        numKept++;
+    }
+    if (numAcceptedInRun > 0) {
+        registry.countEvents(sensorHandle, numAcceptedInRun);
+    }
+    if (numSuppressedInRun > 0) {
+        registry.countSuppressedEvents(sensorHandle, numSuppressedInRun);
     }
-    return eventsOut;
+    return numKept;
 }
 
 }  // namespace implementation
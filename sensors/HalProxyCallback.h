@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "EventTrace.h"
+#include "SensorRegistry.h"
+#include "V2_0/ScopedWakelock.h"
+#include "V2_0/SubHal.h"
+#include "V2_1/SubHal.h"
+#include "convertV2_1.h"
+
+#include <android/hardware/sensors/2.1/ISensors.h>
+#include <android/hardware/sensors/2.1/types.h>
+#include <log/log.h>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_0 {
+namespace implementation {
+
+/**
+ * Interface used to communicate with the HalProxy when subHals interact with their provided
+ * callback.
+ */
+class ISubHalCallback {
+  public:
+    virtual ~ISubHalCallback() {}
+
+    // Below methods from ::android::hardware::sensors::V2_0::ISensorsCallback with a minor change
+    // to pass in the sub-HAL index. While the above methods are invoked from the sensors framework
+    // via the proxy, these methods are invoked from sub-HALs using the callback provided during
+    // initialization.
+    virtual Return<void> onDynamicSensorsConnected(
+            const hidl_vec<V2_1::SensorInfo>& dynamicSensorsAdded, int32_t subHalIndex) = 0;
+
+    virtual Return<void> onDynamicSensorsDisconnected(
+            const hidl_vec<int32_t>& dynamicSensorHandlesRemoved, int32_t subHalIndex) = 0;
+
+    /**
+     * Post events to the event message queue if there is room to write them. Otherwise post the
+     * remaining events to a background thread that writes them as the reader makes room, and
+     * drops them if it makes none for kPendingWriteTimeoutNs.
+     *
+     * @param events The array of events to post to the message queue.
+     * @param numEvents The number of events in events.
+     * @param numWakeupEvents The number of wakeup events in events.
+     * @param postTimeNs The elapsed realtime at which the subhal posted the events.
+     * @param wakelock The wakelock associated with this post of events.
+     */
+    virtual void postEventsToMessageQueue(const V2_1::Event* events, size_t numEvents,
+                                          size_t numWakeupEvents, int64_t postTimeNs,
+                                          V2_0::implementation::ScopedWakelock wakelock) = 0;
+
+    /**
+     * Post non wake-up events of software batched sensors to their batches.
+     *
+     * @param events The array of events to post.
+     * @param numEvents The number of events in events.
+     * @param postTimeNs The elapsed realtime at which the subhal posted the events.
+     */
+    virtual void postEventsToSoftwareBatches(const V2_1::Event* events, size_t numEvents,
+                                             int64_t postTimeNs) = 0;
+
+    /**
+     * Write events to the direct channels the proxy writes to on behalf of their sensors.
+     *
+     * @param events The array of events to write.
+     * @param numEvents The number of events in events.
+     */
+    virtual void postEventsToDirectChannels(const V2_1::Event* events, size_t numEvents) = 0;
+
+    /**
+     * Get the registry of all the sensors, for lookups on the event path.
+     *
+     * @return The sensor registry.
+     */
+    virtual const V2_1::implementation::SensorRegistry& getSensorRegistry() = 0;
+
+    /**
+     * Get the recorder of the event trace, for the events to be recorded as the subhals post them.
+     *
+     * @return The event recorder.
+     */
+    virtual V2_1::implementation::EventRecorder& getEventRecorder() = 0;
+
+    virtual bool areThreadsRunning() = 0;
+};
+
+/**
+ * Callback class given to subhals that allows the HalProxy to know which subhal a given invocation
+ * is coming from.
+ */
+class HalProxyCallbackBase : public VirtualLightRefBase {
+  public:
+    HalProxyCallbackBase(ISubHalCallback* callback,
+                         V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                         int32_t subHalIndex)
+        : mCallback(callback), mRefCounter(refCounter), mSubHalIndex(subHalIndex) {}
+
+    void postEvents(const std::vector<V2_1::Event>& events,
+                    V2_0::implementation::ScopedWakelock wakelock);
+
+    //! Post the events of a 2.0 subhal, converted as they are copied to the post buffer.
+    void postEvents(const std::vector<V1_0::Event>& events,
+                    V2_0::implementation::ScopedWakelock wakelock);
+
+    V2_0::implementation::ScopedWakelock createScopedWakelock(bool lock);
+
+  protected:
+    ISubHalCallback* mCallback;
+    V2_0::implementation::IScopedWakelockRefCounter* mRefCounter;
+    int32_t mSubHalIndex;
+
+  private:
+    /**
+     * Record, process and post the events copied to the post buffer of the calling thread.
+     *
+     * @param postTimeNs The elapsed realtime at which the events were posted.
+     * @param wakelock The wakelock the subhal posted the events with.
+     */
+    void postBufferedEvents(int64_t postTimeNs, V2_0::implementation::ScopedWakelock wakelock);
+
+    /**
+     * Set the subhal index on the handles of the events and drop the ones the framework shouldn't
+     * see. Events are processed in place and the kept ones are moved to the front of the array.
+     * The latency from the subhal timestamp to the post is recorded for the kept events. Events
+     * of software batched sensors are moved out to batchedEvents instead of being kept, and the
+     * ones of sensors reported through direct channels by the proxy are copied to directEvents.
+     *
+     * @param events The array of events to process.
+     * @param numEvents The number of events in events.
+     * @param postTimeNs The elapsed realtime at which the events were posted.
+     * @param numWakeupEvents Set to the number of wakeup events kept.
+     * @param batchedEvents Filled with the events to post to the software batches.
+     * @param directEvents Filled with the events to post to the direct channels.
+     *
+     * @return The number of events kept.
+     */
+    size_t processEvents(V2_1::Event* events, size_t numEvents, int64_t postTimeNs,
+                         size_t* numWakeupEvents, std::vector<V2_1::Event>* batchedEvents,
+                         std::vector<V2_1::Event>* directEvents) const;
+};
+
+class HalProxyCallbackV2_0 : public HalProxyCallbackBase,
+                             public V2_0::implementation::IHalProxyCallback {
+  public:
+    HalProxyCallbackV2_0(ISubHalCallback* callback,
+                         V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                         int32_t subHalIndex)
+        : HalProxyCallbackBase(callback, refCounter, subHalIndex) {}
+
+    Return<void> onDynamicSensorsConnected(
+            const hidl_vec<V1_0::SensorInfo>& dynamicSensorsAdded) override {
+        return mCallback->onDynamicSensorsConnected(
+                V2_1::implementation::convertToNewSensorInfos(dynamicSensorsAdded), mSubHalIndex);
+    }
+
+    Return<void> onDynamicSensorsDisconnected(
+            const hidl_vec<int32_t>& dynamicSensorHandlesRemoved) override {
+        return mCallback->onDynamicSensorsDisconnected(dynamicSensorHandlesRemoved, mSubHalIndex);
+    }
+
+    void postEvents(const std::vector<V1_0::Event>& events,
+                    V2_0::implementation::ScopedWakelock wakelock) override {
+        HalProxyCallbackBase::postEvents(events, std::move(wakelock));
+    }
+
+    V2_0::implementation::ScopedWakelock createScopedWakelock(bool lock) override {
+        return HalProxyCallbackBase::createScopedWakelock(lock);
+    }
+};
+
+class HalProxyCallbackV2_1 : public HalProxyCallbackBase,
+                             public V2_1::implementation::IHalProxyCallback {
+  public:
+    HalProxyCallbackV2_1(ISubHalCallback* callback,
+                         V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                         int32_t subHalIndex)
+        : HalProxyCallbackBase(callback, refCounter, subHalIndex) {}
+
+    Return<void> onDynamicSensorsConnected_2_1(
+            const hidl_vec<V2_1::SensorInfo>& dynamicSensorsAdded) override {
+        return mCallback->onDynamicSensorsConnected(dynamicSensorsAdded, mSubHalIndex);
+    }
+
+    Return<void> onDynamicSensorsConnected(
+            const hidl_vec<V1_0::SensorInfo>& /* dynamicSensorsAdded */) override {
+        LOG_ALWAYS_FATAL("Old dynamic sensors method can't be used");
+        return Void();
+    }
+
+    Return<void> onDynamicSensorsDisconnected(
+            const hidl_vec<int32_t>& dynamicSensorHandlesRemoved) override {
+        return mCallback->onDynamicSensorsDisconnected(dynamicSensorHandlesRemoved, mSubHalIndex);
+    }
+
+    void postEvents(const std::vector<V2_1::Event>& events,
+                    V2_0::implementation::ScopedWakelock wakelock) override {
+        return HalProxyCallbackBase::postEvents(events, std::move(wakelock));
+    }
+
+    V2_0::implementation::ScopedWakelock createScopedWakelock(bool lock) override {
+        return HalProxyCallbackBase::createScopedWakelock(lock);
+    }
+};
+
+}  // namespace implementation
+}  // namespace V2_0
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
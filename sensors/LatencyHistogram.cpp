@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LatencyHistogram.h"
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+namespace {
+
+int64_t usFromNs(int64_t nanos) {
+    return nanos / 1000;
+}
+
+}  // namespace
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : mBuckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    mCount.store(0, std::memory_order_relaxed);
+    mSumNs.store(0, std::memory_order_relaxed);
+    mMaxNs.store(0, std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::getPercentileUpperBoundNs(double percentile) const {
+    uint64_t count = getCount();
+    if (count == 0) return 0;
+    uint64_t rank = static_cast<uint64_t>(percentile * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += mBuckets[i].load(std::memory_order_relaxed);
+        if (seen > rank) {
+            return getBucketUpperBoundNs(i);
+        }
+    }
+    return getBucketUpperBoundNs(kNumBuckets - 1);
+}
+
+void LatencyHistogram::dump(std::ostream& stream) const {
+    uint64_t count = getCount();
+    stream << "count=" << count;
+    if (count == 0) {
+        stream << std::endl;
+        return;
+    }
+    stream << " mean=" << usFromNs(mSumNs.load(std::memory_order_relaxed) / count) << "us"
+           << " max=" << usFromNs(mMaxNs.load(std::memory_order_relaxed)) << "us"
+           << " p50<" << usFromNs(getPercentileUpperBoundNs(0.5)) << "us"
+           << " p99<" << usFromNs(getPercentileUpperBoundNs(0.99)) << "us"
+           << " p999<" << usFromNs(getPercentileUpperBoundNs(0.999)) << "us"
+           << " buckets(<us:count)=";
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        uint64_t bucketCount = mBuckets[i].load(std::memory_order_relaxed);
+        if (bucketCount > 0) {
+            stream << " " << usFromNs(getBucketUpperBoundNs(i)) << ":" << bucketCount;
+        }
+    }
+    stream << std::endl;
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * Lock free histogram of durations with power of two buckets.
+ *
+ * Bucket 0 counts durations below 1 us and every following bucket doubles the upper bound, the
+ * last one also counting everything above it. Recording is a handful of relaxed atomic adds so it
+ * can be done from any thread on the event path. A dump racing with records or a reset may be off
+ * by the samples recorded meanwhile, which is fine for debugging.
+ */
+class LatencyHistogram {
+  public:
+    static constexpr size_t kNumBuckets = 24;
+
+    /**
+     * Record samples that all took the same time.
+     *
+     * @param durationNs The duration, negative durations are counted as 0.
+     * @param count The number of samples.
+     */
+    void record(int64_t durationNs, uint64_t count = 1) {
+        if (durationNs < 0) durationNs = 0;
+        mBuckets[bucketFor(durationNs)].fetch_add(count, std::memory_order_relaxed);
+        mCount.fetch_add(count, std::memory_order_relaxed);
+        mSumNs.fetch_add(static_cast<uint64_t>(durationNs) * count, std::memory_order_relaxed);
+        uint64_t max = mMaxNs.load(std::memory_order_relaxed);
+        while (static_cast<uint64_t>(durationNs) > max &&
+               !mMaxNs.compare_exchange_weak(max, durationNs, std::memory_order_relaxed)) {
+        }
+    }
+
+    void reset();
+
+    uint64_t getCount() const { return mCount.load(std::memory_order_relaxed); }
+
+    /**
+     * @param percentile The percentile to get, between 0 and 1.
+     *
+     * @return The upper bound in ns of the bucket the percentile falls in, 0 if nothing was
+     *    recorded.
+     */
+    int64_t getPercentileUpperBoundNs(double percentile) const;
+
+    /**
+     * Write the count, mean, max and percentiles followed by the non empty buckets on one line.
+     *
+     * @param stream The stream to write to.
+     */
+    void dump(std::ostream& stream) const;
+
+    static int64_t getBucketUpperBoundNs(size_t bucket) { return INT64_C(1000) << bucket; }
+
+  private:
+    static size_t bucketFor(int64_t durationNs) {
+        uint64_t us = static_cast<uint64_t>(durationNs) / 1000;
+        size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        return bucket < kNumBuckets ? bucket : kNumBuckets - 1;
+    }
+
+    std::atomic<uint64_t> mBuckets[kNumBuckets] = {};
+    std::atomic<uint64_t> mCount = 0;
+    std::atomic<uint64_t> mSumNs = 0;
+    std::atomic<uint64_t> mMaxNs = 0;
+};
+
+/**
+ * The latencies of the events of one sensor through the HalProxy.
+ */
+struct SensorLatencyStats {
+    //! From the event timestamp set by the subhal to the subhal posting the event.
+    LatencyHistogram subHalToPost;
+
+    //! From the subhal posting the event to the event being written to the event FMQ.
+    LatencyHistogram postToWrite;
+
+    //! Time the event spent on the pending write events queue, for events that went through it.
+    LatencyHistogram pendingQueue;
+
+    void reset() {
+        subHalToPost.reset();
+        postToWrite.reset();
+        pendingQueue.reset();
+    }
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PendingWriteEventsQueue.h"
+
+#include <log/log.h>
+
+#include <algorithm>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+bool PendingWriteEventsQueue::push(const Event* events, size_t numEvents, size_t numWakeupEvents,
+                                   size_t numSheddableEvents, int64_t postTimeNs,
+                                   int64_t enqueueTimeNs) {
+    if (numEvents == 0) {
+        return true;
+    }
+    if (numEvents > mCapacity - mSize) {
+        return false;
+    }
+    reserve(mSize + numEvents);
+
+    size_t tail = (mHead + mSize) % mStorageSize;
+    size_t numBeforeWrap = std::min(numEvents, mStorageSize - tail);
+    std::copy(events, events + numBeforeWrap, mEvents.get() + tail);
+    std::copy(events + numBeforeWrap, events + numEvents, mEvents.get());
+    mSize += numEvents;
+
+    if (mNumSpans == kMaxNumSpans) {
+        Span& back = mSpans[(mSpanHead + mNumSpans - 1) % kMaxNumSpans];
+        back.numEvents += numEvents;
+        back.numWakeupEvents += numWakeupEvents;
+        back.numSheddableEvents += numSheddableEvents;
+    } else {
+        mSpans[(mSpanHead + mNumSpans) % kMaxNumSpans] = {numEvents, numWakeupEvents,
+                                                          numSheddableEvents, postTimeNs,
+                                                          enqueueTimeNs};
+        mNumSpans++;
+    }
+    return true;
+}
+
+const PendingWriteEventsQueue::Span& PendingWriteEventsQueue::front(const Event** events,
+                                                                    size_t* numContiguous) const {
+    const Span& span = mSpans[mSpanHead];
+    *events = mEvents.get() + mHead;
+    *numContiguous = std::min(span.numEvents, mStorageSize - mHead);
+    return span;
+}
+
+void PendingWriteEventsQueue::pop(size_t numEvents, size_t numWakeupEvents) {
+    Span& span = mSpans[mSpanHead];
+    ALOG_ASSERT(numEvents <= span.numEvents, "Popping %zu events from span of %zu", numEvents,
+                span.numEvents);
+    span.numEvents -= numEvents;
+    span.numWakeupEvents -= std::min(span.numWakeupEvents, numWakeupEvents);
+    // Which of the popped events were sheddable isn't known, so the count stays an upper bound.
+    span.numSheddableEvents = std::min(span.numSheddableEvents, span.numEvents);
+    if (span.numEvents == 0) {
+        mSpanHead = (mSpanHead + 1) % kMaxNumSpans;
+        mNumSpans--;
+    }
+
+    mHead = (mHead + numEvents) % mStorageSize;
+    mSize -= numEvents;
+    if (mSize == 0) {
+        mHead = 0;
+    }
+    // Events are only read from the front span before being popped.
+    mRetiredEvents.clear();
+    maybeReleaseStorage();
+}
+
+void PendingWriteEventsQueue::reserve(size_t numEvents) {
+    if (numEvents <= mStorageSize) {
+        return;
+    }
+    size_t storageSize = std::max(mStorageSize, kMinStorageSize);
+    while (storageSize < numEvents) {
+        storageSize *= 2;
+    }
+    storageSize = std::min(storageSize, mCapacity);
+
+    std::unique_ptr<Event[]> events(new Event[storageSize]);
+    for (size_t i = 0; i < mSize; i++) {
+        events[i] = at(i);
+    }
+    if (mEvents != nullptr) {
+        mRetiredEvents.push_back(std::move(mEvents));
+    }
+    mEvents = std::move(events);
+    mStorageSize = storageSize;
+    mHead = 0;
+}
+
+void PendingWriteEventsQueue::maybeReleaseStorage() {
+    if (mSize == 0 && mStorageSize > kMaxRetainedStorageSize) {
+        mEvents.reset();
+        mStorageSize = 0;
+    }
+}
+
+namespace {
+
+/**
+ * Alternates a keep/drop decision per sensor handle. Handles are tracked in a small open addressed
+ * table, past which the extra handles share the parity of the last slot probed.
+ */
+class HandleParity {
+  public:
+    //! @return true for the 1st, 3rd, 5th... call with the same handle.
+    bool keepNext(int32_t sensorHandle) {
+        size_t slot = static_cast<uint32_t>(sensorHandle) % kNumSlots;
+        for (size_t i = 0; i < kNumSlots - 1; i++) {
+            if (!mUsed[slot] || mHandles[slot] == sensorHandle) break;
+            slot = (slot + 1) % kNumSlots;
+        }
+        mUsed[slot] = true;
+        mHandles[slot] = sensorHandle;
+        bool keep = !mSkipNext[slot];
+        mSkipNext[slot] = keep;
+        return keep;
+    }
+
+  private:
+    static constexpr size_t kNumSlots = 64;
+
+    std::array<int32_t, kNumSlots> mHandles = {};
+    std::array<bool, kNumSlots> mUsed = {};
+    std::array<bool, kNumSlots> mSkipNext = {};
+};
+
+}  // namespace
+
+size_t PendingWriteEventsQueue::shed(size_t numPinned, size_t numToDrop, size_t maxNumScanned,
+                                     bool decimate, const SensorRegistry& registry) {
+    if (numToDrop == 0 || mSize <= numPinned) {
+        return 0;
+    }
+    size_t lowest = mSize - std::min(maxNumScanned, mSize - numPinned);
+
+    // Walk the spans from the back, packing the kept events at the back of the queue. Once done,
+    // the events in [scanStart, keptStart) were dropped.
+    HandleParity parity;
+    size_t numDropped = 0;
+    size_t keptStart = mSize;
+    size_t scanStart = mSize;
+    size_t spanEnd = mSize;
+    for (size_t i = mNumSpans; i-- > 0 && numDropped < numToDrop && spanEnd > lowest;) {
+        Span& span = mSpans[(mSpanHead + i) % kMaxNumSpans];
+        size_t spanStart = spanEnd - span.numEvents;
+        size_t from = std::max(spanStart, lowest);
+        if (span.numSheddableEvents == 0) {
+            // The events only move if events behind them were dropped.
+            if (numDropped == 0) {
+                keptStart = from;
+            } else {
+                for (size_t j = spanEnd; j-- > from;) {
+                    at(--keptStart) = at(j);
+                }
+            }
+            scanStart = from;
+        } else {
+            size_t numDroppedInSpan = 0;
+            size_t j = spanEnd;
+            while (j > from && numDropped < numToDrop) {
+                j--;
+                const Event& event = at(j);
+                if (registry.isSheddable(event) &&
+                    (!decimate || !parity.keepNext(event.sensorHandle))) {
+                    registry.countShedEvents(event.sensorHandle, 1);
+                    numDropped++;
+                    numDroppedInSpan++;
+                } else if (--keptStart != j) {
+                    at(keptStart) = event;
+                }
+            }
+            scanStart = j;
+            span.numEvents -= numDroppedInSpan;
+            // Wakeup events are never sheddable so the span keeps its wakeup count.
+            if (!decimate && j == spanStart) {
+                span.numSheddableEvents = 0;
+            } else {
+                span.numSheddableEvents -= std::min(span.numSheddableEvents, numDroppedInSpan);
+            }
+        }
+        spanEnd = spanStart;
+    }
+    if (numDropped == 0) {
+        return 0;
+    }
+
+    for (size_t j = keptStart; j < mSize; j++) {
+        at(scanStart + j - keptStart) = at(j);
+    }
+    mSize -= numDropped;
+    size_t numSpansKept = 0;
+    for (size_t i = 0; i < mNumSpans; i++) {
+        const Span& span = mSpans[(mSpanHead + i) % kMaxNumSpans];
+        if (span.numEvents > 0) {
+            mSpans[(mSpanHead + numSpansKept) % kMaxNumSpans] = span;
+            numSpansKept++;
+        }
+    }
+    mNumSpans = numSpansKept;
+    if (mSize == 0) {
+        mHead = 0;
+        mSpanHead = 0;
+    }
+    maybeReleaseStorage();
+    return numDropped;
+}
+
+void PendingWriteEventsQueue::clear() {
+    mHead = 0;
+    mSize = 0;
+    mSpanHead = 0;
+    mNumSpans = 0;
+    mEvents.reset();
+    mStorageSize = 0;
+    mRetiredEvents.clear();
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
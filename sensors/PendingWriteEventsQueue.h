@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "SensorRegistry.h"
+
+#include <android/hardware/sensors/2.1/types.h>
+
+#include <array>
+#include <memory>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * Bounded FIFO of events waiting to be written to the event FMQ by the pending writes thread.
+ *
+ * Events are stored contiguously in a ring so that posting and draining never shift them. Each
+ * post is recorded as a span together with the number of wakeup events it carries, which is what
+ * the wakelock accounting needs when a span is dropped, and the number of sheddable events it
+ * carries, so that shedding skips the spans it can't drop anything from. The ring is allocated the
+ * first time events are pushed and doubles as needed up to the capacity of the queue. Once the
+ * queue drains, a ring grown past kMaxRetainedStorageSize is freed, so that a burst doesn't pin
+ * its memory.
+ *
+ * The queue is not thread safe, callers are expected to hold the event queue write mutex.
+ * Events returned by front() stay valid across a concurrent push() until the next pop(), since
+ * pushes only ever append behind them and a ring outgrown meanwhile is kept until then.
+ */
+class PendingWriteEventsQueue {
+  public:
+    using Event = ::android::hardware::sensors::V2_1::Event;
+
+    //! A run of events that were posted together.
+    struct Span {
+        size_t numEvents;
+        size_t numWakeupEvents;
+        //! At least the number of sheddable events of the span, 0 only if there are none.
+        size_t numSheddableEvents;
+        //! When the events were posted by the subhal.
+        int64_t postTimeNs;
+        //! When the events were pushed to the queue.
+        int64_t enqueueTimeNs;
+    };
+
+    explicit PendingWriteEventsQueue(size_t capacity) : mCapacity(capacity) {}
+
+    /**
+     * Append events to the back of the queue.
+     *
+     * @param events The events to copy in.
+     * @param numEvents The number of events to copy.
+     * @param numWakeupEvents The number of wakeup events in events.
+     * @param numSheddableEvents The number of sheddable events in events.
+     * @param postTimeNs When the events were posted by the subhal.
+     * @param enqueueTimeNs The current time.
+     *
+     * @return false if the events do not fit, in which case nothing is queued.
+     */
+    bool push(const Event* events, size_t numEvents, size_t numWakeupEvents,
+              size_t numSheddableEvents, int64_t postTimeNs, int64_t enqueueTimeNs);
+
+    /**
+     * Get the span at the front of the queue. Must not be called on an empty queue.
+     *
+     * @param events Set to the first event of the span.
+     * @param numContiguous Set to the number of events of the span that can be read from events
+     *    before the ring wraps around.
+     *
+     * @return The front span.
+     */
+    const Span& front(const Event** events, size_t* numContiguous) const;
+
+    /**
+     * Remove events from the front span.
+     *
+     * @param numEvents The number of events to remove, at most the size of the front span.
+     * @param numWakeupEvents The number of wakeup events among the removed ones.
+     */
+    void pop(size_t numEvents, size_t numWakeupEvents);
+
+    /**
+     * Drop sheddable events, newest first, in a single pass. The other events are kept in order
+     * and the spans are shrunk accordingly. The events behind the oldest dropped one are moved, so
+     * the work is bounded by the number of events looked at.
+     *
+     * @param numPinned The number of events at the front that must not move, because they are
+     *    being written to the event FMQ.
+     * @param numToDrop Stop once that many events were dropped.
+     * @param maxNumScanned The most events to look at, from the back of the queue.
+     * @param decimate true to keep every other sheddable event of each sensor, false to drop all
+     *    of them.
+     * @param registry The registry telling which events are sheddable, which also counts the
+     *    dropped events of each sensor.
+     *
+     * @return The number of events dropped.
+     */
+    size_t shed(size_t numPinned, size_t numToDrop, size_t maxNumScanned, bool decimate,
+                const SensorRegistry& registry);
+
+    //! Drop every queued event and free the storage.
+    void clear();
+
+    bool empty() const { return mSize == 0; }
+
+    size_t size() const { return mSize; }
+
+    size_t capacity() const { return mCapacity; }
+
+    size_t availableToPush() const { return mCapacity - mSize; }
+
+  private:
+    /**
+     * The max number of spans tracked separately, later posts get merged into the last span which
+     * keeps the times of its first post.
+     */
+    static constexpr size_t kMaxNumSpans = 256;
+
+    //! The size of the ring when first allocated.
+    static constexpr size_t kMinStorageSize = 256;
+
+    //! The largest ring kept once the queue drains.
+    static constexpr size_t kMaxRetainedStorageSize = 1024;
+
+    //! Grow the ring to hold at least numEvents, keeping the queued events in order.
+    void reserve(size_t numEvents);
+
+    //! Forget the ring if the queue is empty and the ring is larger than worth keeping.
+    void maybeReleaseStorage();
+
+    const size_t mCapacity;
+
+    std::unique_ptr<Event[]> mEvents;
+    size_t mStorageSize = 0;
+
+    //! Rings outgrown while the pending writes thread may still read from them, freed by pop().
+    std::vector<std::unique_ptr<Event[]>> mRetiredEvents;
+
+    Event& at(size_t index) { return mEvents[(mHead + index) % mStorageSize]; }
+
+    //! Index of the first queued event and the number of queued events.
+    size_t mHead = 0;
+    size_t mSize = 0;
+
+    std::array<Span, kMaxNumSpans> mSpans;
+
+    //! Index of the front span and the number of spans in use.
+    size_t mSpanHead = 0;
+    size_t mNumSpans = 0;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SensorPatches.h"
+
+#include <log/log.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+namespace {
+
+/**
+ * Split a line in whitespace separated tokens, honoring double quotes and stopping at a '#'.
+ *
+ * @return false if a quote isn't closed.
+ */
+bool tokenize(const std::string& line, std::vector<std::string>* tokens) {
+    size_t i = 0;
+    while (i < line.size()) {
+        if (isspace(static_cast<unsigned char>(line[i]))) {
+            i++;
+        } else if (line[i] == '#') {
+            break;
+        } else if (line[i] == '"') {
+            size_t end = line.find('"', i + 1);
+            if (end == std::string::npos) return false;
+            tokens->push_back(line.substr(i + 1, end - i - 1));
+            i = end + 1;
+        } else {
+            size_t end = i;
+            while (end < line.size() && !isspace(static_cast<unsigned char>(line[end]))) {
+                end++;
+            }
+            tokens->push_back(line.substr(i, end - i));
+            i = end;
+        }
+    }
+    return true;
+}
+
+bool parseInt(const std::string& token, int64_t* value) {
+    char* end;
+    errno = 0;
+    *value = strtoll(token.c_str(), &end, 0);
+    return errno == 0 && !token.empty() && *end == '\0';
+}
+
+bool parseFloat(const std::string& token, float* value) {
+    char* end;
+    errno = 0;
+    *value = strtof(token.c_str(), &end);
+    return errno == 0 && !token.empty() && *end == '\0';
+}
+
+bool parseBool(const std::string& token, bool* value) {
+    if (token == "true") {
+        *value = true;
+    } else if (token == "false") {
+        *value = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseFilterIndex(const std::string& token, uint8_t* index) {
+    if (token == "scalar") {
+        *index = 0;
+        return true;
+    }
+    int64_t value;
+    if (token.size() < 7 || token.compare(0, 5, "data[") != 0 || token.back() != ']' ||
+        !parseInt(token.substr(5, token.size() - 6), &value) || value < 0 || value >= 16) {
+        return false;
+    }
+    *index = static_cast<uint8_t>(value);
+    return true;
+}
+
+bool parseFilterOp(const std::string& token, EventFilter::Op* op) {
+    static const std::pair<const char*, EventFilter::Op> kOps[] = {
+            {"eq", EventFilter::kEq}, {"ne", EventFilter::kNe}, {"lt", EventFilter::kLt},
+            {"le", EventFilter::kLe}, {"gt", EventFilter::kGt}, {"ge", EventFilter::kGe},
+    };
+    for (const auto& entry : kOps) {
+        if (token == entry.first) {
+            *op = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+bool SensorPatches::load(const std::string& path) {
+    std::ifstream stream(path);
+    if (!stream) {
+        mRules.clear();
+        return false;
+    }
+    parse(stream, path);
+    return true;
+}
+
+void SensorPatches::parse(std::istream& stream, const std::string& source) {
+    mRules.clear();
+    std::string line;
+    for (size_t lineNumber = 1; std::getline(stream, line); lineNumber++) {
+        std::vector<std::string> tokens;
+        if (!tokenize(line, &tokens)) {
+            ALOGE("%s:%zu: unterminated quote, skipping rule", source.c_str(), lineNumber);
+            continue;
+        }
+        if (tokens.empty()) continue;
+
+        Rule rule;
+        std::string error;
+        if (!parseRule(tokens, &rule, &error)) {
+            ALOGE("%s:%zu: %s, skipping rule", source.c_str(), lineNumber, error.c_str());
+            continue;
+        }
+        mRules.push_back(std::move(rule));
+    }
+}
+
+bool SensorPatches::parseRule(const std::vector<std::string>& tokens, Rule* rule,
+                              std::string* error) {
+    bool hasMatcher = false;
+    bool hasAction = false;
+    size_t i = 0;
+    size_t keywordIndex = 0;
+    // Returns the next argument of the keyword at i, or nullptr if the line ended.
+    auto nextArg = [&]() -> const std::string* {
+        return i + 1 < tokens.size() ? &tokens[++i] : nullptr;
+    };
+
+    for (; i < tokens.size(); i++) {
+        keywordIndex = i;
+        const std::string& keyword = tokens[i];
+        const std::string* arg = nullptr;
+        bool isMatcher = keyword == "name" || keyword == "type_string" || keyword == "type" ||
+                         keyword == "wakeup";
+        if (isMatcher && hasAction) {
+            *error = "matcher '" + keyword + "' after an action";
+            return false;
+        }
+
+        if (keyword == "name" || keyword == "type_string") {
+            if ((arg = nextArg()) == nullptr) break;
+            (keyword == "name" ? rule->name : rule->typeString) = *arg;
+        } else if (keyword == "type") {
+            int64_t type;
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseInt(*arg, &type)) {
+                *error = "bad type '" + *arg + "'";
+                return false;
+            }
+            rule->type = static_cast<int32_t>(type);
+        } else if (keyword == "wakeup") {
+            bool wakeUp;
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseBool(*arg, &wakeUp)) {
+                *error = "bad boolean '" + *arg + "'";
+                return false;
+            }
+            rule->wakeUp = wakeUp;
+        } else if (keyword == "remove") {
+            rule->remove = true;
+        } else if (keyword == "set_type") {
+            int64_t type;
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseInt(*arg, &type)) {
+                *error = "bad type '" + *arg + "'";
+                return false;
+            }
+            if ((arg = nextArg()) == nullptr) break;
+            rule->newType = static_cast<int32_t>(type);
+            rule->newTypeString = *arg;
+        } else if (keyword == "set_max_range") {
+            float maxRange;
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseFloat(*arg, &maxRange)) {
+                *error = "bad max range '" + *arg + "'";
+                return false;
+            }
+            rule->maxRange = maxRange;
+        } else if (keyword == "set_flags" || keyword == "clear_flags") {
+            int64_t mask;
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseInt(*arg, &mask) || mask < 0 || mask > UINT32_MAX) {
+                *error = "bad flags mask '" + *arg + "'";
+                return false;
+            }
+            (keyword == "set_flags" ? rule->setFlags : rule->clearFlags) |=
+                    static_cast<uint32_t>(mask);
+        } else if (keyword == "filter") {
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseFilterIndex(*arg, &rule->filter.index)) {
+                *error = "bad filter value '" + *arg + "'";
+                return false;
+            }
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseFilterOp(*arg, &rule->filter.op)) {
+                *error = "bad filter op '" + *arg + "'";
+                return false;
+            }
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseFloat(*arg, &rule->filter.operand)) {
+                *error = "bad filter operand '" + *arg + "'";
+                return false;
+            }
+        } else if (keyword == "dedup") {
+            int64_t keepaliveMs;
+            if ((arg = nextArg()) == nullptr) break;
+            if (!parseInt(*arg, &keepaliveMs) || keepaliveMs < 0 ||
+                keepaliveMs > INT64_MAX / 1000000) {
+                *error = "bad dedup keepalive '" + *arg + "'";
+                return false;
+            }
+            rule->dedupKeepaliveNs = keepaliveMs * 1000000;
+        } else if (keyword == "software_batch") {
+            rule->softwareBatch = true;
+        } else {
+            *error = "unknown keyword '" + keyword + "'";
+            return false;
+        }
+        hasMatcher |= isMatcher;
+        hasAction |= !isMatcher;
+    }
+
+    if (i < tokens.size()) {
+        *error = "missing argument of '" + tokens[keywordIndex] + "'";
+        return false;
+    }
+    if (!hasMatcher || !hasAction) {
+        *error = "a rule needs at least a matcher and an action";
+        return false;
+    }
+    return true;
+}
+
+bool SensorPatches::Rule::matches(const SensorInfo& sensor) const {
+    return (!name || sensor.name == *name) &&
+           (!typeString || sensor.typeAsString == *typeString) &&
+           (!type || static_cast<int32_t>(sensor.type) == *type) &&
+           (!wakeUp || ((sensor.flags & V1_0::SensorFlagBits::WAKE_UP) != 0) == *wakeUp);
+}
+
+bool SensorPatches::apply(SensorInfo* sensor, EventFilter* filter, int64_t* dedupKeepaliveNs,
+                          bool* softwareBatch) const {
+    *filter = {};
+    *dedupKeepaliveNs = -1;
+    *softwareBatch = false;
+    if (mRules.empty()) return true;
+
+    const SensorInfo original = *sensor;
+    bool keep = true;
+    for (const Rule& rule : mRules) {
+        if (!rule.matches(original)) continue;
+        if (rule.remove) {
+            keep = false;
+        }
+        if (rule.newType) {
+            sensor->type = static_cast<V2_1::SensorType>(*rule.newType);
+            sensor->typeAsString = rule.newTypeString;
+        }
+        if (rule.maxRange) {
+            sensor->maxRange = *rule.maxRange;
+        }
+        sensor->flags = (sensor->flags | rule.setFlags) & ~rule.clearFlags;
+        if (rule.filter.op != EventFilter::kNone) {
+            *filter = rule.filter;
+        }
+        if (rule.dedupKeepaliveNs) {
+            *dedupKeepaliveNs = *rule.dedupKeepaliveNs;
+        }
+        *softwareBatch |= rule.softwareBatch;
+    }
+    return keep;
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
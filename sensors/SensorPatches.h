@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/sensors/2.1/types.h>
+
+#include <istream>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * A predicate on one value of the events of a sensor. Events that don't satisfy it are dropped
+ * before reaching the framework. Meta data events, such as flush completes, always pass.
+ */
+struct EventFilter {
+    enum Op : uint8_t {
+        kNone,
+        kEq,
+        kNe,
+        kLt,
+        kLe,
+        kGt,
+        kGe,
+    };
+
+    Op op = kNone;
+    //! The index of the value in the event data, 0 being the scalar.
+    uint8_t index = 0;
+    float operand = 0;
+
+    bool accepts(const V2_1::Event& event) const {
+        if (event.sensorType == V2_1::SensorType::META_DATA) return true;
+        float value = event.u.data[index];
+        switch (op) {
+            case kNone:
+                return true;
+            case kEq:
+                return value == operand;
+            case kNe:
+                return value != operand;
+            case kLt:
+                return value < operand;
+            case kLe:
+                return value <= operand;
+            case kGt:
+                return value > operand;
+            case kGe:
+                return value >= operand;
+        }
+        return true;
+    }
+};
+
+/**
+ * Rules patching the sensors reported by the subhals, read from a vendor config file so that quirky
+ * sensors can be fixed up without rebuilding the HAL.
+ *
+ * Each line of the file is a rule made of matchers followed by actions, and '#' starts a comment.
+ * Values containing spaces are double quoted. A sensor matches a rule if it matches all of its
+ * matchers, every matching rule is applied in file order and matchers see the sensor as the subhal
+ * reported it.
+ *
+ * Matchers:
+ *   name <string>            The sensor name.
+ *   type_string <string>     The sensor type string.
+ *   type <int>               The sensor type.
+ *   wakeup <true|false>      Whether the sensor is a wake-up sensor.
+ *
+ * Actions:
+ *   remove                   Hide the sensor from the framework.
+ *   set_type <int> <string>  Change the type and type string.
+ *   set_max_range <float>    Change the max range.
+ *   set_flags <mask>         Set flags bits.
+ *   clear_flags <mask>       Clear flags bits.
+ *   filter <value> <op> <float>
+ *                            Only forward the events whose value satisfies the predicate. The
+ *                            value is "scalar" or "data[<0-15>]", op one of eq ne lt le gt ge.
+ *   dedup <int>              Drop the events of an on-change sensor that repeat the data of the
+ *                            last forwarded one, unless that was at least the given number of ms
+ *                            ago, or ever if 0. Ignored for other reporting modes.
+ *   software_batch           Batch the events of a non wake-up continuous or on-change sensor
+ *                            without a hardware FIFO in the proxy, which then reports a FIFO
+ *                            of SoftwareBatcher::kFifoSize events for it. Ignored for other
+ *                            sensors.
+ */
+class SensorPatches {
+  public:
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+
+    /**
+     * Replace the rules with the ones from a file. Malformed rules are logged and skipped.
+     *
+     * @param path The path of the file.
+     *
+     * @return false if the file couldn't be opened, in which case there are no rules.
+     */
+    bool load(const std::string& path);
+
+    /**
+     * Replace the rules with the ones read from a stream.
+     *
+     * @param stream The stream to read.
+     * @param source The name of the stream, for logging.
+     */
+    void parse(std::istream& stream, const std::string& source);
+
+    /**
+     * Apply the matching rules to a sensor.
+     *
+     * @param sensor The sensor to patch.
+     * @param filter Set to the event filter of the sensor.
+     * @param dedupKeepaliveNs Set to the keepalive of the deduplication of the events of the
+     *    sensor, negative if they aren't deduplicated.
+     * @param softwareBatch Set to whether the events of the sensor are to be batched by the
+     *    proxy.
+     *
+     * @return false if the sensor must be removed.
+     */
+    bool apply(SensorInfo* sensor, EventFilter* filter, int64_t* dedupKeepaliveNs,
+               bool* softwareBatch) const;
+
+    size_t size() const { return mRules.size(); }
+
+  private:
+    struct Rule {
+        std::optional<std::string> name;
+        std::optional<std::string> typeString;
+        std::optional<int32_t> type;
+        std::optional<bool> wakeUp;
+
+        bool remove = false;
+        std::optional<int32_t> newType;
+        std::string newTypeString;
+        std::optional<float> maxRange;
+        uint32_t setFlags = 0;
+        uint32_t clearFlags = 0;
+        EventFilter filter;
+        std::optional<int64_t> dedupKeepaliveNs;
+        bool softwareBatch = false;
+
+        bool matches(const SensorInfo& sensor) const;
+    };
+
+    /**
+     * Parse the tokens of a line into a rule.
+     *
+     * @return false if the line is malformed, with error set to why.
+     */
+    static bool parseRule(const std::vector<std::string>& tokens, Rule* rule, std::string* error);
+
+    std::vector<Rule> mRules;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SensorRegistry.h"
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+void SensorRegistry::add(const SensorInfo& sensor, const EventFilter& filter,
+                         int64_t dedupKeepaliveNs) {
+    std::lock_guard<std::mutex> lock(mWriteMutex);
+    Entry* entry = findOrCreate(sensor.sensorHandle);
+
+    // Readers may hold on to the previous copy, so a changed sensor gets a new one. Sensors
+    // reconnecting unchanged, as dynamic sensors usually do, keep theirs.
+    const SensorInfo* info = entry->info.load(std::memory_order_relaxed);
+    if (info == nullptr || !(*info == sensor)) {
+        mSensorInfos.push_back(sensor);
+        info = &mSensorInfos.back();
+    }
+
+    if (entry->latency.load(std::memory_order_relaxed) == nullptr) {
+        mLatencyStats.emplace_back();
+        entry->latency.store(&mLatencyStats.back(), std::memory_order_release);
+    }
+
+    uint8_t flags = computeFlags(sensor);
+    if (filter.op != EventFilter::kNone) {
+        flags |= kFlagFilterEvents;
+    }
+    bool onChange = (sensor.flags & V1_0::SensorFlagBits::MASK_REPORTING_MODE) ==
+                    static_cast<uint32_t>(V1_0::SensorFlagBits::ON_CHANGE_MODE);
+    if (dedupKeepaliveNs >= 0 && onChange) {
+        EventDeduplicator* deduplicator = entry->deduplicator.load(std::memory_order_relaxed);
+        if (deduplicator == nullptr) {
+            mDeduplicators.emplace_back();
+            deduplicator = &mDeduplicators.back();
+            entry->deduplicator.store(deduplicator, std::memory_order_release);
+        }
+        deduplicator->setKeepalive(dedupKeepaliveNs);
+        deduplicator->reset();
+        flags |= kFlagDeduplicate;
+    }
+    entry->type.store(sensor.type, std::memory_order_relaxed);
+    entry->info.store(info, std::memory_order_release);
+    entry->filter.store(filter, std::memory_order_relaxed);
+    entry->flags.store(flags, std::memory_order_release);
+}
+
+void SensorRegistry::remove(int32_t sensorHandle) {
+    std::lock_guard<std::mutex> lock(mWriteMutex);
+    const Entry* entry = find(sensorHandle);
+    if (entry != nullptr) {
+        const_cast<Entry*>(entry)->flags.store(0, std::memory_order_release);
+        const_cast<Entry*>(entry)->active.store(false, std::memory_order_relaxed);
+    }
+}
+
+void SensorRegistry::setFlag(int32_t sensorHandle, uint8_t flag, bool set) {
+    std::lock_guard<std::mutex> lock(mWriteMutex);
+    Entry* entry = const_cast<Entry*>(find(sensorHandle));
+    if (entry == nullptr || (entry->flags.load(std::memory_order_relaxed) & kFlagValid) == 0) {
+        return;
+    }
+    if (set) {
+        entry->flags.fetch_or(flag, std::memory_order_release);
+    } else {
+        entry->flags.fetch_and(static_cast<uint8_t>(~flag), std::memory_order_release);
+    }
+}
+
+void SensorRegistry::setActive(int32_t sensorHandle, bool active) {
+    std::lock_guard<std::mutex> lock(mWriteMutex);
+    Entry* entry = const_cast<Entry*>(find(sensorHandle));
+    if (entry == nullptr || (entry->flags.load(std::memory_order_relaxed) & kFlagValid) == 0) {
+        return;
+    }
+    entry->active.store(active, std::memory_order_relaxed);
+    EventDeduplicator* deduplicator = entry->deduplicator.load(std::memory_order_relaxed);
+    if (active && deduplicator != nullptr) {
+        deduplicator->reset();
+    }
+}
+
+void SensorRegistry::setBatchParams(int32_t sensorHandle, int64_t samplingPeriodNs,
+                                    int64_t maxReportLatencyNs) {
+    std::lock_guard<std::mutex> lock(mWriteMutex);
+    Entry* entry = const_cast<Entry*>(find(sensorHandle));
+    if (entry == nullptr || (entry->flags.load(std::memory_order_relaxed) & kFlagValid) == 0) {
+        return;
+    }
+    entry->samplingPeriodNs.store(samplingPeriodNs, std::memory_order_relaxed);
+    entry->maxReportLatencyNs.store(maxReportLatencyNs, std::memory_order_relaxed);
+}
+
+const SensorRegistry::SensorInfo& SensorRegistry::getSensorInfo(int32_t sensorHandle) const {
+    static const SensorInfo kUnknownSensor = {};
+    const Entry* entry = find(sensorHandle);
+    if (entry == nullptr || (entry->flags.load(std::memory_order_acquire) & kFlagValid) == 0) {
+        return kUnknownSensor;
+    }
+    return *entry->info.load(std::memory_order_acquire);
+}
+
+uint8_t SensorRegistry::computeFlags(const SensorInfo& sensor) {
+    uint8_t flags = kFlagValid;
+    if ((sensor.flags & V1_0::SensorFlagBits::WAKE_UP) != 0) {
+        flags |= kFlagWakeUp;
+    }
+    if ((sensor.flags & V1_0::SensorFlagBits::WAKE_UP) == 0 &&
+        (sensor.flags & V1_0::SensorFlagBits::MASK_REPORTING_MODE) ==
+                static_cast<uint32_t>(V1_0::SensorFlagBits::CONTINUOUS_MODE)) {
+        flags |= kFlagSheddable;
+    }
+    return flags;
+}
+
+SensorRegistry::Entry* SensorRegistry::findOrCreate(int32_t sensorHandle) {
+    std::atomic<SubHalTable*>& tableSlot = mTables[byteAt(sensorHandle, 24)];
+    SubHalTable* table = tableSlot.load(std::memory_order_relaxed);
+    if (table == nullptr) {
+        mOwnedTables.push_back(std::make_unique<SubHalTable>());
+        table = mOwnedTables.back().get();
+        tableSlot.store(table, std::memory_order_release);
+    }
+
+    std::atomic<Node*>& nodeSlot = table->nodes[byteAt(sensorHandle, 16)];
+    Node* node = nodeSlot.load(std::memory_order_relaxed);
+    if (node == nullptr) {
+        mOwnedNodes.push_back(std::make_unique<Node>());
+        node = mOwnedNodes.back().get();
+        nodeSlot.store(node, std::memory_order_release);
+    }
+
+    std::atomic<Leaf*>& leafSlot = node->leaves[byteAt(sensorHandle, 8)];
+    Leaf* leaf = leafSlot.load(std::memory_order_relaxed);
+    if (leaf == nullptr) {
+        mOwnedLeaves.push_back(std::make_unique<Leaf>());
+        leaf = mOwnedLeaves.back().get();
+        leafSlot.store(leaf, std::memory_order_release);
+    }
+
+    return &leaf->entries[byteAt(sensorHandle, 0)];
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "EventDeduplicator.h"
+#include "LatencyHistogram.h"
+#include "SensorPatches.h"
+
+#include <android/hardware/sensors/2.1/types.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * Handle indexed table of every sensor, static and dynamic, known to the HalProxy.
+ *
+ * The event path only needs a couple of bits per sensor, so each handle maps to a small hot entry
+ * while the full SensorInfo sits in cold storage. The subhal index byte of the handle selects a
+ * per subhal table in which the 24 bit local handle is split in three bytes, the last one
+ * indexing a dense leaf of 256 entries. Lookups are a fixed number of loads, never insert and
+ * don't take a lock, so they can run concurrently with dynamic sensors being connected or
+ * disconnected. Writers are serialized internally.
+ *
+ * Tables and cold SensorInfos are only freed with the registry, and a published SensorInfo is
+ * never written to again: adding a handle with a different sensor publishes a new copy. So
+ * references returned by getSensorInfo stay valid and unchanged.
+ */
+class SensorRegistry {
+  public:
+    using Event = ::android::hardware::sensors::V2_1::Event;
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+
+    //! Flags of the hot entry of a sensor.
+    enum : uint8_t {
+        //! The handle belongs to a sensor that is currently registered.
+        kFlagValid = 1 << 0,
+        //! Events from this sensor hold the shared wakelock.
+        kFlagWakeUp = 1 << 1,
+        //! Only events accepted by the event filter of the sensor are forwarded to the framework.
+        kFlagFilterEvents = 1 << 2,
+        //! Continuous non wake-up sensor, whose events may be decimated when the proxy is
+        //! overloaded.
+        kFlagSheddable = 1 << 3,
+        //! Events from this sensor are held in its software batch. Set while the sensor is
+        //! batched, never by computeFlags.
+        kFlagSoftwareBatched = 1 << 4,
+        //! Events from this sensor are copied to the direct channels the proxy writes to. Set
+        //! while the proxy emulates a direct report of the sensor.
+        kFlagDirectReport = 1 << 5,
+        //! Events from this sensor are only reported through direct channels, the framework
+        //! didn't enable it.
+        kFlagDirectReportOnly = 1 << 6,
+        //! Repeated events of this on-change sensor are suppressed by its deduplicator.
+        kFlagDeduplicate = 1 << 7,
+    };
+
+    SensorRegistry() = default;
+    SensorRegistry(const SensorRegistry&) = delete;
+    SensorRegistry& operator=(const SensorRegistry&) = delete;
+
+    /**
+     * Add a sensor or update the one registered with the same handle.
+     *
+     * @param sensor The sensor, with the subhal index already set in its handle.
+     * @param filter The filter of the events of the sensor.
+     * @param dedupKeepaliveNs The keepalive of the deduplicator of the sensor, negative to forward
+     *    repeated events. Ignored unless the sensor is on-change.
+     */
+    void add(const SensorInfo& sensor, const EventFilter& filter = {},
+             int64_t dedupKeepaliveNs = -1);
+
+    /**
+     * Remove a sensor. Unknown handles are ignored.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     */
+    void remove(int32_t sensorHandle);
+
+    /**
+     * Set or clear one of the flags that change while a sensor is registered, such as
+     * kFlagSoftwareBatched. Unknown handles are ignored.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     * @param flag The flag.
+     * @param set Whether to set or clear the flag.
+     */
+    void setFlag(int32_t sensorHandle, uint8_t flag, bool set);
+
+    /**
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     *
+     * @return The flags of the sensor, 0 if the handle isn't registered.
+     */
+    uint8_t getFlags(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? 0 : entry->flags.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     *
+     * @return The event filter of the sensor, only meaningful if it has kFlagFilterEvents.
+     */
+    EventFilter getEventFilter(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? EventFilter{} : entry->filter.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     *
+     * @return The deduplicator of the sensor, only meaningful if it has kFlagDeduplicate.
+     */
+    EventDeduplicator* getDeduplicator(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? nullptr : entry->deduplicator.load(std::memory_order_acquire);
+    }
+
+    bool isWakeUpSensor(int32_t sensorHandle) const {
+        return (getFlags(sensorHandle) & kFlagWakeUp) != 0;
+    }
+
+    /**
+     * @param event An event of a registered sensor.
+     *
+     * @return true if the event may be dropped when the proxy is overloaded. Flush complete and
+     *    additional info events never are.
+     */
+    bool isSheddable(const Event& event) const {
+        return event.sensorType != V2_1::SensorType::META_DATA &&
+               event.sensorType != V2_1::SensorType::ADDITIONAL_INFO &&
+               (getFlags(event.sensorHandle) & kFlagSheddable) != 0;
+    }
+
+    /**
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     *
+     * @return The type of the sensor, META_DATA if the handle isn't registered.
+     */
+    V2_1::SensorType getType(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? V2_1::SensorType::META_DATA
+                                : entry->type.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     *
+     * @return The sensor info, or an empty one if the handle isn't registered.
+     */
+    const SensorInfo& getSensorInfo(int32_t sensorHandle) const;
+
+    /**
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     *
+     * @return The latency stats of the sensor, or nullptr if the handle was never registered.
+     *    Stats outlive the removal of their sensor and are kept when it is added again.
+     */
+    SensorLatencyStats* getLatencyStats(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? nullptr : entry->latency.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Count events of a sensor that were dropped because the proxy was overloaded. Unknown handles
+     * are ignored.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     * @param numEvents The number of events dropped.
+     */
+    void countShedEvents(int32_t sensorHandle, uint64_t numEvents) const {
+        const Entry* entry = find(sensorHandle);
+        if (entry != nullptr) {
+            entry->numShedEvents.fetch_add(numEvents, std::memory_order_relaxed);
+        }
+    }
+
+    //! @return The number of events of the sensor that were dropped, kept across re-adds.
+    uint64_t getNumShedEvents(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? 0 : entry->numShedEvents.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Count events of a sensor that the proxy accepted from its subhal. Unknown handles are
+     * ignored.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     * @param numEvents The number of events accepted.
+     */
+    void countEvents(int32_t sensorHandle, uint64_t numEvents) const {
+        const Entry* entry = find(sensorHandle);
+        if (entry != nullptr) {
+            entry->numEvents.fetch_add(numEvents, std::memory_order_relaxed);
+        }
+    }
+
+    //! @return The number of events of the sensor that were accepted, kept across re-adds.
+    uint64_t getNumEvents(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? 0 : entry->numEvents.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Count events of a sensor that were lost when writing them to the event FMQ failed. Unknown
+     * handles are ignored.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     * @param numEvents The number of events lost.
+     */
+    void countDroppedEvents(int32_t sensorHandle, uint64_t numEvents) const {
+        const Entry* entry = find(sensorHandle);
+        if (entry != nullptr) {
+            entry->numDroppedEvents.fetch_add(numEvents, std::memory_order_relaxed);
+        }
+    }
+
+    //! @return The number of events of the sensor that were lost, kept across re-adds.
+    uint64_t getNumDroppedEvents(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? 0 : entry->numDroppedEvents.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Count events of a sensor that its deduplicator suppressed. Unknown handles are ignored.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     * @param numEvents The number of events suppressed.
+     */
+    void countSuppressedEvents(int32_t sensorHandle, uint64_t numEvents) const {
+        const Entry* entry = find(sensorHandle);
+        if (entry != nullptr) {
+            entry->numSuppressedEvents.fetch_add(numEvents, std::memory_order_relaxed);
+        }
+    }
+
+    //! @return The number of events of the sensor that were suppressed, kept across re-adds.
+    uint64_t getNumSuppressedEvents(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        return entry == nullptr ? 0 : entry->numSuppressedEvents.load(std::memory_order_relaxed);
+    }
+
+    //! The configuration of a sensor the framework last requested, as accepted by its subhal.
+    struct SensorConfig {
+        bool active = false;
+        int64_t samplingPeriodNs = 0;
+        int64_t maxReportLatencyNs = 0;
+    };
+
+    /**
+     * Set whether the sensor is active. Unknown handles are ignored. Activating the sensor resets
+     * its deduplicator, so that the framework gets the current value again.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     * @param active Whether the sensor is active.
+     */
+    void setActive(int32_t sensorHandle, bool active);
+
+    /**
+     * Set the batch parameters in effect for the sensor. Unknown handles are ignored.
+     *
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     * @param samplingPeriodNs The sampling period.
+     * @param maxReportLatencyNs The max report latency.
+     */
+    void setBatchParams(int32_t sensorHandle, int64_t samplingPeriodNs,
+                        int64_t maxReportLatencyNs);
+
+    /**
+     * @param sensorHandle The handle of the sensor, including the subhal index.
+     *
+     * @return The configuration of the sensor, the default one if the handle isn't registered.
+     */
+    SensorConfig getConfig(int32_t sensorHandle) const {
+        const Entry* entry = find(sensorHandle);
+        if (entry == nullptr) return {};
+        return {entry->active.load(std::memory_order_relaxed),
+                entry->samplingPeriodNs.load(std::memory_order_relaxed),
+                entry->maxReportLatencyNs.load(std::memory_order_relaxed)};
+    }
+
+    //! @return The hot entry flags that should be used for the sensor.
+    static uint8_t computeFlags(const SensorInfo& sensor);
+
+  private:
+    static constexpr size_t kFanout = 256;
+
+    struct Entry {
+        std::atomic<uint8_t> flags{0};
+        std::atomic<V2_1::SensorType> type{V2_1::SensorType::META_DATA};
+        std::atomic<EventFilter> filter{EventFilter{}};
+        std::atomic<const SensorInfo*> info{nullptr};
+        std::atomic<SensorLatencyStats*> latency{nullptr};
+        mutable std::atomic<uint64_t> numShedEvents{0};
+        mutable std::atomic<uint64_t> numEvents{0};
+        mutable std::atomic<uint64_t> numDroppedEvents{0};
+        mutable std::atomic<uint64_t> numSuppressedEvents{0};
+        std::atomic<EventDeduplicator*> deduplicator{nullptr};
+        std::atomic<bool> active{false};
+        std::atomic<int64_t> samplingPeriodNs{0};
+        std::atomic<int64_t> maxReportLatencyNs{0};
+    };
+
+    struct Leaf {
+        Entry entries[kFanout];
+    };
+
+    struct Node {
+        std::atomic<Leaf*> leaves[kFanout] = {};
+    };
+
+    struct SubHalTable {
+        std::atomic<Node*> nodes[kFanout] = {};
+    };
+
+    static size_t byteAt(int32_t sensorHandle, int shift) {
+        return (static_cast<uint32_t>(sensorHandle) >> shift) & (kFanout - 1);
+    }
+
+    const Entry* find(int32_t sensorHandle) const {
+        const SubHalTable* table =
+                mTables[byteAt(sensorHandle, 24)].load(std::memory_order_acquire);
+        if (table == nullptr) return nullptr;
+        const Node* node = table->nodes[byteAt(sensorHandle, 16)].load(std::memory_order_acquire);
+        if (node == nullptr) return nullptr;
+        const Leaf* leaf = node->leaves[byteAt(sensorHandle, 8)].load(std::memory_order_acquire);
+        if (leaf == nullptr) return nullptr;
+        return &leaf->entries[byteAt(sensorHandle, 0)];
+    }
+
+    //! Find the entry of the handle, creating the tables leading to it. Needs mWriteMutex.
+    Entry* findOrCreate(int32_t sensorHandle);
+
+    std::atomic<SubHalTable*> mTables[kFanout] = {};
+
+    //! The mutex serializing writers.
+    std::mutex mWriteMutex;
+
+    //! Owners of the tables published in mTables.
+    std::vector<std::unique_ptr<SubHalTable>> mOwnedTables;
+    std::vector<std::unique_ptr<Node>> mOwnedNodes;
+    std::vector<std::unique_ptr<Leaf>> mOwnedLeaves;
+
+    //! Cold storage of the full sensor infos, addresses are stable.
+    std::deque<SensorInfo> mSensorInfos;
+
+    //! Latency stats of the sensors, addresses are stable.
+    std::deque<SensorLatencyStats> mLatencyStats;
+
+    //! Deduplicators of the sensors that ever had one, addresses are stable.
+    std::deque<EventDeduplicator> mDeduplicators;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SoftwareBatcher.h"
+
+#include <utils/SystemClock.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+SoftwareBatcher::SoftwareBatcher(FlushCallback flushCallback, ThreadConfig threadConfig)
+    : mFlushCallback(std::move(flushCallback)), mThreadConfig(std::move(threadConfig)) {
+    mDeadlineThread = std::thread([this] {
+        mThreadConfig.apply();
+        handleDeadlines();
+    });
+}
+
+SoftwareBatcher::~SoftwareBatcher() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mThreadRun = false;
+    }
+    mDeadlineCV.notify_one();
+    mDeadlineThread.join();
+}
+
+bool SoftwareBatcher::canBatch(const SensorInfo& sensor) {
+    uint32_t reportingMode = sensor.flags & V1_0::SensorFlagBits::MASK_REPORTING_MODE;
+    return sensor.fifoMaxEventCount == 0 && (sensor.flags & V1_0::SensorFlagBits::WAKE_UP) == 0 &&
+           (reportingMode == static_cast<uint32_t>(V1_0::SensorFlagBits::CONTINUOUS_MODE) ||
+            reportingMode == static_cast<uint32_t>(V1_0::SensorFlagBits::ON_CHANGE_MODE));
+}
+
+void SoftwareBatcher::addSensor(int32_t sensorHandle) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBatches[sensorHandle];
+}
+
+bool SoftwareBatcher::hasSensor(int32_t sensorHandle) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBatches.find(sensorHandle) != mBatches.end();
+}
+
+bool SoftwareBatcher::setMaxReportLatency(int32_t sensorHandle, int64_t maxReportLatencyNs) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto iter = mBatches.find(sensorHandle);
+    if (iter == mBatches.end()) {
+        return false;
+    }
+    SensorBatch& batch = iter->second;
+    if (maxReportLatencyNs <= 0) {
+        flushLocked(batch);
+        batch.maxReportLatencyNs = 0;
+        return false;
+    }
+
+    if (batch.events.capacity() == 0) {
+        batch.events.reserve(kFifoSize);
+    }
+    batch.maxReportLatencyNs = maxReportLatencyNs;
+    if (!batch.events.empty()) {
+        int64_t deadlineNs = batch.firstPostTimeNs + maxReportLatencyNs;
+        if (deadlineNs < batch.deadlineNs) {
+            batch.deadlineNs = deadlineNs;
+            mDeadlineCV.notify_one();
+        }
+    }
+    return true;
+}
+
+void SoftwareBatcher::push(const Event* events, size_t numEvents, int64_t postTimeNs) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    bool deadlineAdded = false;
+    size_t runStart = 0;
+    while (runStart < numEvents) {
+        int32_t sensorHandle = events[runStart].sensorHandle;
+        size_t runEnd = runStart + 1;
+        while (runEnd < numEvents && events[runEnd].sensorHandle == sensorHandle) {
+            runEnd++;
+        }
+
+        auto iter = mBatches.find(sensorHandle);
+        if (iter == mBatches.end() || iter->second.maxReportLatencyNs == 0) {
+            // Batching was turned off while the events were being posted.
+            mFlushCallback(events + runStart, runEnd - runStart, postTimeNs);
+        } else {
+            SensorBatch& batch = iter->second;
+            for (size_t i = runStart; i < runEnd; i++) {
+                if (batch.events.empty()) {
+                    batch.firstPostTimeNs = postTimeNs;
+                    batch.deadlineNs = postTimeNs + batch.maxReportLatencyNs;
+                    deadlineAdded = true;
+                }
+                batch.events.push_back(events[i]);
+                batch.numEventsBatched++;
+                // A flush complete event must follow the events batched before it right away.
+                if (batch.events.size() == kFifoSize ||
+                    events[i].sensorType == V2_1::SensorType::META_DATA) {
+                    flushLocked(batch);
+                }
+            }
+        }
+        runStart = runEnd;
+    }
+    if (deadlineAdded) {
+        mDeadlineCV.notify_one();
+    }
+}
+
+void SoftwareBatcher::flush(int32_t sensorHandle) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto iter = mBatches.find(sensorHandle);
+    if (iter != mBatches.end()) {
+        flushLocked(iter->second);
+    }
+}
+
+void SoftwareBatcher::reset() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& batchEntry : mBatches) {
+        batchEntry.second.events.clear();
+        batchEntry.second.maxReportLatencyNs = 0;
+    }
+}
+
+void SoftwareBatcher::dump(std::ostream& stream) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    stream << "Software batched sensors (FIFO of " << kFifoSize << " events):" << std::endl;
+    for (const auto& batchEntry : mBatches) {
+        const SensorBatch& batch = batchEntry.second;
+        stream << "  Handle 0x" << std::hex << batchEntry.first << std::dec
+               << ": max report latency " << batch.maxReportLatencyNs / 1000000 << " ms, "
+               << batch.events.size() << " events buffered, " << batch.numEventsBatched
+               << " batched, " << batch.numFlushes << " flushes" << std::endl;
+    }
+}
+
+void SoftwareBatcher::flushLocked(SensorBatch& batch) {
+    if (batch.events.empty()) return;
+    mFlushCallback(batch.events.data(), batch.events.size(), batch.firstPostTimeNs);
+    batch.events.clear();
+    batch.numFlushes++;
+}
+
+void SoftwareBatcher::handleDeadlines() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mThreadRun) {
+        int64_t now = ::android::elapsedRealtimeNano();
+        int64_t nextDeadlineNs = std::numeric_limits<int64_t>::max();
+        for (auto& batchEntry : mBatches) {
+            SensorBatch& batch = batchEntry.second;
+            if (batch.events.empty()) continue;
+            if (batch.deadlineNs <= now) {
+                flushLocked(batch);
+            } else {
+                nextDeadlineNs = std::min(nextDeadlineNs, batch.deadlineNs);
+            }
+        }
+        // Pushes and latency changes notify while holding the mutex, so a deadline added since
+        // the scan above can't be missed.
+        if (nextDeadlineNs == std::numeric_limits<int64_t>::max()) {
+            mDeadlineCV.wait(lock);
+        } else {
+            mDeadlineCV.wait_for(lock, std::chrono::nanoseconds(nextDeadlineNs - now));
+        }
+    }
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
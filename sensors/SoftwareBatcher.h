@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/sensors/2.1/types.h>
+
+#include "ThreadConfig.h"
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * Software FIFOs for non wake-up sensors that have no hardware FIFO, for the sensors the
+ * software_batch action of the sensor patches is applied to.
+ *
+ * While a sensor is batched with a non zero max report latency, its events are held in a buffer of
+ * kFifoSize events instead of being written to the event FMQ right away. The buffer is flushed when
+ * the report latency of its oldest event expires, when it's full, or when asked to. Buffers are
+ * allocated the first time the sensor is batched.
+ *
+ * The flush callback is invoked with the batcher mutex held, so that the events of a sensor are
+ * written in order. It must not call back into the batcher.
+ */
+class SoftwareBatcher {
+  public:
+    using Event = ::android::hardware::sensors::V2_1::Event;
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+
+    /**
+     * Writes events to the event FMQ.
+     *
+     * @param events The array of events to write.
+     * @param numEvents The number of events in events.
+     * @param postTimeNs When the oldest of the events was posted.
+     */
+    using FlushCallback =
+            std::function<void(const Event* events, size_t numEvents, int64_t postTimeNs)>;
+
+    //! The number of events buffered per sensor, advertised as the max FIFO of the sensor.
+    static constexpr uint32_t kFifoSize = 256;
+
+    /**
+     * @param flushCallback Writes the flushed events.
+     * @param threadConfig The config of the thread flushing the batches whose deadline expired.
+     */
+    SoftwareBatcher(FlushCallback flushCallback, ThreadConfig threadConfig);
+    ~SoftwareBatcher();
+
+    SoftwareBatcher(const SoftwareBatcher&) = delete;
+    SoftwareBatcher& operator=(const SoftwareBatcher&) = delete;
+
+    /**
+     * @param sensor A sensor, as reported by its subhal.
+     *
+     * @return true if the events of the sensor can be batched by the proxy.
+     */
+    static bool canBatch(const SensorInfo& sensor);
+
+    //! Add a sensor for which canBatch is true.
+    void addSensor(int32_t sensorHandle);
+
+    //! @return true if the sensor was added.
+    bool hasSensor(int32_t sensorHandle);
+
+    /**
+     * Set the max report latency of a sensor. Setting it to 0 flushes the buffered events.
+     *
+     * @param sensorHandle The handle of a sensor that was added.
+     * @param maxReportLatencyNs The max report latency.
+     *
+     * @return true if the events of the sensor are to be buffered from now on.
+     */
+    bool setMaxReportLatency(int32_t sensorHandle, int64_t maxReportLatencyNs);
+
+    /**
+     * Buffer events. Events of sensors that aren't batched are written right away. A flush
+     * complete event is buffered behind the events of its sensor, which are then flushed.
+     *
+     * @param events The array of events.
+     * @param numEvents The number of events in events.
+     * @param postTimeNs When the events were posted.
+     */
+    void push(const Event* events, size_t numEvents, int64_t postTimeNs);
+
+    //! Flush the buffered events of a sensor. Unknown handles are ignored.
+    void flush(int32_t sensorHandle);
+
+    //! Drop the buffered events and reset the max report latencies of all the sensors.
+    void reset();
+
+    void dump(std::ostream& stream);
+
+    const ThreadConfig& getThreadConfig() const { return mThreadConfig; }
+
+  private:
+    struct SensorBatch {
+        int64_t maxReportLatencyNs = 0;
+        std::vector<Event> events;
+        //! When the oldest buffered event was posted, and when it must be written.
+        int64_t firstPostTimeNs = 0;
+        int64_t deadlineNs = 0;
+        uint64_t numFlushes = 0;
+        uint64_t numEventsBatched = 0;
+    };
+
+    //! Write out the buffered events of a sensor. Needs mMutex.
+    void flushLocked(SensorBatch& batch);
+
+    //! Flushes the batches whose deadline expired.
+    void handleDeadlines();
+
+    const FlushCallback mFlushCallback;
+
+    const ThreadConfig mThreadConfig;
+
+    //! The mutex protecting the batches.
+    std::mutex mMutex;
+
+    //! Signaled when a deadline may have moved earlier or when the thread must stop.
+    std::condition_variable mDeadlineCV;
+
+    std::map<int32_t, SensorBatch> mBatches;
+
+    bool mThreadRun = true;
+
+    std::thread mDeadlineThread;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SubHalCache.h"
+
+#include <android-base/properties.h>
+#include <log/log.h>
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <fstream>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x43485348;  // "HSHC"
+constexpr uint32_t kVersion = 2;
+
+//! Upper bound of the counts and string sizes read, so that a corrupt file can't exhaust memory.
+constexpr uint32_t kMaxCount = 1 << 16;
+
+class Writer {
+  public:
+    explicit Writer(std::ofstream& stream) : mStream(stream) {}
+
+    template <typename T>
+    void write(T value) {
+        mStream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void writeString(const std::string& value) {
+        write(static_cast<uint32_t>(value.size()));
+        mStream.write(value.data(), value.size());
+    }
+
+  private:
+    std::ofstream& mStream;
+};
+
+class Reader {
+  public:
+    explicit Reader(std::ifstream& stream) : mStream(stream) {}
+
+    template <typename T>
+    bool read(T* value) {
+        return static_cast<bool>(mStream.read(reinterpret_cast<char*>(value), sizeof(*value)));
+    }
+
+    bool readCount(uint32_t* count) { return read(count) && *count <= kMaxCount; }
+
+    bool readString(std::string* value) {
+        uint32_t size;
+        if (!readCount(&size)) return false;
+        value->resize(size);
+        return static_cast<bool>(mStream.read(value->data(), size));
+    }
+
+    bool readString(hidl_string* value) {
+        std::string string;
+        if (!readString(&string)) return false;
+        *value = string;
+        return true;
+    }
+
+  private:
+    std::ifstream& mStream;
+};
+
+void writeSensorInfo(Writer& writer, const V2_1::SensorInfo& sensor) {
+    writer.write(sensor.sensorHandle);
+    writer.writeString(sensor.name);
+    writer.writeString(sensor.vendor);
+    writer.write(sensor.version);
+    writer.write(static_cast<int32_t>(sensor.type));
+    writer.writeString(sensor.typeAsString);
+    writer.write(sensor.maxRange);
+    writer.write(sensor.resolution);
+    writer.write(sensor.power);
+    writer.write(sensor.minDelay);
+    writer.write(sensor.fifoReservedEventCount);
+    writer.write(sensor.fifoMaxEventCount);
+    writer.writeString(sensor.requiredPermission);
+    writer.write(sensor.maxDelay);
+    writer.write(static_cast<uint32_t>(sensor.flags));
+}
+
+bool readSensorInfo(Reader& reader, V2_1::SensorInfo* sensor) {
+    int32_t type;
+    uint32_t flags;
+    if (!reader.read(&sensor->sensorHandle) || !reader.readString(&sensor->name) ||
+        !reader.readString(&sensor->vendor) || !reader.read(&sensor->version) ||
+        !reader.read(&type) || !reader.readString(&sensor->typeAsString) ||
+        !reader.read(&sensor->maxRange) || !reader.read(&sensor->resolution) ||
+        !reader.read(&sensor->power) || !reader.read(&sensor->minDelay) ||
+        !reader.read(&sensor->fifoReservedEventCount) ||
+        !reader.read(&sensor->fifoMaxEventCount) ||
+        !reader.readString(&sensor->requiredPermission) || !reader.read(&sensor->maxDelay) ||
+        !reader.read(&flags)) {
+        return false;
+    }
+    sensor->type = static_cast<V2_1::SensorType>(type);
+    sensor->flags = flags;
+    return true;
+}
+
+}  // namespace
+
+bool SubHalCache::read(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream) {
+        return false;
+    }
+    Reader reader(stream);
+
+    uint32_t magic;
+    uint32_t version;
+    if (!reader.read(&magic) || magic != kMagic || !reader.read(&version) ||
+        version != kVersion) {
+        ALOGW("Ignoring subhal cache %s of unknown format", path.c_str());
+        return false;
+    }
+    if (!reader.readString(&buildFingerprint)) return false;
+
+    uint32_t numLibraries;
+    if (!reader.readCount(&numLibraries)) return false;
+    libraries.resize(numLibraries);
+    for (Library& library : libraries) {
+        if (!reader.readString(&library.file) || !reader.readString(&library.stamp)) return false;
+    }
+
+    uint32_t numSubHals;
+    if (!reader.readCount(&numSubHals)) return false;
+    subHals.resize(numSubHals);
+    for (SubHal& subHal : subHals) {
+        uint32_t numSensors;
+        if (!reader.readString(&subHal.libraryFile) || !reader.readString(&subHal.name) ||
+            !reader.readCount(&numSensors)) {
+            return false;
+        }
+        subHal.sensors.resize(numSensors);
+        for (SensorInfo& sensor : subHal.sensors) {
+            if (!readSensorInfo(reader, &sensor)) return false;
+        }
+    }
+    return true;
+}
+
+bool SubHalCache::write(const std::string& path) const {
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream stream(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!stream) {
+            ALOGE("Failed to open subhal cache %s for writing", tmpPath.c_str());
+            return false;
+        }
+        Writer writer(stream);
+
+        writer.write(kMagic);
+        writer.write(kVersion);
+        writer.writeString(buildFingerprint);
+        writer.write(static_cast<uint32_t>(libraries.size()));
+        for (const Library& library : libraries) {
+            writer.writeString(library.file);
+            writer.writeString(library.stamp);
+        }
+        writer.write(static_cast<uint32_t>(subHals.size()));
+        for (const SubHal& subHal : subHals) {
+            writer.writeString(subHal.libraryFile);
+            writer.writeString(subHal.name);
+            writer.write(static_cast<uint32_t>(subHal.sensors.size()));
+            for (const SensorInfo& sensor : subHal.sensors) {
+                writeSensorInfo(writer, sensor);
+            }
+        }
+
+        stream.flush();
+        if (!stream) {
+            ALOGE("Failed to write subhal cache %s", tmpPath.c_str());
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        ALOGE("Failed to rename subhal cache to %s", path.c_str());
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string SubHalCache::getLibraryStamp(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return "";
+    }
+    return std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+           std::to_string(st.st_mtim.tv_nsec);
+}
+
+std::string SubHalCache::getBuildFingerprint() {
+    std::string vendorFingerprint = android::base::GetProperty("ro.vendor.build.fingerprint", "");
+    if (vendorFingerprint.empty()) {
+        return "";
+    }
+    return vendorFingerprint + "|" + android::base::GetProperty("ro.odm.build.fingerprint", "");
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/hardware/sensors/2.1/types.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * The sensor lists of the subhals, persisted so that subhals can be loaded on demand.
+ *
+ * The sensor lists are stored as the subhals report them, before the HalProxy sets the subhal
+ * index or patches them. The cache also records every library listed in the config file with a
+ * stamp of its size and modification time, so it can be told apart from a stale one when a library
+ * is added or removed. Those stamps are fixed at build time, so they don't change when an update
+ * replaces a library or what it loads: the cache also records the fingerprints of the builds of
+ * the partitions the libraries are loaded from, and is only valid for those builds.
+ */
+struct SubHalCache {
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+
+    //! A library listed in the config file.
+    struct Library {
+        std::string file;
+        std::string stamp;
+
+        bool operator==(const Library& other) const {
+            return file == other.file && stamp == other.stamp;
+        }
+    };
+
+    //! A subhal that was loaded, in subhal index order.
+    struct SubHal {
+        std::string libraryFile;
+        std::string name;
+        std::vector<SensorInfo> sensors;
+    };
+
+    //! The fingerprints of the builds the cache was written for.
+    std::string buildFingerprint;
+    std::vector<Library> libraries;
+    std::vector<SubHal> subHals;
+
+    /**
+     * Read the cache from a file.
+     *
+     * @param path The path of the file.
+     *
+     * @return false if the file is missing, unreadable or of another format version.
+     */
+    bool read(const std::string& path);
+
+    /**
+     * Write the cache to a file, replacing it atomically.
+     *
+     * @param path The path of the file.
+     *
+     * @return false if the file couldn't be written.
+     */
+    bool write(const std::string& path) const;
+
+    /**
+     * @param path The path of a library.
+     *
+     * @return The stamp of the library, empty if it doesn't exist.
+     */
+    static std::string getLibraryStamp(const std::string& path);
+
+    /**
+     * @return The fingerprints of the vendor and odm builds, empty if the vendor one is unknown.
+     */
+    static std::string getBuildFingerprint();
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
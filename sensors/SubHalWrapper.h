@@ -0,0 +1,449 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "HalProxyCallback.h"
+#include "V2_0/SubHal.h"
+#include "V2_1/SubHal.h"
+#include "convertV2_1.h"
+
+#include "android/hardware/sensors/1.0/ISensors.h"
+#include "android/hardware/sensors/1.0/types.h"
+#include "android/hardware/sensors/2.0/ISensors.h"
+#include "android/hardware/sensors/2.0/ISensorsCallback.h"
+#include "android/hardware/sensors/2.1/ISensors.h"
+#include "android/hardware/sensors/2.1/ISensorsCallback.h"
+#include "android/hardware/sensors/2.1/types.h"
+
+#include <android-base/file.h>
+#include <utils/LightRefBase.h>
+
+#include <cassert>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * The following subHal wrapper classes abstract away common functionality across V2.0 and V2.1
+ * subHal interfaces. Much of the logic is common between the two versions and this allows users of
+ * the classes to only care about the type used at initialization and then interact with either
+ * version of the subHal interface without worrying about the type.
+ */
+class ISubHalWrapperBase {
+  protected:
+    using Event = ::android::hardware::sensors::V2_1::Event;
+    using OperationMode = ::android::hardware::sensors::V1_0::OperationMode;
+    using RateLevel = ::android::hardware::sensors::V1_0::RateLevel;
+    using Result = ::android::hardware::sensors::V1_0::Result;
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+    using SharedMemInfo = ::android::hardware::sensors::V1_0::SharedMemInfo;
+
+  public:
+    virtual ~ISubHalWrapperBase() {}
+
+    virtual bool supportsNewEvents() = 0;
+
+    virtual Return<Result> initialize(V2_0::implementation::ISubHalCallback* callback,
+                                      V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                                      int32_t subHalIndex) = 0;
+
+    virtual Return<void> getSensorsList(
+            ::android::hardware::sensors::V2_1::ISensors::getSensorsList_2_1_cb _hidl_cb) = 0;
+
+    virtual Return<Result> setOperationMode(OperationMode mode) = 0;
+
+    virtual Return<Result> activate(int32_t sensorHandle, bool enabled) = 0;
+
+    virtual Return<Result> batch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                                 int64_t maxReportLatencyNs) = 0;
+
+    virtual Return<Result> flush(int32_t sensorHandle) = 0;
+
+    virtual Return<Result> injectSensorData(const Event& event) = 0;
+
+    virtual Return<void> registerDirectChannel(const SharedMemInfo& mem,
+                                               ISensors::registerDirectChannel_cb _hidl_cb) = 0;
+
+    virtual Return<Result> unregisterDirectChannel(int32_t channelHandle) = 0;
+
+    virtual Return<void> configDirectReport(int32_t sensorHandle, int32_t channelHandle,
+                                            RateLevel rate,
+                                            ISensors::configDirectReport_cb _hidl_cb) = 0;
+
+    virtual Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) = 0;
+
+    virtual const std::string getName() = 0;
+};
+
+template <typename T>
+class SubHalWrapperBase : public ISubHalWrapperBase {
+  public:
+    SubHalWrapperBase(T* subHal) : mSubHal(subHal){};
+
+    virtual bool supportsNewEvents() override { return false; }
+
+    virtual Return<void> getSensorsList(
+            ::android::hardware::sensors::V2_1::ISensors::getSensorsList_2_1_cb _hidl_cb) override {
+        return mSubHal->getSensorsList(
+                [&](const auto& list) { _hidl_cb(convertToNewSensorInfos(list)); });
+    }
+
+    Return<Result> setOperationMode(OperationMode mode) override {
+        return mSubHal->setOperationMode(mode);
+    }
+
+    Return<Result> activate(int32_t sensorHandle, bool enabled) override {
+        return mSubHal->activate(sensorHandle, enabled);
+    }
+
+    Return<Result> batch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                         int64_t maxReportLatencyNs) override {
+        return mSubHal->batch(sensorHandle, samplingPeriodNs, maxReportLatencyNs);
+    }
+
+    Return<Result> flush(int32_t sensorHandle) override { return mSubHal->flush(sensorHandle); }
+
+    virtual Return<Result> injectSensorData(const Event& event) override {
+        return mSubHal->injectSensorData(convertToOldEvent(event));
+    }
+
+    Return<void> registerDirectChannel(const SharedMemInfo& mem,
+                                       ISensors::registerDirectChannel_cb _hidl_cb) override {
+        return mSubHal->registerDirectChannel(mem, _hidl_cb);
+    }
+
+    Return<Result> unregisterDirectChannel(int32_t channelHandle) override {
+        return mSubHal->unregisterDirectChannel(channelHandle);
+    }
+
+    Return<void> configDirectReport(int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
+                                    ISensors::configDirectReport_cb _hidl_cb) override {
+        return mSubHal->configDirectReport(sensorHandle, channelHandle, rate, _hidl_cb);
+    }
+
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) override {
+        return mSubHal->debug(fd, args);
+    }
+
+    const std::string getName() override { return mSubHal->getName(); }
+
+  protected:
+    T* mSubHal;
+};
+
+class SubHalWrapperV2_0 : public SubHalWrapperBase<V2_0::implementation::ISensorsSubHal> {
+  public:
+    SubHalWrapperV2_0(V2_0::implementation::ISensorsSubHal* subHal) : SubHalWrapperBase(subHal){};
+
+    Return<Result> initialize(V2_0::implementation::ISubHalCallback* callback,
+                              V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                              int32_t subHalIndex) override {
+        return mSubHal->initialize(
+                new V2_0::implementation::HalProxyCallbackV2_0(callback, refCounter, subHalIndex));
+    }
+};
+
+class SubHalWrapperV2_1 : public SubHalWrapperBase<V2_1::implementation::ISensorsSubHal> {
+  public:
+    SubHalWrapperV2_1(V2_1::implementation::ISensorsSubHal* subHal) : SubHalWrapperBase(subHal) {}
+
+    bool supportsNewEvents() override { return true; }
+
+    virtual Return<void> getSensorsList(
+            ::android::hardware::sensors::V2_1::ISensors::getSensorsList_2_1_cb _hidl_cb) override {
+        return mSubHal->getSensorsList_2_1([&](const auto& list) { _hidl_cb(list); });
+    }
+
+    virtual Return<Result> injectSensorData(const Event& event) override {
+        return mSubHal->injectSensorData_2_1(event);
+    }
+
+    Return<Result> initialize(V2_0::implementation::ISubHalCallback* callback,
+                              V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                              int32_t subHalIndex) override {
+        return mSubHal->initialize(
+                new V2_0::implementation::HalProxyCallbackV2_1(callback, refCounter, subHalIndex));
+    }
+};
+
+/**
+ * Wrapper of a subhal whose library is only loaded once one of its sensors is used.
+ *
+ * Until then, the sensor list and name come from the subhal cache and the calls that don't need
+ * the subhal are answered without it: initialization and the operation mode are remembered and
+ * replayed on the subhal once it's loaded, and disabling a sensor is a no-op.
+ */
+class LazySubHalWrapper : public ISubHalWrapperBase {
+  public:
+    using Loader = std::function<std::shared_ptr<ISubHalWrapperBase>()>;
+
+    /**
+     * @param name The name the subhal reported when it was cached.
+     * @param sensors The sensor list the subhal reported when it was cached.
+     * @param loader Loads the subhal, returning nullptr on failure.
+     */
+    LazySubHalWrapper(const std::string& name, const std::vector<SensorInfo>& sensors,
+                      Loader loader)
+        : mName(name), mSensors(sensors), mLoader(std::move(loader)) {}
+
+    bool supportsNewEvents() override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(false /* load */);
+        return subHal != nullptr && subHal->supportsNewEvents();
+    }
+
+    Return<Result> initialize(V2_0::implementation::ISubHalCallback* callback,
+                              V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                              int32_t subHalIndex) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCallback = callback;
+        mRefCounter = refCounter;
+        mSubHalIndex = subHalIndex;
+        mOperationMode = OperationMode::NORMAL;
+        if (mSubHal == nullptr) {
+            return Result::OK;
+        }
+        return mSubHal->initialize(callback, refCounter, subHalIndex);
+    }
+
+    Return<void> getSensorsList(
+            ::android::hardware::sensors::V2_1::ISensors::getSensorsList_2_1_cb _hidl_cb) override {
+        _hidl_cb(mSensors);
+        return Void();
+    }
+
+    Return<Result> setOperationMode(OperationMode mode) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mSubHal == nullptr) {
+            mOperationMode = mode;
+            return Result::OK;
+        }
+        Result result = mSubHal->setOperationMode(mode);
+        if (result == Result::OK) {
+            mOperationMode = mode;
+        }
+        return result;
+    }
+
+    Return<Result> activate(int32_t sensorHandle, bool enabled) override {
+        // Sensors of a subhal that isn't loaded are all disabled already.
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(enabled /* load */);
+        if (subHal == nullptr) {
+            return enabled ? Result::BAD_VALUE : Result::OK;
+        }
+        return subHal->activate(sensorHandle, enabled);
+    }
+
+    Return<Result> batch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                         int64_t maxReportLatencyNs) override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(true /* load */);
+        if (subHal == nullptr) return Result::BAD_VALUE;
+        return subHal->batch(sensorHandle, samplingPeriodNs, maxReportLatencyNs);
+    }
+
+    Return<Result> flush(int32_t sensorHandle) override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(true /* load */);
+        if (subHal == nullptr) return Result::BAD_VALUE;
+        return subHal->flush(sensorHandle);
+    }
+
+    Return<Result> injectSensorData(const Event& event) override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(true /* load */);
+        if (subHal == nullptr) return Result::BAD_VALUE;
+        return subHal->injectSensorData(event);
+    }
+
+    Return<void> registerDirectChannel(const SharedMemInfo& mem,
+                                       ISensors::registerDirectChannel_cb _hidl_cb) override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(true /* load */);
+        if (subHal == nullptr) {
+            _hidl_cb(Result::INVALID_OPERATION, -1 /* channelHandle */);
+            return Void();
+        }
+        return subHal->registerDirectChannel(mem, _hidl_cb);
+    }
+
+    Return<Result> unregisterDirectChannel(int32_t channelHandle) override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(false /* load */);
+        if (subHal == nullptr) return Result::BAD_VALUE;
+        return subHal->unregisterDirectChannel(channelHandle);
+    }
+
+    Return<void> configDirectReport(int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
+                                    ISensors::configDirectReport_cb _hidl_cb) override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(true /* load */);
+        if (subHal == nullptr) {
+            _hidl_cb(Result::INVALID_OPERATION, -1 /* reportToken */);
+            return Void();
+        }
+        return subHal->configDirectReport(sensorHandle, channelHandle, rate, _hidl_cb);
+    }
+
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) override {
+        std::shared_ptr<ISubHalWrapperBase> subHal = getSubHal(false /* load */);
+        if (subHal == nullptr) {
+            android::base::WriteStringToFd("  Not loaded yet\n", fd->data[0]);
+            return Void();
+        }
+        return subHal->debug(fd, args);
+    }
+
+    const std::string getName() override { return mName; }
+
+  private:
+    /**
+     * @param load Whether to load the subhal if it isn't loaded yet.
+     *
+     * @return The subhal, or nullptr if it isn't loaded.
+     */
+    std::shared_ptr<ISubHalWrapperBase> getSubHal(bool load) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mSubHal != nullptr || !load || mLoadFailed) {
+            return mSubHal;
+        }
+
+        std::shared_ptr<ISubHalWrapperBase> subHal = mLoader();
+        if (subHal == nullptr) {
+            ALOGE("Failed to load subhal %s on demand", mName.c_str());
+            mLoadFailed = true;
+            return nullptr;
+        }
+        if (mCallback != nullptr) {
+            Result result = subHal->initialize(mCallback, mRefCounter, mSubHalIndex);
+            if (result != Result::OK) {
+                ALOGE("Subhal '%s' failed to initialize.", mName.c_str());
+            }
+            if (mOperationMode != OperationMode::NORMAL) {
+                subHal->setOperationMode(mOperationMode);
+            }
+        }
+        ALOGI("Loaded subhal %s on demand", mName.c_str());
+        mSubHal = subHal;
+        return mSubHal;
+    }
+
+    const std::string mName;
+    const hidl_vec<SensorInfo> mSensors;
+    const Loader mLoader;
+
+    //! The mutex protecting the members below.
+    std::mutex mMutex;
+
+    std::shared_ptr<ISubHalWrapperBase> mSubHal;
+    bool mLoadFailed = false;
+
+    //! The arguments of the last initialize call, replayed when the subhal is loaded.
+    V2_0::implementation::ISubHalCallback* mCallback = nullptr;
+    V2_0::implementation::IScopedWakelockRefCounter* mRefCounter = nullptr;
+    int32_t mSubHalIndex = 0;
+
+    OperationMode mOperationMode = OperationMode::NORMAL;
+};
+
+/**
+ * Wrapper serializing the calls to a subhal, which the proxy makes from several binder threads.
+ *
+ * Subhals were only ever called from one binder thread, so calls to one subhal are still made one
+ * at a time, while different subhals are called concurrently. Dumps aren't serialized so that a
+ * stuck call can be debugged.
+ */
+class SerializedSubHalWrapper : public ISubHalWrapperBase {
+  public:
+    explicit SerializedSubHalWrapper(std::shared_ptr<ISubHalWrapperBase> subHal)
+        : mSubHal(std::move(subHal)) {}
+
+    bool supportsNewEvents() override { return mSubHal->supportsNewEvents(); }
+
+    Return<Result> initialize(V2_0::implementation::ISubHalCallback* callback,
+                              V2_0::implementation::IScopedWakelockRefCounter* refCounter,
+                              int32_t subHalIndex) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->initialize(callback, refCounter, subHalIndex);
+    }
+
+    Return<void> getSensorsList(
+            ::android::hardware::sensors::V2_1::ISensors::getSensorsList_2_1_cb _hidl_cb) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->getSensorsList(_hidl_cb);
+    }
+
+    Return<Result> setOperationMode(OperationMode mode) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->setOperationMode(mode);
+    }
+
+    Return<Result> activate(int32_t sensorHandle, bool enabled) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->activate(sensorHandle, enabled);
+    }
+
+    Return<Result> batch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                         int64_t maxReportLatencyNs) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->batch(sensorHandle, samplingPeriodNs, maxReportLatencyNs);
+    }
+
+    Return<Result> flush(int32_t sensorHandle) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->flush(sensorHandle);
+    }
+
+    Return<Result> injectSensorData(const Event& event) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->injectSensorData(event);
+    }
+
+    Return<void> registerDirectChannel(const SharedMemInfo& mem,
+                                       ISensors::registerDirectChannel_cb _hidl_cb) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->registerDirectChannel(mem, _hidl_cb);
+    }
+
+    Return<Result> unregisterDirectChannel(int32_t channelHandle) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->unregisterDirectChannel(channelHandle);
+    }
+
+    Return<void> configDirectReport(int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
+                                    ISensors::configDirectReport_cb _hidl_cb) override {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mSubHal->configDirectReport(sensorHandle, channelHandle, rate, _hidl_cb);
+    }
+
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) override {
+        return mSubHal->debug(fd, args);
+    }
+
+    const std::string getName() override { return mSubHal->getName(); }
+
+  private:
+    const std::shared_ptr<ISubHalWrapperBase> mSubHal;
+
+    //! Held for the duration of each call to the subhal.
+    std::mutex mMutex;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
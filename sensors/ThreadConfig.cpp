@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ThreadConfig.h"
+
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <log/log.h>
+#include <processgroup/processgroup.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+namespace {
+
+const char* kPropertyPrefix = "vendor.sensors.multihal.";
+
+constexpr int kMaxUclamp = 1024;
+
+//! The task profile moving a thread to the top-app cpuset, which spans all the CPUs.
+const char* kAllCpusTaskProfile = "ProcessCapacityMax";
+
+//! The flags of sched_setattr() setting the min utilization clamp and keeping the rest.
+constexpr uint64_t kSchedFlagKeepAll = 0x08 | 0x10;
+constexpr uint64_t kSchedFlagUtilClampMin = 0x20;
+
+//! The struct taken by sched_setattr(), which libc doesn't wrap.
+struct SchedAttr {
+    uint32_t size;
+    uint32_t schedPolicy;
+    uint64_t schedFlags;
+    int32_t schedNice;
+    uint32_t schedPriority;
+    uint64_t schedRuntime;
+    uint64_t schedDeadline;
+    uint64_t schedPeriod;
+    uint32_t schedUtilMin;
+    uint32_t schedUtilMax;
+};
+
+//! @return false if the list is malformed or names a CPU that doesn't exist.
+bool parseCpus(const std::string& list, std::vector<int>* cpus) {
+    for (const std::string& item : android::base::Split(list, ",")) {
+        std::vector<std::string> bounds = android::base::Split(item, "-");
+        int first;
+        int last;
+        if (bounds.size() > 2 ||
+            !android::base::ParseInt(bounds.front(), &first, 0, CPU_SETSIZE - 1) ||
+            !android::base::ParseInt(bounds.back(), &last, first, CPU_SETSIZE - 1)) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus->push_back(cpu);
+        }
+    }
+    return !cpus->empty();
+}
+
+}  // namespace
+
+ThreadConfig ThreadConfig::fromProperties(const std::string& key, const std::string& name) {
+    std::string prefix = kPropertyPrefix + key + ".";
+    ThreadConfig config;
+    config.name = name;
+    config.fifoPriority = android::base::GetIntProperty(prefix + "fifo_priority", 0, 0,
+                                                        sched_get_priority_max(SCHED_FIFO));
+    config.uclampMin = android::base::GetIntProperty(prefix + "uclamp_min", -1, -1, kMaxUclamp);
+    std::string cpus = android::base::GetProperty(prefix + "cpus", "");
+    if (!cpus.empty() && !parseCpus(cpus, &config.cpus)) {
+        ALOGE("Invalid %scpus %s, keeping the affinity of %s", prefix.c_str(), cpus.c_str(),
+              name.c_str());
+        config.cpus.clear();
+    }
+    return config;
+}
+
+void ThreadConfig::apply() const {
+    pthread_setname_np(pthread_self(), name.c_str());
+
+    if (fifoPriority > 0) {
+        sched_param param = {.sched_priority = fifoPriority};
+        if (sched_setscheduler(0 /* calling thread */, SCHED_FIFO, &param) != 0) {
+            ALOGE("Failed to run %s as SCHED_FIFO %d: %s", name.c_str(), fifoPriority,
+                  strerror(errno));
+        }
+    }
+
+    if (uclampMin >= 0) {
+        SchedAttr attr = {};
+        attr.size = sizeof(attr);
+        attr.schedFlags = kSchedFlagKeepAll | kSchedFlagUtilClampMin;
+        attr.schedUtilMin = static_cast<uint32_t>(uclampMin);
+        if (syscall(__NR_sched_setattr, 0 /* calling thread */, &attr, 0 /* flags */) != 0) {
+            ALOGE("Failed to set the uclamp.min of %s to %d: %s", name.c_str(), uclampMin,
+                  strerror(errno));
+        }
+    }
+
+    if (!cpus.empty()) {
+        // The affinity is limited to the cpuset, and the one of the service leaves out the big
+        // cores, so only move this thread to a cpuset with all the CPUs.
+        if (!SetTaskProfiles(gettid(), {kAllCpusTaskProfile})) {
+            ALOGE("Failed to apply %s to %s", kAllCpusTaskProfile, name.c_str());
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0 /* calling thread */, sizeof(set), &set) != 0) {
+            ALOGE("Failed to set the CPU affinity of %s: %s", name.c_str(), strerror(errno));
+        }
+    }
+}
+
+void ThreadConfig::dump(std::ostream& stream) const {
+    stream << name << ": ";
+    if (fifoPriority > 0) {
+        stream << "SCHED_FIFO " << fifoPriority;
+    } else {
+        stream << "default policy";
+    }
+    if (uclampMin >= 0) {
+        stream << ", uclamp.min " << uclampMin;
+    }
+    if (!cpus.empty()) {
+        stream << ", CPUs";
+        for (int cpu : cpus) {
+            stream << " " << cpu;
+        }
+    }
+    stream << std::endl;
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * The name and scheduling settings of a worker thread of the HalProxy.
+ *
+ * The settings are read from the vendor.sensors.multihal.<key>.* properties:
+ *  - fifo_priority: run the thread as SCHED_FIFO with that priority, at most the rtprio rlimit of
+ *    the service.
+ *  - uclamp_min: the min utilization clamp of the thread, from 0 to 1024, which makes the
+ *    scheduler pick faster cores and frequencies for it.
+ *  - cpus: the CPUs the thread may run on, as a list of CPUs and ranges such as "4-7" or "0,6-7".
+ *    The service runs in the system-background cpuset, which leaves out the big cores 6-7, so a
+ *    thread with CPUs set alone moves to the top-app cpuset, which spans all of them.
+ * Unset or invalid properties leave the setting as the thread inherited it.
+ */
+struct ThreadConfig {
+    //! The name of the thread, at most 15 characters.
+    std::string name;
+
+    //! The SCHED_FIFO priority, 0 to keep the policy.
+    int fifoPriority = 0;
+
+    //! The min utilization clamp, -1 to keep it.
+    int uclampMin = -1;
+
+    //! The CPUs, empty to keep the affinity.
+    std::vector<int> cpus;
+
+    /**
+     * @param key The key of the thread in the property names.
+     * @param name The name of the thread.
+     *
+     * @return The config of the thread, as currently set by the properties.
+     */
+    static ThreadConfig fromProperties(const std::string& key, const std::string& name);
+
+    //! Apply the config to the calling thread, logging the settings that couldn't be applied.
+    void apply() const;
+
+    //! Write the settings on one line.
+    void dump(std::ostream& stream) const;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
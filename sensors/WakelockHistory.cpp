@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WakelockHistory.h"
+
+#include <algorithm>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+namespace {
+
+int64_t msFromNs(int64_t nanos) {
+    return nanos / 1000000;
+}
+
+}  // namespace
+
+void SubHalWakelockStats::acquire(size_t delta, int64_t now) {
+    if (delta == 0) return;
+    if (mRefCount == 0) {
+        mHoldStartNs = now;
+    }
+    mRefCount += delta;
+    mNumRefsAcquired += delta;
+}
+
+void SubHalWakelockStats::release(size_t delta, int64_t now) {
+    if (delta == 0 || mRefCount == 0) return;
+    mRefCount -= std::min(mRefCount, delta);
+    if (mRefCount > 0) return;
+
+    int64_t holdNs = now - mHoldStartNs;
+    mHistory[mNumHolds % kHistorySize] = {mHoldStartNs, now};
+    mNumHolds++;
+    mTotalHoldNs += holdNs;
+    mLongestHoldNs = std::max(mLongestHoldNs, holdNs);
+}
+
+void SubHalWakelockStats::dump(std::ostream& stream, int64_t now) const {
+    stream << "    Wakelock ref count: " << mRefCount;
+    if (mRefCount > 0) {
+        stream << " (held for " << msFromNs(now - mHoldStartNs) << " ms)";
+    }
+    stream << std::endl;
+    stream << "    # of wakelock refs acquired: " << mNumRefsAcquired << std::endl;
+    stream << "    # of wakelock holds: " << mNumHolds << ", total " << msFromNs(mTotalHoldNs)
+           << " ms, longest " << msFromNs(mLongestHoldNs) << " ms" << std::endl;
+    size_t numInHistory = std::min<uint64_t>(mNumHolds, kHistorySize);
+    if (numInHistory > 0) {
+        stream << "    Most recent wakelock holds:" << std::endl;
+    }
+    for (size_t i = 1; i <= numInHistory; i++) {
+        const Hold& hold = mHistory[(mNumHolds - i) % kHistorySize];
+        stream << "      acquired " << msFromNs(now - hold.acquireTimeNs) << " ms ago, held "
+               << msFromNs(hold.releaseTimeNs - hold.acquireTimeNs) << " ms" << std::endl;
+    }
+}
+
+void WakeupEventOwners::push(int32_t subHalIndex, size_t numEvents) {
+    if (numEvents == 0) return;
+    if (mNumRuns > 0) {
+        Run& back = mRuns[(mHead + mNumRuns - 1) % kMaxNumRuns];
+        if (back.subHalIndex == subHalIndex || mNumRuns == kMaxNumRuns) {
+            back.numEvents += numEvents;
+            return;
+        }
+    }
+    mRuns[(mHead + mNumRuns) % kMaxNumRuns] = {subHalIndex, numEvents};
+    mNumRuns++;
+}
+
+size_t WakeupEventOwners::remove(int32_t subHalIndex, size_t numEvents) {
+    size_t numRemoved = 0;
+    size_t numKept = 0;
+    // Compact the runs in place, dropping the ones that become empty.
+    for (size_t i = 0; i < mNumRuns; i++) {
+        Run run = mRuns[(mHead + i) % kMaxNumRuns];
+        if (run.subHalIndex == subHalIndex && numRemoved < numEvents) {
+            size_t numFromRun = std::min(numEvents - numRemoved, run.numEvents);
+            run.numEvents -= numFromRun;
+            numRemoved += numFromRun;
+        }
+        if (run.numEvents > 0) {
+            mRuns[(mHead + numKept) % kMaxNumRuns] = run;
+            numKept++;
+        }
+    }
+    mNumRuns = numKept;
+    return numRemoved;
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
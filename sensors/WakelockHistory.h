@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * The share of the shared wakelock refcount held on behalf of one subhal, and the history of the
+ * intervals during which that share was non zero.
+ *
+ * Not thread safe, callers are expected to hold the wakelock mutex.
+ */
+class SubHalWakelockStats {
+  public:
+    //! Add refs, starting a hold if the subhal had none.
+    void acquire(size_t delta, int64_t now);
+
+    //! Remove refs, ending the current hold if none are left.
+    void release(size_t delta, int64_t now);
+
+    //! Remove every ref, as when the shared wakelock is reset.
+    void releaseAll(int64_t now) { release(mRefCount, now); }
+
+    size_t getRefCount() const { return mRefCount; }
+
+    /**
+     * Write the current refcount, the totals and the most recent holds.
+     *
+     * @param stream The stream to write to.
+     * @param now The current time, holds are printed relative to it.
+     */
+    void dump(std::ostream& stream, int64_t now) const;
+
+  private:
+    //! The number of most recent holds kept.
+    static constexpr size_t kHistorySize = 16;
+
+    struct Hold {
+        int64_t acquireTimeNs;
+        int64_t releaseTimeNs;
+    };
+
+    size_t mRefCount = 0;
+
+    //! When the current hold started, only valid while mRefCount > 0.
+    int64_t mHoldStartNs = 0;
+
+    //! The total of refs ever acquired.
+    uint64_t mNumRefsAcquired = 0;
+
+    //! The number of completed holds, their total and longest duration.
+    uint64_t mNumHolds = 0;
+    int64_t mTotalHoldNs = 0;
+    int64_t mLongestHoldNs = 0;
+
+    //! Ring of the most recent completed holds, mNumHolds % kHistorySize is the next slot.
+    std::array<Hold, kHistorySize> mHistory;
+};
+
+/**
+ * FIFO of which subhal posted the wakeup events that the framework hasn't acknowledged yet.
+ *
+ * The framework acks wakeup events in the order they were written to the event FMQ, which is the
+ * order in which they were posted, so acks can be attributed by popping from the front. Runs of
+ * events from the same subhal are merged. When the ring is full, further events are added to the
+ * run at the back, which may misattribute them but keeps the counts right.
+ *
+ * Not thread safe, callers are expected to hold the wakelock mutex.
+ */
+class WakeupEventOwners {
+  public:
+    void push(int32_t subHalIndex, size_t numEvents);
+
+    /**
+     * Remove events from the front.
+     *
+     * @param numEvents The number of events to remove.
+     * @param onRemoved Called with the subhal index and the number of events removed from it.
+     */
+    template <typename Callback>
+    void popFront(size_t numEvents, Callback onRemoved) {
+        while (numEvents > 0 && mNumRuns > 0) {
+            Run& run = mRuns[mHead];
+            size_t numRemoved = std::min(numEvents, run.numEvents);
+            onRemoved(run.subHalIndex, numRemoved);
+            numEvents -= numRemoved;
+            run.numEvents -= numRemoved;
+            if (run.numEvents == 0) {
+                mHead = (mHead + 1) % kMaxNumRuns;
+                mNumRuns--;
+            }
+        }
+    }
+
+    /**
+     * Remove the oldest events of a subhal, as when its events are dropped instead of written.
+     *
+     * @return The number of events removed, at most numEvents.
+     */
+    size_t remove(int32_t subHalIndex, size_t numEvents);
+
+    void clear() {
+        mHead = 0;
+        mNumRuns = 0;
+    }
+
+  private:
+    static constexpr size_t kMaxNumRuns = 256;
+
+    struct Run {
+        int32_t subHalIndex;
+        size_t numEvents;
+    };
+
+    std::array<Run, kMaxNumRuns> mRuns;
+    size_t mHead = 0;
+    size_t mNumRuns = 0;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
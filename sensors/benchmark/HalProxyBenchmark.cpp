@@ -0,0 +1,804 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "HalProxy.h"
+#include "replay/ReplaySubHal.h"
+
+#include <android/hardware/sensors/2.1/types.h>
+#include <benchmark/benchmark.h>
+#include <fmq/EventFlag.h>
+#include <fmq/MessageQueue.h>
+#include <utils/SystemClock.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <new>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Measures what the multihal proxy costs per event. Synthetic subhals post events stamped with
+ * the time of the post, a simulated framework reader drains the event FMQ the way sensorservice
+ * does and acks wakeup events on the wakelock FMQ, and the latency is taken when events are read.
+ */
+
+static std::atomic<uint64_t> gNumAllocations = 0;
+
+void* operator new(size_t size) {
+    gNumAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size);
+    if (ptr == nullptr) abort();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t /* size */) noexcept {
+    free(ptr);
+}
+
+namespace {
+
+using ::android::sp;
+using ::android::hardware::EventFlag;
+using ::android::hardware::hidl_handle;
+using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::kSynchronizedReadWrite;
+using ::android::hardware::MessageQueue;
+using ::android::hardware::Return;
+using ::android::hardware::Void;
+using ::android::hardware::sensors::V1_0::OperationMode;
+using ::android::hardware::sensors::V1_0::RateLevel;
+using ::android::hardware::sensors::V1_0::Result;
+using ::android::hardware::sensors::V1_0::SensorFlagBits;
+using ::android::hardware::sensors::V1_0::SharedMemInfo;
+using ::android::hardware::sensors::V2_0::EventQueueFlagBits;
+using ::android::hardware::sensors::V2_0::implementation::HalProxyCallbackV2_0;
+using ::android::hardware::sensors::V2_0::implementation::HalProxyCallbackV2_1;
+using ::android::hardware::sensors::V2_0::WakeLockQueueFlagBits;
+using ::android::hardware::sensors::V2_1::Event;
+using ::android::hardware::sensors::V2_1::SensorInfo;
+using ::android::hardware::sensors::V2_1::SensorType;
+using ::android::hardware::sensors::V2_1::implementation::convertToNewEvents;
+using ::android::hardware::sensors::V2_1::implementation::HalProxy;
+using ::android::hardware::sensors::V2_1::implementation::ReplaySubHal;
+
+using EventMessageQueue = MessageQueue<Event, kSynchronizedReadWrite>;
+using WakeLockQueue = MessageQueue<uint32_t, kSynchronizedReadWrite>;
+using ISensorsSubHalV2_0 = ::android::hardware::sensors::V2_0::implementation::ISensorsSubHal;
+using ISensorsSubHalV2_1 = ::android::hardware::sensors::V2_1::implementation::ISensorsSubHal;
+using IHalProxyCallbackV2_1 = ::android::hardware::sensors::V2_1::implementation::IHalProxyCallback;
+
+// Same sizes as the queues sensorservice hands to the HAL.
+constexpr size_t kEventQueueSize = 256;
+constexpr size_t kWakeLockQueueSize = 256;
+
+constexpr int32_t kContinuousSensorHandle = 1;
+constexpr int32_t kWakeUpSensorHandle = 2;
+
+//! Dynamic sensors get handles from there on.
+constexpr int32_t kFirstDynamicSensorHandle = 0x100;
+
+constexpr int64_t kReadTimeoutNs = 100 * 1000 * 1000;
+constexpr size_t kMaxLatencySamples = 1 << 20;
+constexpr auto kSampleWindow = std::chrono::milliseconds(100);
+
+struct BenchmarkConfig {
+    size_t numSubHals;
+    size_t batchSize;
+    //! Percentage of events that come from the wakeup sensor of each subhal.
+    size_t wakeupPercent;
+    //! Events per second posted by each subhal, 0 to post as fast as possible.
+    size_t rateHz;
+    //! Dynamic sensors each subhal keeps connected.
+    size_t numDynamicSensors = 0;
+    //! Dynamic sensors each subhal replaces per second, by disconnecting the oldest one and
+    //! connecting a new one.
+    size_t churnHz = 0;
+};
+
+//! @return The percentile of the samples, which are partially sorted.
+int64_t getPercentileNs(std::vector<int64_t>& samplesNs, double percentile) {
+    if (samplesNs.empty()) return 0;
+    size_t index = std::min(samplesNs.size() - 1,
+                            static_cast<size_t>(percentile * samplesNs.size()));
+    std::nth_element(samplesNs.begin(), samplesNs.begin() + index, samplesNs.end());
+    return samplesNs[index];
+}
+
+/**
+ * Subhal with a continuous and a wakeup accelerometer that posts batches from its own thread, and
+ * optionally churns through dynamic sensors from another.
+ */
+class SyntheticSubHal : public ISensorsSubHalV2_1 {
+  public:
+    SyntheticSubHal(size_t index, const BenchmarkConfig& config)
+        : mName("SyntheticSubHal" + std::to_string(index)), mConfig(config) {}
+
+    ~SyntheticSubHal() { stop(); }
+
+    void start() {
+        mRunning = true;
+        mThread = std::thread([this] { emitEvents(); });
+        if (mConfig.numDynamicSensors > 0) {
+            mChurnThread = std::thread([this] { churnDynamicSensors(); });
+        }
+    }
+
+    void stop() {
+        mRunning = false;
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+        if (mChurnThread.joinable()) {
+            mChurnThread.join();
+        }
+    }
+
+    uint64_t getNumEventsPosted() const { return mNumEventsPosted.load(); }
+
+    uint64_t getNumSensorsChurned() const { return mNumSensorsChurned.load(); }
+
+    //! How long replacing a dynamic sensor took, only valid once the subhal is stopped.
+    std::vector<int64_t>& getChurnLatenciesNs() { return mChurnLatenciesNs; }
+
+    const std::string getName() override { return mName; }
+
+    Return<Result> initialize(const sp<IHalProxyCallbackV2_1>& halProxyCallback) override {
+        mCallback = halProxyCallback;
+        return Result::OK;
+    }
+
+    Return<void> getSensorsList_2_1(getSensorsList_2_1_cb _hidl_cb) override {
+        std::vector<SensorInfo> sensors = {
+                makeSensorInfo(kContinuousSensorHandle, 0 /* flags */),
+                makeSensorInfo(kWakeUpSensorHandle,
+                               static_cast<uint32_t>(SensorFlagBits::WAKE_UP)),
+        };
+        _hidl_cb(sensors);
+        return Void();
+    }
+
+    Return<void> getSensorsList(getSensorsList_cb /* _hidl_cb */) override { return Void(); }
+
+    Return<Result> setOperationMode(OperationMode /* mode */) override { return Result::OK; }
+
+    Return<Result> activate(int32_t /* sensorHandle */, bool /* enabled */) override {
+        return Result::OK;
+    }
+
+    Return<Result> batch(int32_t /* sensorHandle */, int64_t /* samplingPeriodNs */,
+                         int64_t /* maxReportLatencyNs */) override {
+        return Result::OK;
+    }
+
+    Return<Result> flush(int32_t /* sensorHandle */) override { return Result::OK; }
+
+    Return<Result> injectSensorData(
+            const ::android::hardware::sensors::V1_0::Event& /* event */) override {
+        return Result::INVALID_OPERATION;
+    }
+
+    Return<Result> injectSensorData_2_1(const Event& /* event */) override {
+        return Result::INVALID_OPERATION;
+    }
+
+    Return<void> registerDirectChannel(const SharedMemInfo& /* mem */,
+                                       registerDirectChannel_cb _hidl_cb) override {
+        _hidl_cb(Result::INVALID_OPERATION, -1 /* channelHandle */);
+        return Void();
+    }
+
+    Return<Result> unregisterDirectChannel(int32_t /* channelHandle */) override {
+        return Result::INVALID_OPERATION;
+    }
+
+    Return<void> configDirectReport(int32_t /* sensorHandle */, int32_t /* channelHandle */,
+                                    RateLevel /* rate */, configDirectReport_cb _hidl_cb) override {
+        _hidl_cb(Result::INVALID_OPERATION, -1 /* reportToken */);
+        return Void();
+    }
+
+    Return<void> debug(const hidl_handle& /* fd */,
+                       const hidl_vec<hidl_string>& /* args */) override {
+        return Void();
+    }
+
+  private:
+    static SensorInfo makeSensorInfo(int32_t sensorHandle, uint32_t flags) {
+        SensorInfo sensor = {};
+        sensor.sensorHandle = sensorHandle;
+        sensor.name = ((flags & SensorFlagBits::DYNAMIC_SENSOR) != 0 ? "Synthetic Dynamic "
+                                                                     : "Synthetic ") +
+                      std::string("Accelerometer ") + std::to_string(sensorHandle);
+        sensor.vendor = "LineageOS";
+        sensor.version = 1;
+        sensor.type = SensorType::ACCELEROMETER;
+        sensor.typeAsString = "";
+        sensor.maxRange = 78.4f;
+        sensor.resolution = 0.01f;
+        sensor.power = 0.1f;
+        sensor.minDelay = 2500;
+        sensor.maxDelay = 1000000;
+        sensor.flags = flags;
+        return sensor;
+    }
+
+    void emitEvents() {
+        // The batch is reused so that the only allocations seen are the proxy's.
+        std::vector<Event> events(mConfig.batchSize);
+        int64_t periodNs =
+                mConfig.rateHz == 0 ? 0 : mConfig.batchSize * INT64_C(1000000000) / mConfig.rateHz;
+        int64_t nextPostNs = ::android::elapsedRealtimeNano();
+        size_t wakeupAccumulator = 0;
+        while (mRunning.load()) {
+            size_t numWakeupEvents = 0;
+            int64_t now = ::android::elapsedRealtimeNano();
+            for (Event& event : events) {
+                // Spread the wakeup events evenly over the stream.
+                wakeupAccumulator += mConfig.wakeupPercent;
+                bool wakeup = wakeupAccumulator >= 100;
+                if (wakeup) {
+                    wakeupAccumulator -= 100;
+                    numWakeupEvents++;
+                }
+                event.timestamp = now;
+                event.sensorHandle = wakeup ? kWakeUpSensorHandle : kContinuousSensorHandle;
+                event.sensorType = SensorType::ACCELEROMETER;
+                event.u.vec3.x = 0.0f;
+                event.u.vec3.y = 0.0f;
+                event.u.vec3.z = 9.81f;
+            }
+            mCallback->postEvents(events, mCallback->createScopedWakelock(numWakeupEvents > 0));
+            mNumEventsPosted.fetch_add(events.size());
+
+            if (periodNs > 0) {
+                nextPostNs += periodNs;
+                int64_t sleepNs = nextPostNs - ::android::elapsedRealtimeNano();
+                if (sleepNs > 0) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(sleepNs));
+                }
+            }
+        }
+    }
+
+    void churnDynamicSensors() {
+        // Handles cycle through twice as many as are connected, like a subhal reusing the handles
+        // of unplugged sensors, so that the proxy sees a bounded set of handles.
+        size_t numHandles = 2 * mConfig.numDynamicSensors;
+        size_t nextHandle = 0;
+        std::deque<int32_t> connectedHandles;
+        auto makeSensors = [&](size_t count) {
+            std::vector<SensorInfo> sensors;
+            for (size_t i = 0; i < count; i++) {
+                int32_t sensorHandle =
+                        kFirstDynamicSensorHandle + static_cast<int32_t>(nextHandle);
+                nextHandle = (nextHandle + 1) % numHandles;
+                sensors.push_back(makeSensorInfo(
+                        sensorHandle, static_cast<uint32_t>(SensorFlagBits::DYNAMIC_SENSOR)));
+                connectedHandles.push_back(sensorHandle);
+            }
+            return sensors;
+        };
+
+        mCallback->onDynamicSensorsConnected_2_1(makeSensors(mConfig.numDynamicSensors));
+        int64_t periodNs = mConfig.churnHz == 0 ? 0 : INT64_C(1000000000) / mConfig.churnHz;
+        int64_t nextChurnNs = ::android::elapsedRealtimeNano();
+        while (mRunning.load()) {
+            if (periodNs == 0) {
+                std::this_thread::sleep_for(kSampleWindow);
+                continue;
+            }
+            std::vector<SensorInfo> sensors = makeSensors(1);
+            int64_t startNs = ::android::elapsedRealtimeNano();
+            mCallback->onDynamicSensorsDisconnected({connectedHandles.front()});
+            mCallback->onDynamicSensorsConnected_2_1(sensors);
+            if (mChurnLatenciesNs.size() < kMaxLatencySamples) {
+                mChurnLatenciesNs.push_back(::android::elapsedRealtimeNano() - startNs);
+            }
+            connectedHandles.pop_front();
+            mNumSensorsChurned.fetch_add(1);
+
+            nextChurnNs += periodNs;
+            int64_t sleepNs = nextChurnNs - ::android::elapsedRealtimeNano();
+            if (sleepNs > 0) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(sleepNs));
+            }
+        }
+        mCallback->onDynamicSensorsDisconnected(
+                std::vector<int32_t>(connectedHandles.begin(), connectedHandles.end()));
+    }
+
+    const std::string mName;
+    const BenchmarkConfig mConfig;
+    sp<IHalProxyCallbackV2_1> mCallback;
+    std::thread mThread;
+    std::thread mChurnThread;
+    std::atomic_bool mRunning = false;
+    std::atomic<uint64_t> mNumEventsPosted = 0;
+    std::atomic<uint64_t> mNumSensorsChurned = 0;
+    std::vector<int64_t> mChurnLatenciesNs;
+};
+
+class NoOpSensorsCallback : public ::android::hardware::sensors::V2_1::ISensorsCallback {
+  public:
+    Return<void> onDynamicSensorsConnected(
+            const hidl_vec<::android::hardware::sensors::V1_0::SensorInfo>& /* added */) override {
+        return Void();
+    }
+
+    Return<void> onDynamicSensorsConnected_2_1(const hidl_vec<SensorInfo>& /* added */) override {
+        return Void();
+    }
+
+    Return<void> onDynamicSensorsDisconnected(const hidl_vec<int32_t>& /* removed */) override {
+        return Void();
+    }
+};
+
+/**
+ * Reads the event FMQ like sensorservice's poll loop and records how long events took from being
+ * posted by a subhal to being read.
+ */
+class FrameworkReader {
+  public:
+    FrameworkReader(EventMessageQueue* eventQueue, WakeLockQueue* wakeLockQueue)
+        : mEventQueue(eventQueue), mWakeLockQueue(wakeLockQueue) {
+        EventFlag::createEventFlag(mEventQueue->getEventFlagWord(), &mEventQueueFlag);
+        EventFlag::createEventFlag(mWakeLockQueue->getEventFlagWord(), &mWakeLockQueueFlag);
+        mLatenciesNs.reserve(kMaxLatencySamples);
+    }
+
+    ~FrameworkReader() {
+        stop();
+        EventFlag::deleteEventFlag(&mEventQueueFlag);
+        EventFlag::deleteEventFlag(&mWakeLockQueueFlag);
+    }
+
+    void start() {
+        mRunning = true;
+        mThread = std::thread([this] { readEvents(); });
+    }
+
+    void stop() {
+        mRunning = false;
+        if (mThread.joinable()) {
+            mEventQueueFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS));
+            mThread.join();
+        }
+    }
+
+    //! Must be called before the reader is started.
+    void setWakeUpSensorHandles(std::set<int32_t> sensorHandles) {
+        mWakeUpSensorHandles = std::move(sensorHandles);
+    }
+
+    uint64_t getNumEventsRead() const { return mNumEventsRead.load(); }
+
+    //! Only valid once the reader is stopped.
+    int64_t getLatencyPercentileNs(double percentile) {
+        return getPercentileNs(mLatenciesNs, percentile);
+    }
+
+  private:
+    void readEvents() {
+        std::vector<Event> events(kEventQueueSize);
+        while (mRunning.load()) {
+            size_t numAvailable = mEventQueue->availableToRead();
+            if (numAvailable == 0) {
+                uint32_t eventFlagState = 0;
+                mEventQueueFlag->wait(static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS),
+                                      &eventFlagState, kReadTimeoutNs);
+                numAvailable = mEventQueue->availableToRead();
+            }
+            if (numAvailable == 0) continue;
+
+            size_t numToRead = std::min(numAvailable, events.size());
+            if (!mEventQueue->read(events.data(), numToRead)) continue;
+            mEventQueueFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::EVENTS_READ));
+
+            int64_t now = ::android::elapsedRealtimeNano();
+            uint32_t numWakeupEvents = 0;
+            for (size_t i = 0; i < numToRead; i++) {
+                if (mWakeUpSensorHandles.count(events[i].sensorHandle) > 0) {
+                    numWakeupEvents++;
+                }
+                if (mLatenciesNs.size() < kMaxLatencySamples) {
+                    mLatenciesNs.push_back(now - events[i].timestamp);
+                }
+            }
+            mNumEventsRead.fetch_add(numToRead);
+
+            if (numWakeupEvents > 0) {
+                mWakeLockQueue->write(&numWakeupEvents);
+                mWakeLockQueueFlag->wake(static_cast<uint32_t>(WakeLockQueueFlagBits::DATA_WRITTEN));
+            }
+        }
+    }
+
+    EventMessageQueue* mEventQueue;
+    WakeLockQueue* mWakeLockQueue;
+    EventFlag* mEventQueueFlag = nullptr;
+    EventFlag* mWakeLockQueueFlag = nullptr;
+    std::thread mThread;
+    std::atomic_bool mRunning = false;
+    std::atomic<uint64_t> mNumEventsRead = 0;
+    std::vector<int64_t> mLatenciesNs;
+    std::set<int32_t> mWakeUpSensorHandles;
+};
+
+/**
+ * A HalProxy wired to synthetic subhals, optionally a subhal replaying a trace, and a simulated
+ * framework.
+ */
+class MultiHalRig {
+  public:
+    explicit MultiHalRig(const BenchmarkConfig& config,
+                         std::unique_ptr<ReplaySubHal> replaySubHal = nullptr)
+        : mEventQueue(std::make_unique<EventMessageQueue>(kEventQueueSize, true)),
+          mWakeLockQueue(std::make_unique<WakeLockQueue>(kWakeLockQueueSize, true)),
+          mReader(mEventQueue.get(), mWakeLockQueue.get()),
+          mReplaySubHal(std::move(replaySubHal)) {
+        std::vector<ISensorsSubHalV2_0*> subHalsV2_0;
+        std::vector<ISensorsSubHalV2_1*> subHalsV2_1;
+        for (size_t i = 0; i < config.numSubHals; i++) {
+            mSubHals.push_back(std::make_unique<SyntheticSubHal>(i, config));
+            subHalsV2_1.push_back(mSubHals.back().get());
+        }
+        if (mReplaySubHal != nullptr) {
+            subHalsV2_1.push_back(mReplaySubHal.get());
+        }
+        mHalProxy = std::make_unique<HalProxy>(subHalsV2_0, subHalsV2_1);
+        mHalProxy->initialize_2_1(*mEventQueue->getDesc(), *mWakeLockQueue->getDesc(),
+                                  new NoOpSensorsCallback());
+
+        std::set<int32_t> wakeUpSensorHandles;
+        for (const auto& sensorEntry : mHalProxy->getSensors()) {
+            if ((sensorEntry.second.flags & SensorFlagBits::WAKE_UP) != 0) {
+                wakeUpSensorHandles.insert(sensorEntry.first);
+            }
+            // The replay subhal is the last one.
+            if (mReplaySubHal != nullptr &&
+                (static_cast<uint32_t>(sensorEntry.first) >> 24) == subHalsV2_1.size() - 1) {
+                mReplaySensorHandles.push_back(sensorEntry.first);
+            }
+        }
+        mReader.setWakeUpSensorHandles(std::move(wakeUpSensorHandles));
+    }
+
+    ~MultiHalRig() {
+        stop();
+        // The proxy holds raw pointers to the subhals so it has to go first.
+        mHalProxy.reset();
+    }
+
+    void start() {
+        mReader.start();
+        for (auto& subHal : mSubHals) {
+            subHal->start();
+        }
+        for (int32_t sensorHandle : mReplaySensorHandles) {
+            mHalProxy->activate(sensorHandle, true /* enabled */);
+        }
+    }
+
+    void stop() {
+        for (auto& subHal : mSubHals) {
+            subHal->stop();
+        }
+        for (int32_t sensorHandle : mReplaySensorHandles) {
+            mHalProxy->activate(sensorHandle, false /* enabled */);
+        }
+        mReader.stop();
+    }
+
+    uint64_t getNumEventsPosted() const {
+        uint64_t numEventsPosted = 0;
+        for (const auto& subHal : mSubHals) {
+            numEventsPosted += subHal->getNumEventsPosted();
+        }
+        if (mReplaySubHal != nullptr) {
+            numEventsPosted += mReplaySubHal->getNumEventsPosted();
+        }
+        return numEventsPosted;
+    }
+
+    uint64_t getNumSensorsChurned() const {
+        uint64_t numSensorsChurned = 0;
+        for (const auto& subHal : mSubHals) {
+            numSensorsChurned += subHal->getNumSensorsChurned();
+        }
+        return numSensorsChurned;
+    }
+
+    //! Only valid once the rig is stopped.
+    std::vector<int64_t> getChurnLatenciesNs() {
+        std::vector<int64_t> latenciesNs;
+        for (auto& subHal : mSubHals) {
+            std::vector<int64_t>& subHalLatenciesNs = subHal->getChurnLatenciesNs();
+            latenciesNs.insert(latenciesNs.end(), subHalLatenciesNs.begin(),
+                               subHalLatenciesNs.end());
+        }
+        return latenciesNs;
+    }
+
+    FrameworkReader& getReader() { return mReader; }
+
+    HalProxy& getHalProxy() { return *mHalProxy; }
+
+  private:
+    std::unique_ptr<EventMessageQueue> mEventQueue;
+    std::unique_ptr<WakeLockQueue> mWakeLockQueue;
+    FrameworkReader mReader;
+    std::vector<std::unique_ptr<SyntheticSubHal>> mSubHals;
+    std::unique_ptr<ReplaySubHal> mReplaySubHal;
+    std::vector<int32_t> mReplaySensorHandles;
+    std::unique_ptr<HalProxy> mHalProxy;
+};
+
+void BM_HalProxyPostToRead(benchmark::State& state) {
+    BenchmarkConfig config = {
+            .numSubHals = static_cast<size_t>(state.range(0)),
+            .batchSize = static_cast<size_t>(state.range(1)),
+            .wakeupPercent = static_cast<size_t>(state.range(2)),
+            .rateHz = static_cast<size_t>(state.range(3)),
+    };
+    MultiHalRig rig(config);
+    rig.start();
+
+    uint64_t numAllocationsStart = gNumAllocations.load();
+    uint64_t numEventsReadStart = rig.getReader().getNumEventsRead();
+    int64_t startNs = ::android::elapsedRealtimeNano();
+    for (auto _ : state) {
+        std::this_thread::sleep_for(kSampleWindow);
+    }
+    double elapsedS = (::android::elapsedRealtimeNano() - startNs) / 1e9;
+    uint64_t numEventsRead = rig.getReader().getNumEventsRead() - numEventsReadStart;
+    uint64_t numAllocations = gNumAllocations.load() - numAllocationsStart;
+    rig.stop();
+
+    FrameworkReader& reader = rig.getReader();
+    state.counters["events_per_s"] = numEventsRead / elapsedS;
+    state.counters["p50_us"] = reader.getLatencyPercentileNs(0.5) / 1e3;
+    state.counters["p99_us"] = reader.getLatencyPercentileNs(0.99) / 1e3;
+    state.counters["p999_us"] = reader.getLatencyPercentileNs(0.999) / 1e3;
+    state.counters["allocs_per_event"] =
+            numEventsRead == 0 ? 0.0 : static_cast<double>(numAllocations) / numEventsRead;
+    state.counters["pending_hwm"] = rig.getHalProxy().getMostEventsObservedPendingWriteEventsQueue();
+    state.counters["events_lost"] = rig.getNumEventsPosted() - reader.getNumEventsRead();
+}
+
+BENCHMARK(BM_HalProxyPostToRead)
+        ->ArgNames({"subhals", "batch", "wakeup%", "rate_hz"})
+        // Typical: a couple of subhals streaming at 200Hz with a few wakeup events.
+        ->Args({1, 1, 0, 200})
+        ->Args({2, 1, 5, 200})
+        // Game rotation vector and gyro at max rate.
+        ->Args({1, 4, 0, 1600})
+        ->Args({4, 4, 0, 1600})
+        // FIFO flushes after screen on.
+        ->Args({1, 64, 0, 50000})
+        ->Args({4, 64, 10, 50000})
+        // Saturation.
+        ->Args({1, 64, 0, 0})
+        ->Args({4, 16, 10, 0})
+        ->Iterations(20)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+/**
+ * The post to read cost as the number of subhals grows to what the handles have room for, each
+ * subhal streaming at a typical rate. The per subhal threads dominate on small hosts, so compare
+ * runs on the same machine.
+ */
+void BM_HalProxySubHalScaling(benchmark::State& state) {
+    BM_HalProxyPostToRead(state);
+}
+
+BENCHMARK(BM_HalProxySubHalScaling)
+        ->ArgNames({"subhals", "batch", "wakeup%", "rate_hz"})
+        ->Args({1, 1, 5, 200})
+        ->Args({16, 1, 5, 200})
+        ->Args({64, 1, 5, 200})
+        ->Args({128, 1, 5, 200})
+        ->Args({255, 1, 5, 200})
+        // Every subhal flushing a FIFO at once.
+        ->Args({64, 16, 5, 1600})
+        ->Args({255, 16, 5, 1600})
+        ->Iterations(20)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+/**
+ * Dynamic sensors connected and disconnected by every subhal while they post, which contends with
+ * the event path in the sensor registry and for the dynamic sensors mutex.
+ */
+void BM_HalProxyDynamicSensorChurn(benchmark::State& state) {
+    BenchmarkConfig config = {
+            .numSubHals = static_cast<size_t>(state.range(0)),
+            .batchSize = 1,
+            .wakeupPercent = 5,
+            .rateHz = 200,
+            .numDynamicSensors = static_cast<size_t>(state.range(1)),
+            .churnHz = static_cast<size_t>(state.range(2)),
+    };
+    MultiHalRig rig(config);
+    rig.start();
+
+    uint64_t numEventsReadStart = rig.getReader().getNumEventsRead();
+    uint64_t numSensorsChurnedStart = rig.getNumSensorsChurned();
+    int64_t startNs = ::android::elapsedRealtimeNano();
+    for (auto _ : state) {
+        std::this_thread::sleep_for(kSampleWindow);
+    }
+    double elapsedS = (::android::elapsedRealtimeNano() - startNs) / 1e9;
+    uint64_t numEventsRead = rig.getReader().getNumEventsRead() - numEventsReadStart;
+    uint64_t numSensorsChurned = rig.getNumSensorsChurned() - numSensorsChurnedStart;
+    rig.stop();
+
+    FrameworkReader& reader = rig.getReader();
+    std::vector<int64_t> churnLatenciesNs = rig.getChurnLatenciesNs();
+    state.counters["dynamic_sensors"] = config.numSubHals * config.numDynamicSensors;
+    state.counters["events_per_s"] = numEventsRead / elapsedS;
+    state.counters["p50_us"] = reader.getLatencyPercentileNs(0.5) / 1e3;
+    state.counters["p99_us"] = reader.getLatencyPercentileNs(0.99) / 1e3;
+    state.counters["p999_us"] = reader.getLatencyPercentileNs(0.999) / 1e3;
+    state.counters["churn_per_s"] = numSensorsChurned / elapsedS;
+    state.counters["churn_p50_us"] = getPercentileNs(churnLatenciesNs, 0.5) / 1e3;
+    state.counters["churn_p99_us"] = getPercentileNs(churnLatenciesNs, 0.99) / 1e3;
+}
+
+BENCHMARK(BM_HalProxyDynamicSensorChurn)
+        ->ArgNames({"subhals", "dynamic", "churn_hz"})
+        // Thousands of dynamic sensors, held by few or many subhals.
+        ->Args({1, 4096, 0})
+        ->Args({4, 1024, 100})
+        ->Args({16, 256, 100})
+        ->Args({255, 16, 10})
+        // Heavy churn.
+        ->Args({16, 256, 1000})
+        ->Args({255, 16, 100})
+        ->Iterations(20)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+enum class PostPath : int64_t {
+    //! 2.1 events.
+    kV2_1,
+    //! 2.0 events, converted in bulk into the post buffer.
+    kV2_0,
+    //! 2.0 events, converted event by event into new vectors before being posted as 2.1 events.
+    kV2_0PerEvent,
+};
+
+/**
+ * The cost of a post to the callback of a subhal, on the thread of the subhal, depending on how
+ * the events are converted. The post includes the write to the event FMQ, which the simulated
+ * framework drains.
+ */
+void BM_HalProxyCallbackPost(benchmark::State& state) {
+    PostPath path = static_cast<PostPath>(state.range(0));
+    size_t batchSize = static_cast<size_t>(state.range(1));
+    // The subhal isn't started, its sensors are posted to from the benchmark thread.
+    BenchmarkConfig config = {
+            .numSubHals = 1,
+            .batchSize = batchSize,
+            .wakeupPercent = 0,
+            .rateHz = 0,
+    };
+    MultiHalRig rig(config);
+    rig.getReader().start();
+    HalProxy& halProxy = rig.getHalProxy();
+    sp<HalProxyCallbackV2_0> callbackV2_0 =
+            new HalProxyCallbackV2_0(&halProxy, &halProxy, 0 /* subHalIndex */);
+    sp<HalProxyCallbackV2_1> callbackV2_1 =
+            new HalProxyCallbackV2_1(&halProxy, &halProxy, 0 /* subHalIndex */);
+
+    std::vector<Event> events(batchSize);
+    std::vector<::android::hardware::sensors::V1_0::Event> eventsV2_0(batchSize);
+    for (auto _ : state) {
+        int64_t now = ::android::elapsedRealtimeNano();
+        if (path == PostPath::kV2_1) {
+            for (Event& event : events) {
+                event.timestamp = now;
+                event.sensorHandle = kContinuousSensorHandle;
+                event.sensorType = SensorType::ACCELEROMETER;
+            }
+            callbackV2_1->postEvents(events, callbackV2_1->createScopedWakelock(false));
+            continue;
+        }
+        for (auto& event : eventsV2_0) {
+            event.timestamp = now;
+            event.sensorHandle = kContinuousSensorHandle;
+            event.sensorType = ::android::hardware::sensors::V1_0::SensorType::ACCELEROMETER;
+        }
+        if (path == PostPath::kV2_0) {
+            callbackV2_0->postEvents(eventsV2_0, callbackV2_0->createScopedWakelock(false));
+        } else {
+            callbackV2_1->postEvents(convertToNewEvents(eventsV2_0),
+                                     callbackV2_1->createScopedWakelock(false));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batchSize);
+    rig.stop();
+}
+
+BENCHMARK(BM_HalProxyCallbackPost)
+        ->ArgNames({"path", "batch"})
+        // Every path of PostPath, from single events to FIFO flushes.
+        ->ArgsProduct({{0, 1, 2}, {1, 16, 64, 256}});
+
+/**
+ * Replays the trace at $HALPROXY_BENCHMARK_TRACE, recorded with the --record debug argument of the
+ * proxy, on top of the synthetic load.
+ */
+void BM_HalProxyReplay(benchmark::State& state) {
+    const char* tracePath = getenv("HALPROXY_BENCHMARK_TRACE");
+    if (tracePath == nullptr) {
+        state.SkipWithError("HALPROXY_BENCHMARK_TRACE isn't set");
+        return;
+    }
+    BenchmarkConfig config = {
+            .numSubHals = static_cast<size_t>(state.range(1)),
+            .batchSize = 1,
+            .wakeupPercent = 0,
+            .rateHz = 200,
+    };
+    auto replaySubHal = std::make_unique<ReplaySubHal>(
+            tracePath, static_cast<double>(state.range(0)), true /* loop */);
+    MultiHalRig rig(config, std::move(replaySubHal));
+    rig.start();
+
+    uint64_t numEventsReadStart = rig.getReader().getNumEventsRead();
+    int64_t startNs = ::android::elapsedRealtimeNano();
+    for (auto _ : state) {
+        std::this_thread::sleep_for(kSampleWindow);
+    }
+    double elapsedS = (::android::elapsedRealtimeNano() - startNs) / 1e9;
+    uint64_t numEventsRead = rig.getReader().getNumEventsRead() - numEventsReadStart;
+    rig.stop();
+
+    FrameworkReader& reader = rig.getReader();
+    state.counters["events_per_s"] = numEventsRead / elapsedS;
+    state.counters["p50_us"] = reader.getLatencyPercentileNs(0.5) / 1e3;
+    state.counters["p99_us"] = reader.getLatencyPercentileNs(0.99) / 1e3;
+    state.counters["p999_us"] = reader.getLatencyPercentileNs(0.999) / 1e3;
+    state.counters["pending_hwm"] = rig.getHalProxy().getMostEventsObservedPendingWriteEventsQueue();
+}
+
+BENCHMARK(BM_HalProxyReplay)
+        ->ArgNames({"speed", "subhals"})
+        // The trace alone, as recorded, then accelerated and as fast as possible.
+        ->Args({1, 0})
+        ->Args({10, 0})
+        ->Args({0, 0})
+        // The trace with synthetic background load.
+        ->Args({1, 4})
+        ->Iterations(20)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
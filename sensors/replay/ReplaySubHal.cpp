@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ReplaySubHal.h"
+
+#include <android-base/file.h>
+#include <android-base/parsedouble.h>
+#include <android-base/properties.h>
+#include <log/log.h>
+#include <utils/SystemClock.h>
+
+#include <chrono>
+#include <sstream>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+using ::android::hardware::sensors::V1_0::MetaDataEventType;
+using ::android::hardware::sensors::V1_0::SensorFlagBits;
+
+//! The properties configuring the replay, read when the subhal is loaded.
+static const char* kTraceProperty = "vendor.sensors.replay.trace";
+static const char* kSpeedProperty = "vendor.sensors.replay.speed";
+static const char* kLoopProperty = "vendor.sensors.replay.loop";
+
+//! The trace replayed by default, where the HalProxy records.
+static const char* kDefaultTraceFile = "/data/vendor/sensors/events.trace";
+
+ReplaySubHal::ReplaySubHal(const std::string& tracePath, double speed, bool loop)
+    : mTracePath(tracePath), mSpeed(speed), mLoop(loop) {
+    if (!mReader.open(tracePath)) {
+        ALOGE("Failed to read event trace %s, replaying no sensor", tracePath.c_str());
+        return;
+    }
+
+    EventTraceRecord record;
+    while (mReader.next(&record)) {
+        if (record.type != EventTraceRecord::kSensor ||
+            mSensorIndices.count(record.sensor.sensorHandle) > 0) {
+            continue;
+        }
+        auto sensor = std::make_unique<ReplayedSensor>();
+        sensor->info = record.sensor;
+        sensor->info.sensorHandle = static_cast<int32_t>(mSensors.size()) + 1;
+        // The proxy emulated the direct report and batched the sensors without a FIFO, it does so
+        // again for the replayed ones. Dynamic sensors are replayed as static ones.
+        sensor->info.flags &= ~(SensorFlagBits::MASK_DIRECT_REPORT |
+                                SensorFlagBits::MASK_DIRECT_CHANNEL |
+                                SensorFlagBits::DYNAMIC_SENSOR);
+        sensor->info.fifoReservedEventCount = 0;
+        sensor->info.fifoMaxEventCount = 0;
+        sensor->wakeUp = (sensor->info.flags & SensorFlagBits::WAKE_UP) != 0;
+        mSensorIndices[record.sensor.sensorHandle] = mSensors.size();
+        mSensors.push_back(std::move(sensor));
+    }
+    ALOGI("Replaying %zu sensors from %s", mSensors.size(), tracePath.c_str());
+}
+
+ReplaySubHal::~ReplaySubHal() {
+    stopReplay();
+}
+
+Return<void> ReplaySubHal::getSensorsList_2_1(getSensorsList_2_1_cb _hidl_cb) {
+    std::vector<SensorInfo> sensors;
+    for (const auto& sensor : mSensors) {
+        sensors.push_back(sensor->info);
+    }
+    _hidl_cb(sensors);
+    return Void();
+}
+
+Return<Result> ReplaySubHal::injectSensorData_2_1(const Event& /* event */) {
+    return Result::INVALID_OPERATION;
+}
+
+Return<void> ReplaySubHal::getSensorsList(getSensorsList_cb /* _hidl_cb */) {
+    // Only used for 2.0 subhals.
+    return Void();
+}
+
+Return<Result> ReplaySubHal::setOperationMode(OperationMode mode) {
+    return mode == OperationMode::NORMAL ? Result::OK : Result::BAD_VALUE;
+}
+
+Return<Result> ReplaySubHal::activate(int32_t sensorHandle, bool enabled) {
+    ReplayedSensor* sensor = findSensor(sensorHandle);
+    if (sensor == nullptr) {
+        return Result::BAD_VALUE;
+    }
+    sensor->enabled.store(enabled);
+    return Result::OK;
+}
+
+Return<Result> ReplaySubHal::batch(int32_t sensorHandle, int64_t /* samplingPeriodNs */,
+                                   int64_t /* maxReportLatencyNs */) {
+    // Events are replayed at the recorded rate whatever the framework asks for.
+    return findSensor(sensorHandle) == nullptr ? Result::BAD_VALUE : Result::OK;
+}
+
+Return<Result> ReplaySubHal::flush(int32_t sensorHandle) {
+    ReplayedSensor* sensor = findSensor(sensorHandle);
+    if (sensor == nullptr || !sensor->enabled.load() || mCallback == nullptr) {
+        return Result::BAD_VALUE;
+    }
+    Event event = {};
+    event.sensorHandle = sensorHandle;
+    event.sensorType = SensorType::META_DATA;
+    event.u.meta.what = MetaDataEventType::META_DATA_FLUSH_COMPLETE;
+    mCallback->postEvents({event}, mCallback->createScopedWakelock(sensor->wakeUp));
+    return Result::OK;
+}
+
+Return<Result> ReplaySubHal::injectSensorData(const V1_0::Event& /* event */) {
+    return Result::INVALID_OPERATION;
+}
+
+Return<void> ReplaySubHal::registerDirectChannel(const SharedMemInfo& /* mem */,
+                                                 registerDirectChannel_cb _hidl_cb) {
+    _hidl_cb(Result::INVALID_OPERATION, -1 /* channelHandle */);
+    return Void();
+}
+
+Return<Result> ReplaySubHal::unregisterDirectChannel(int32_t /* channelHandle */) {
+    return Result::INVALID_OPERATION;
+}
+
+Return<void> ReplaySubHal::configDirectReport(int32_t /* sensorHandle */,
+                                              int32_t /* channelHandle */, RateLevel /* rate */,
+                                              configDirectReport_cb _hidl_cb) {
+    _hidl_cb(Result::INVALID_OPERATION, -1 /* reportToken */);
+    return Void();
+}
+
+Return<void> ReplaySubHal::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& /* args */) {
+    if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+        return Void();
+    }
+    std::ostringstream stream;
+    stream << "  Trace: " << mTracePath << ", speed " << mSpeed << (mLoop ? ", looping" : "")
+           << std::endl;
+    stream << "  # of sensors: " << mSensors.size() << std::endl;
+    stream << "  # of events posted: " << mNumEventsPosted.load() << std::endl;
+    stream << "  # of times the trace was replayed: " << mNumLoops.load() << std::endl;
+    android::base::WriteStringToFd(stream.str(), fd->data[0]);
+    return Void();
+}
+
+Return<Result> ReplaySubHal::initialize(const sp<IHalProxyCallback>& halProxyCallback) {
+    // The proxy reinitializes subhals when the framework restarts, which replays from the start.
+    stopReplay();
+    mCallback = halProxyCallback;
+    for (const auto& sensor : mSensors) {
+        sensor->enabled.store(false);
+    }
+    startReplay();
+    return Result::OK;
+}
+
+ReplaySubHal* ReplaySubHal::getInstance() {
+    // Never destroyed, so that the replay isn't torn down while the process exits.
+    static ReplaySubHal* subHal = [] {
+        double speed;
+        std::string speedValue = android::base::GetProperty(kSpeedProperty, "1");
+        if (!android::base::ParseDouble(speedValue.c_str(), &speed)) {
+            ALOGW("Invalid %s %s, replaying at the recorded speed", kSpeedProperty,
+                  speedValue.c_str());
+            speed = 1.0;
+        }
+        return new ReplaySubHal(android::base::GetProperty(kTraceProperty, kDefaultTraceFile),
+                                speed, android::base::GetBoolProperty(kLoopProperty, false));
+    }();
+    return subHal;
+}
+
+ReplaySubHal::ReplayedSensor* ReplaySubHal::findSensor(int32_t sensorHandle) {
+    if (sensorHandle < 1 || static_cast<size_t>(sensorHandle) > mSensors.size()) {
+        return nullptr;
+    }
+    return mSensors[sensorHandle - 1].get();
+}
+
+void ReplaySubHal::startReplay() {
+    if (mSensors.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mReplayMutex);
+        mReplayRunning = true;
+    }
+    mReplayThread = std::thread([this] { replay(); });
+}
+
+void ReplaySubHal::stopReplay() {
+    {
+        std::lock_guard<std::mutex> lock(mReplayMutex);
+        mReplayRunning = false;
+    }
+    mReplayCV.notify_all();
+    if (mReplayThread.joinable()) {
+        mReplayThread.join();
+    }
+}
+
+void ReplaySubHal::replay() {
+    EventTraceRecord record;
+    std::vector<Event> events;
+    do {
+        mReader.rewind();
+        int64_t traceStartNs = -1;
+        int64_t replayStartNs = 0;
+        while (mReader.next(&record)) {
+            if (record.type != EventTraceRecord::kEvents) {
+                continue;
+            }
+            if (traceStartNs < 0) {
+                traceStartNs = record.timeNs;
+                replayStartNs = ::android::elapsedRealtimeNano();
+            }
+            if (mSpeed > 0) {
+                int64_t postTimeNs =
+                        replayStartNs +
+                        static_cast<int64_t>((record.timeNs - traceStartNs) / mSpeed);
+                int64_t waitNs = postTimeNs - ::android::elapsedRealtimeNano();
+                std::unique_lock<std::mutex> lock(mReplayMutex);
+                if (waitNs > 0) {
+                    mReplayCV.wait_for(lock, std::chrono::nanoseconds(waitNs),
+                                       [this] { return !mReplayRunning; });
+                }
+                if (!mReplayRunning) return;
+            } else {
+                std::lock_guard<std::mutex> lock(mReplayMutex);
+                if (!mReplayRunning) return;
+            }
+
+            int64_t nowNs = ::android::elapsedRealtimeNano();
+            bool wakeUp = false;
+            events.clear();
+            for (const Event& recordedEvent : record.events) {
+                auto iter = mSensorIndices.find(recordedEvent.sensorHandle);
+                if (recordedEvent.sensorType == SensorType::META_DATA ||
+                    iter == mSensorIndices.end()) {
+                    continue;
+                }
+                const ReplayedSensor& sensor = *mSensors[iter->second];
+                if (!sensor.enabled.load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                Event event = recordedEvent;
+                event.sensorHandle = sensor.info.sensorHandle;
+                event.timestamp = nowNs - (record.timeNs - recordedEvent.timestamp);
+                wakeUp |= sensor.wakeUp;
+                events.push_back(event);
+            }
+            if (!events.empty()) {
+                mCallback->postEvents(events, mCallback->createScopedWakelock(wakeUp));
+                mNumEventsPosted.fetch_add(events.size());
+            }
+        }
+        mNumLoops.fetch_add(1);
+        if (traceStartNs < 0) {
+            ALOGW("No events to replay in %s", mTracePath.c_str());
+            return;
+        }
+    } while (mLoop);
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
+
+using ::android::hardware::sensors::V2_1::implementation::ISensorsSubHal;
+using ::android::hardware::sensors::V2_1::implementation::ReplaySubHal;
+
+ISensorsSubHal* sensorsHalGetSubHal_2_1(uint32_t* version) {
+    *version = SUB_HAL_2_1_VERSION;
+    return ReplaySubHal::getInstance();
+}
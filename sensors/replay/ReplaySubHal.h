@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2026 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "EventTrace.h"
+#include "V2_1/SubHal.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace sensors {
+namespace V2_1 {
+namespace implementation {
+
+/**
+ * Subhal re-emitting the events of a trace recorded by the HalProxy.
+ *
+ * The subhal reports the sensors of the trace, under handles of its own, without direct channel
+ * support or a hardware FIFO. Once initialized it posts the recorded events with the grouping of
+ * the original posts, at the original timing scaled by a speed factor, and shifts their timestamps
+ * so that their latency to the post is the recorded one. Only the events of the sensors the
+ * framework enabled are posted. Flush complete events aren't replayed, the subhal answers flushes
+ * itself. The recorded calls are left for offline analysis.
+ *
+ * Loaded by listing sensors.camellia-replay.so in hals.conf, and configured with the
+ * vendor.sensors.replay.* properties.
+ */
+class ReplaySubHal : public ISensorsSubHal {
+  public:
+    using Event = ::android::hardware::sensors::V2_1::Event;
+    using OperationMode = ::android::hardware::sensors::V1_0::OperationMode;
+    using RateLevel = ::android::hardware::sensors::V1_0::RateLevel;
+    using Result = ::android::hardware::sensors::V1_0::Result;
+    using SensorInfo = ::android::hardware::sensors::V2_1::SensorInfo;
+    using SharedMemInfo = ::android::hardware::sensors::V1_0::SharedMemInfo;
+
+    /**
+     * @param tracePath The path of the trace.
+     * @param speed How much faster than recorded the trace is replayed, 0 or less to post as fast
+     *    as the proxy takes the events.
+     * @param loop Whether to start over at the end of the trace.
+     */
+    ReplaySubHal(const std::string& tracePath, double speed, bool loop);
+    ~ReplaySubHal();
+
+    // Methods from ::android::hardware::sensors::V2_1::ISensors follow.
+    Return<void> getSensorsList_2_1(getSensorsList_2_1_cb _hidl_cb) override;
+
+    Return<Result> injectSensorData_2_1(const Event& event) override;
+
+    // Methods from ::android::hardware::sensors::V2_0::ISensors follow.
+    Return<void> getSensorsList(getSensorsList_cb _hidl_cb) override;
+
+    Return<Result> setOperationMode(OperationMode mode) override;
+
+    Return<Result> activate(int32_t sensorHandle, bool enabled) override;
+
+    Return<Result> batch(int32_t sensorHandle, int64_t samplingPeriodNs,
+                         int64_t maxReportLatencyNs) override;
+
+    Return<Result> flush(int32_t sensorHandle) override;
+
+    Return<Result> injectSensorData(const V1_0::Event& event) override;
+
+    Return<void> registerDirectChannel(const SharedMemInfo& mem,
+                                       registerDirectChannel_cb _hidl_cb) override;
+
+    Return<Result> unregisterDirectChannel(int32_t channelHandle) override;
+
+    Return<void> configDirectReport(int32_t sensorHandle, int32_t channelHandle, RateLevel rate,
+                                    configDirectReport_cb _hidl_cb) override;
+
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& args) override;
+
+    // Methods from ::android::hardware::sensors::V2_1::implementation::ISensorsSubHal follow.
+    const std::string getName() override { return "ReplaySubHal"; }
+
+    Return<Result> initialize(const sp<IHalProxyCallback>& halProxyCallback) override;
+
+    /**
+     * @return The subhal configured from the vendor.sensors.replay.* properties, created on first
+     *    use.
+     */
+    static ReplaySubHal* getInstance();
+
+    //! @return The number of events posted since the subhal was created.
+    uint64_t getNumEventsPosted() const { return mNumEventsPosted.load(); }
+
+  private:
+    struct ReplayedSensor {
+        SensorInfo info;
+        bool wakeUp;
+        std::atomic_bool enabled = false;
+    };
+
+    //! @return The sensor with that subhal handle, nullptr if there is none.
+    ReplayedSensor* findSensor(int32_t sensorHandle);
+
+    void startReplay();
+    void stopReplay();
+
+    //! Replay the trace until it ends or the replay is stopped.
+    void replay();
+
+    const std::string mTracePath;
+    const double mSpeed;
+    const bool mLoop;
+
+    EventTraceReader mReader;
+
+    //! The sensors of the trace, the subhal handle of each being its index plus one.
+    std::vector<std::unique_ptr<ReplayedSensor>> mSensors;
+
+    //! The index in mSensors of the sensors, by their handle in the trace.
+    std::map<int32_t, size_t> mSensorIndices;
+
+    sp<IHalProxyCallback> mCallback;
+
+    std::thread mReplayThread;
+    std::mutex mReplayMutex;
+    std::condition_variable mReplayCV;
+    bool mReplayRunning = false;
+
+    std::atomic<uint64_t> mNumEventsPosted = 0;
+    std::atomic<uint64_t> mNumLoops = 0;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace sensors
+}  // namespace hardware
+}  // namespace android
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <android-base/properties.h>
 #include <android/hardware/sensors/2.1/ISensors.h>
 #include <hidl/HidlTransportSupport.h>
 #include <log/log.h>
@@ -25,8 +26,16 @@ using android::hardware::joinRpcThreadpool;
 using android::hardware::sensors::V2_1::ISensors;
 using android::hardware::sensors::V2_1::implementation::HalProxyV2_1;
 
+//! The number of binder threads serving the framework, including the main thread.
+static const char* kBinderThreadsProperty = "ro.vendor.sensors.multihal.binder_threads";
+static constexpr size_t kDefaultBinderThreads = 4;
+
 int main(int /* argc */, char** /* argv */) {
-    configureRpcThreadpool(1, true);
+    // Calls to different subhals are served concurrently, the HalProxy serializes the calls to
+    // each subhal.
+    configureRpcThreadpool(android::base::GetUintProperty<size_t>(kBinderThreadsProperty,
+                                                                  kDefaultBinderThreads, 64),
+                           true /* callerWillJoin */);
 
     android::sp<ISensors> halProxy = new HalProxyV2_1();
     if (halProxy->registerAsService() != ::android::OK) {